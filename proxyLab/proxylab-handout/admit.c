@@ -0,0 +1,351 @@
+/*
+ *                     admit.c
+ *
+ * The connection count is a single atomic counter, checked on every
+ * accept without a lock. Origins are a hash table of (host, port)
+ * entries under one mutex, as in dns.c, holding the fetches in flight
+ * and a FIFO of waiters; an entry exists only while it has either.
+ * A fetch that finishes hands its slot straight to the oldest waiter,
+ * so a waiter cannot be overtaken by a fetch that arrives later.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <sys/resource.h>
+#include "admit.h"
+
+typedef struct origin_entry {
+    char *host;
+    char *port;
+    unsigned int hash;
+    int active;                   /* Fetches in flight */
+    int waiting;                  /* Fetches in the queue */
+    admit_waiter *head;           /* The queue, oldest first */
+    admit_waiter **tail;
+    struct origin_entry *next;    /* Next entry in the hash bucket */
+} origin_entry;
+
+/* A thread blocked in admit_origin */
+typedef struct thread_waiter {
+    admit_waiter w;
+    pthread_cond_t cond;
+} thread_waiter;
+
+static int max_conns = ADMIT_CONNS;
+static int origin_max = ADMIT_ORIGIN;
+static char busy[MAXLINE];        /* The 503, built by admit_init */
+static int busy_len;
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static origin_entry *buckets[ADMIT_BUCKETS];
+static admit_stats stats;         /* Counters atomic, origins under lock */
+
+static origin_entry **origin_find(char *host, char *port, unsigned int h);
+static void origin_release(origin_entry **ep);
+static void origin_dequeue(origin_entry *e, admit_waiter *w);
+static void thread_wake(void *arg);
+static int fd_cap(int conns);
+
+/*
+ * admit_init - set the connection cap and the per-origin limit, 0 for
+ *     none, and build the 503 sent to whatever is shed. The cap is
+ *     lowered to what the descriptor limit allows.
+ */
+void admit_init(int conns, int per_origin)
+{
+    char body[MAXLINE / 2];
+    int n;
+
+    max_conns = fd_cap(conns);
+    origin_max = per_origin;
+    n = snprintf(body, sizeof(body), "<html><title>Proxy Error</title>"
+                 "<body bgcolor=""ffffff"">\r\n503: Service Unavailable\r\n"
+                 "<p>The proxy is too busy to take this request; try again "
+                 "shortly\r\n<hr><em>The Proxy server</em>\r\n");
+    busy_len = snprintf(busy, sizeof(busy), "HTTP/1.0 503 Service "
+                        "Unavailable\r\nContent-type: text/html\r\n"
+                        "Content-length: %d\r\nConnection: close\r\n"
+                        "Retry-After: 1\r\n\r\n%s", n, body);
+}
+
+/*
+ * fd_cap - the connection cap conns, raising the soft RLIMIT_NOFILE to
+ *     the hard one and lowering a cap to what that leaves room for:
+ *     ADMIT_FDS_PER_CONN descriptors for each, after ADMIT_FD_RESERVE
+ *     for the rest of the proxy
+ */
+static int fd_cap(int conns)
+{
+    struct rlimit rl;
+    rlim_t room;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return conns;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        // A hard limit of RLIM_INFINITY still cannot pass nr_open.
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (!conns || rl.rlim_cur == RLIM_INFINITY)
+        return conns;
+    room = rl.rlim_cur > ADMIT_FD_RESERVE + ADMIT_FDS_PER_CONN
+        ? (rl.rlim_cur - ADMIT_FD_RESERVE) / ADMIT_FDS_PER_CONN : 1;
+    if ((rlim_t)conns <= room)
+        return conns;
+    log_warn("admit: %lu descriptors allow %lu client connections, "
+             "not %d", (unsigned long)rl.rlim_cur, (unsigned long)room,
+             conns);
+    return (int)room;
+}
+
+/*
+ * admit_conn - count a new client connection in; returns 0 if it would
+ *     go over the cap, and it must be rejected instead
+ */
+int admit_conn(void)
+{
+    if (__atomic_add_fetch(&stats.conns, 1, __ATOMIC_RELAXED) > max_conns
+        && max_conns > 0) {
+        __atomic_sub_fetch(&stats.conns, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.conns_shed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_add_fetch(&stats.conns_served, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * admit_conn_done - count an admitted client connection out
+ */
+void admit_conn_done(void)
+{
+    __atomic_sub_fetch(&stats.conns, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * admit_reject - send the 503 on fd, if its socket buffer takes it now,
+ *     without waiting for the request; the caller closes fd
+ */
+void admit_reject(int fd)
+{
+    char discard[MAXLINE];
+
+    if (send(fd, busy, busy_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        log_debug("Could not send 503 on fd %d: %s", fd, strerror(errno));
+        return;
+    }
+    // Closing with the request unread resets the connection, which can
+    // throw the 503 away before the client reads it. What has arrived
+    // is read now; the FIN tells the client not to send more.
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+}
+
+/*
+ * admit_busy_response - copy the 503 into buf, which must hold MAXLINE
+ *     bytes, and return its length
+ */
+int admit_busy_response(char *buf)
+{
+    memcpy(buf, busy, busy_len);
+    return busy_len;
+}
+
+/*
+ * admit_origin - take a slot for a fetch from host:port: ADMIT_OK if
+ *     there was one, ADMIT_SHED if the queue for it is full. Otherwise
+ *     the fetch waits. Without a waiter that is right here, for at most
+ *     ADMIT_QUEUE_TIMEOUT seconds, and ADMIT_SHED if none came free;
+ *     with one, ADMIT_QUEUED, and w->wake is called once the slot is
+ *     its to give back with admit_origin_done.
+ */
+int admit_origin(char *host, char *port, admit_waiter *w)
+{
+    unsigned int h;
+    origin_entry **ep, *e;
+    thread_waiter tw;
+    struct timespec deadline;
+    size_t hostlen, portlen;
+    int rc = ADMIT_OK;
+
+    if (origin_max == 0) {
+        __atomic_add_fetch(&stats.fetches, 1, __ATOMIC_RELAXED);
+        return ADMIT_OK;
+    }
+    h = hash_origin(host, port);
+    pthread_mutex_lock(&admit_lock);
+    if ((e = *(ep = origin_find(host, port, h))) == NULL) {
+        // Host and port share one allocation with the entry's key.
+        hostlen = strlen(host) + 1;
+        portlen = strlen(port) + 1;
+        e = Calloc(1, sizeof(origin_entry));
+        e->host = Malloc(hostlen + portlen);
+        memcpy(e->host, host, hostlen);
+        e->port = e->host + hostlen;
+        memcpy(e->port, port, portlen);
+        e->hash = h;
+        e->tail = &e->head;
+        *ep = e;
+        stats.origins++;
+    }
+    if (e->active < origin_max) {
+        e->active++;
+        __atomic_add_fetch(&stats.fetches, 1, __ATOMIC_RELAXED);
+    } else if (e->waiting >= ADMIT_QUEUE) {
+        __atomic_add_fetch(&stats.fetches_shed, 1, __ATOMIC_RELAXED);
+        rc = ADMIT_SHED;
+    } else if (w) {
+        w->granted = 0;
+        w->next = NULL;
+        *e->tail = w;
+        e->tail = &w->next;
+        e->waiting++;
+        rc = ADMIT_QUEUED;
+    } else {
+        tw.w.wake = thread_wake;
+        tw.w.arg = &tw;
+        tw.w.granted = 0;
+        tw.w.next = NULL;
+        pthread_cond_init(&tw.cond, NULL);
+        *e->tail = &tw.w;
+        e->tail = &tw.w.next;
+        e->waiting++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ADMIT_QUEUE_TIMEOUT;
+        while (!tw.w.granted
+               && pthread_cond_timedwait(&tw.cond, &admit_lock,
+                                         &deadline) != ETIMEDOUT)
+            ;
+        // The entry cannot go away while we are queued on it.
+        if (!tw.w.granted) {
+            origin_dequeue(e, &tw.w);
+            __atomic_add_fetch(&stats.fetches_shed, 1, __ATOMIC_RELAXED);
+            rc = ADMIT_SHED;
+        }
+        pthread_cond_destroy(&tw.cond);
+    }
+    pthread_mutex_unlock(&admit_lock);
+    return rc;
+}
+
+/*
+ * admit_origin_done - give back the slot of a fetch from host:port
+ */
+void admit_origin_done(char *host, char *port)
+{
+    origin_entry **ep;
+
+    if (origin_max == 0)
+        return;
+    pthread_mutex_lock(&admit_lock);
+    if (*(ep = origin_find(host, port, hash_origin(host, port))) != NULL)
+        origin_release(ep);
+    pthread_mutex_unlock(&admit_lock);
+}
+
+/*
+ * admit_origin_cancel - stop waiting with w, counted as shed, or give
+ *     back the slot if it was granted in the meantime
+ */
+void admit_origin_cancel(char *host, char *port, admit_waiter *w)
+{
+    origin_entry **ep;
+
+    pthread_mutex_lock(&admit_lock);
+    if (*(ep = origin_find(host, port, hash_origin(host, port))) != NULL) {
+        if (w->granted)
+            origin_release(ep);
+        else {
+            origin_dequeue(*ep, w);
+            __atomic_add_fetch(&stats.fetches_shed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&admit_lock);
+}
+
+/*
+ * admit_get_stats - a copy of the counters
+ */
+void admit_get_stats(admit_stats *st)
+{
+    st->conns = __atomic_load_n(&stats.conns, __ATOMIC_RELAXED);
+    st->conns_served = __atomic_load_n(&stats.conns_served,
+                                       __ATOMIC_RELAXED);
+    st->conns_shed = __atomic_load_n(&stats.conns_shed, __ATOMIC_RELAXED);
+    st->fetches = __atomic_load_n(&stats.fetches, __ATOMIC_RELAXED);
+    st->queued = __atomic_load_n(&stats.queued, __ATOMIC_RELAXED);
+    st->fetches_shed = __atomic_load_n(&stats.fetches_shed,
+                                       __ATOMIC_RELAXED);
+    pthread_mutex_lock(&admit_lock);
+    st->origins = stats.origins;
+    pthread_mutex_unlock(&admit_lock);
+}
+
+/*
+ * origin_find - the link that points to the entry for host:port, or to
+ *     the end of its bucket. Call with admit_lock held.
+ */
+static origin_entry **origin_find(char *host, char *port, unsigned int h)
+{
+    origin_entry **ep, *e;
+
+    for (ep = &buckets[h % ADMIT_BUCKETS]; (e = *ep) != NULL; ep = &e->next)
+        if (e->hash == h && !strcmp(e->host, host)
+            && !strcmp(e->port, port))
+            break;
+    return ep;
+}
+
+/*
+ * origin_release - pass the slot of a finished fetch to the oldest
+ *     waiter, or give it up, dropping the entry once it is idle. Call
+ *     with admit_lock held.
+ */
+static void origin_release(origin_entry **ep)
+{
+    origin_entry *e = *ep;
+    admit_waiter *w;
+
+    if ((w = e->head) != NULL) {
+        origin_dequeue(e, w);
+        __atomic_add_fetch(&stats.queued, 1, __ATOMIC_RELAXED);
+        // An event loop reads granted without the lock.
+        __atomic_store_n(&w->granted, 1, __ATOMIC_RELEASE);
+        w->wake(w->arg);
+        return;
+    }
+    if (--e->active > 0)
+        return;
+    *ep = e->next;
+    stats.origins--;
+    Free(e->host);
+    Free(e);
+}
+
+/*
+ * origin_dequeue - take w out of the queue of e. Call with admit_lock
+ *     held.
+ */
+static void origin_dequeue(origin_entry *e, admit_waiter *w)
+{
+    admit_waiter **wp;
+
+    for (wp = &e->head; *wp && *wp != w; wp = &(*wp)->next)
+        ;
+    if (*wp == NULL)
+        return;
+    if ((*wp = w->next) == NULL)
+        e->tail = wp;
+    e->waiting--;
+}
+
+/*
+ * thread_wake - waiter callback of a thread blocked in admit_origin;
+ *     called with admit_lock held
+ */
+static void thread_wake(void *arg)
+{
+    pthread_cond_signal(&((thread_waiter *)arg)->cond);
+}
@@ -0,0 +1,70 @@
+/*
+ *                     admit.h
+ *
+ * Admission control. Past a certain load, taking on more work only
+ * makes every request slower, so the proxy sheds what it cannot serve
+ * in time instead, with a 503 that is built once at startup:
+ *
+ *   - at most a global cap of client connections are in the proxy at
+ *     once; one accepted past it is answered and closed at once. The
+ *     cap is kept below what RLIMIT_NOFILE leaves room for, so that a
+ *     connection it admits can also open its origin and splice pipe;
+ *   - at most a number of fetches per origin (host, port) are in flight
+ *     at once; a fetch past it waits in a short queue for one of them
+ *     to finish, and is shed if the queue is full or the wait too long.
+ *
+ * The thread modes wait for an origin on a condition variable. The
+ * event-driven modes pass a waiter, which is called back from the
+ * thread that hands it the slot, as fill waiters are.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include "proxy.h"
+
+#define ADMIT_CONNS         4096 /* Default cap on client connections */
+#define ADMIT_ORIGIN        64   /* Default fetches in flight per origin */
+#define ADMIT_QUEUE         32   /* Fetches that may wait for an origin */
+#define ADMIT_QUEUE_TIMEOUT 5    /* Seconds a fetch may wait */
+#define ADMIT_BUCKETS       256  /* Hash buckets of the origin table */
+#define ADMIT_FDS_PER_CONN  4    /* Client, origin and a splice pipe */
+#define ADMIT_FD_RESERVE    128  /* Listeners, event loops, idle origins */
+
+/* What admit_origin decided */
+#define ADMIT_OK     0  /* The fetch may go ahead */
+#define ADMIT_QUEUED 1  /* It waits; the waiter is called once it may */
+#define ADMIT_SHED   2  /* It must be answered with a 503 */
+
+/* A fetch waiting for its origin, in an event-driven mode */
+typedef struct admit_waiter {
+    void (*wake)(void *arg);      /* Called once the fetch may go ahead */
+    void *arg;
+    int granted;                  /* Set before wake is called */
+    struct admit_waiter *next;
+} admit_waiter;
+
+typedef struct admit_stats {
+    int conns;                    /* Client connections in the proxy now */
+    unsigned long conns_served;   /* Connections admitted */
+    unsigned long conns_shed;     /* ... and turned away at the cap */
+    unsigned long fetches;        /* Fetches admitted at once */
+    unsigned long queued;         /* ... after waiting */
+    unsigned long fetches_shed;   /* ... and shed */
+    int origins;                  /* Origins with fetches in flight now */
+} admit_stats;
+
+void admit_init(int max_conns, int origin_max);
+int admit_conn(void);
+void admit_conn_done(void);
+void admit_reject(int fd);
+int admit_busy_response(char *buf);
+int admit_origin(char *host, char *port, admit_waiter *w);
+void admit_origin_done(char *host, char *port);
+void admit_origin_cancel(char *host, char *port, admit_waiter *w);
+void admit_get_stats(admit_stats *st);
+
+#endif /* __ADMIT_H__ */
@@ -0,0 +1,165 @@
+/*
+ *                     arena.c
+ *
+ * A chunk is a header and the bytes carved from it; an arena keeps its
+ * chunks in a list, newest first, and carves only from the newest, so
+ * going back to a saved position is popping the chunks in front of it.
+ * Pooled chunks all have the same size, which makes any free one as
+ * good as another.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;     /* Older chunk, or next free one */
+    size_t size;                  /* Bytes that can be carved */
+} arena_chunk;
+
+#define CHUNK_HDR  ((sizeof(arena_chunk) + ARENA_ALIGN - 1) \
+                    & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HDR)
+#define POOL_SIZE  (ARENA_CHUNK - CHUNK_HDR)
+#define ROUND(n)   (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static arena_chunk *pool;         /* Free pooled chunks */
+static int pool_count;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static arena_chunk *chunk_get(size_t size);
+static void chunk_put(arena_chunk *c);
+
+/*
+ * arena_init - start an empty arena
+ */
+void arena_init(arena *a)
+{
+    a->chunk = NULL;
+    a->used = 0;
+}
+
+/*
+ * arena_alloc - n bytes, ARENA_ALIGN aligned, that last until the arena
+ *     is reset to before them
+ */
+void *arena_alloc(arena *a, size_t n)
+{
+    arena_chunk *c;
+
+    n = ROUND(n);
+    if (a->chunk && n <= a->chunk->size - a->used) {
+        a->used += n;
+        return CHUNK_DATA(a->chunk) + a->used - n;
+    }
+    // What is left of the current chunk is given up.
+    c = chunk_get(n > POOL_SIZE ? n : POOL_SIZE);
+    c->next = a->chunk;
+    a->chunk = c;
+    a->used = n;
+    return CHUNK_DATA(c);
+}
+
+/*
+ * arena_grow - make the last allocation, p of old bytes, n bytes long:
+ *     in place if its chunk has room, else by copying it; returns where
+ *     it now is
+ */
+void *arena_grow(arena *a, void *p, size_t old, size_t n)
+{
+    void *q;
+
+    if (n <= old)
+        return p;
+    if (a->chunk && (char *)p + ROUND(old) == CHUNK_DATA(a->chunk) + a->used
+        && ROUND(n) - ROUND(old) <= a->chunk->size - a->used) {
+        a->used += ROUND(n) - ROUND(old);
+        return p;
+    }
+    q = arena_alloc(a, n);
+    memcpy(q, p, old);
+    return q;
+}
+
+/*
+ * arena_save - remember where the arena stands
+ */
+void arena_save(arena *a, arena_pos *pos)
+{
+    pos->chunk = a->chunk;
+    pos->used = a->used;
+}
+
+/*
+ * arena_reset - drop everything allocated since pos was saved
+ */
+void arena_reset(arena *a, arena_pos *pos)
+{
+    arena_chunk *c;
+
+    while ((c = a->chunk) != pos->chunk) {
+        a->chunk = c->next;
+        chunk_put(c);
+    }
+    a->used = pos->used;
+}
+
+/*
+ * arena_free - drop everything in the arena
+ */
+void arena_free(arena *a)
+{
+    arena_pos empty = { NULL, 0 };
+
+    arena_reset(a, &empty);
+}
+
+/*
+ * chunk_get - a chunk of size bytes, from the free list if it is the
+ *     pooled size
+ */
+static arena_chunk *chunk_get(size_t size)
+{
+    arena_chunk *c = NULL;
+
+    if (size == POOL_SIZE) {
+        pthread_mutex_lock(&pool_lock);
+        if ((c = pool) != NULL) {
+            pool = c->next;
+            pool_count--;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (c == NULL) {
+        if ((c = malloc(CHUNK_HDR + size)) == NULL) {
+            perror("arena_alloc");
+            exit(1);
+        }
+        c->size = size;
+    }
+    return c;
+}
+
+/*
+ * chunk_put - return a chunk to the free list, or free it if it is not
+ *     the pooled size or the list is full
+ */
+static void chunk_put(arena_chunk *c)
+{
+    if (c->size == POOL_SIZE) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_count < ARENA_POOL_MAX) {
+            c->next = pool;
+            pool = c;
+            pool_count++;
+            c = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    free(c);
+}
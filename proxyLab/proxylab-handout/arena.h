@@ -0,0 +1,53 @@
+/*
+ *                     arena.h
+ *
+ * Request-scoped memory for the thread and prethread modes. The buffers
+ * a connection needs are carved out of its arena by bumping a pointer
+ * through chunks, instead of being fixed arrays on the thread's stack,
+ * so a worker runs on a small stack and a connection holds only what
+ * its requests take. arena_save and arena_reset bracket a request:
+ * everything carved after the save goes at once, and the chunks it
+ * took go back to a free list shared by all threads, for the next
+ * request or connection to reuse. Carving takes no lock; only moving
+ * chunks to and from the free list does.
+ *
+ * An allocation larger than a chunk gets a chunk of its own size, which
+ * is freed rather than kept. Running out of memory is fatal, as it is
+ * for Malloc.
+ *
+ * This file does not depend on csapp.c.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_CHUNK    (16 * 1024) /* Bytes of a pooled chunk */
+#define ARENA_ALIGN    16          /* Allocations start on this boundary */
+#define ARENA_POOL_MAX 256         /* Free chunks kept for reuse */
+
+struct arena_chunk;
+
+typedef struct arena {
+    struct arena_chunk *chunk;    /* Being carved, the older ones behind it */
+    size_t used;                  /* Bytes of it carved so far */
+} arena;
+
+/* Where an arena stood, to go back to with arena_reset */
+typedef struct arena_pos {
+    struct arena_chunk *chunk;
+    size_t used;
+} arena_pos;
+
+void arena_init(arena *a);
+void *arena_alloc(arena *a, size_t n);
+void *arena_grow(arena *a, void *p, size_t old, size_t n);
+void arena_save(arena *a, arena_pos *pos);
+void arena_reset(arena *a, arena_pos *pos);
+void arena_free(arena *a);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,122 @@
+#!/bin/bash
+#
+# bench.sh - Measures how fast the sample files of the Tiny server go
+#     through the proxy. Every file is fetched NREQS times over one
+#     client connection, once with a distinct URI per request (all cache
+#     misses, so every byte is relayed from Tiny) and once with the same
+#     URI (cache hits after the first), and once directly from Tiny for
+#     comparison. Rates are file bytes delivered per second of wall time.
+#
+#     With -c, the proxy is then loaded by that many concurrent clients
+#     (load_bench, "make load_bench") fetching home.html for SECS seconds
+#     each: cache hits over kept-alive connections, cache hits with a new
+#     connection per request, and misses over kept-alive connections.
+#
+#     usage: ./bench.sh [-n nreqs] [-c clients [-d secs]] [-p proxy]
+#                       [-- proxy args]
+#
+
+NREQS=100
+PROXY=./proxy
+CLIENTS=
+SECS=5
+FILES="home.html
+       tiny.c
+       godzilla.jpg
+       godzilla.gif
+       csapp.c
+       tiny"
+
+while getopts "n:c:d:p:" opt; do
+    case $opt in
+        n) NREQS=$OPTARG ;;
+        c) CLIENTS=$OPTARG ;;
+        d) SECS=$OPTARG ;;
+        p) PROXY=$OPTARG ;;
+        *) echo "usage: $0 [-n nreqs] [-c clients [-d secs]] [-p proxy]" \
+                "[-- proxy args]"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+HOME_DIR=`pwd`
+CONFIG=`mktemp`
+
+#
+# wait_for_port_use - spins until something listens on TCP port $1
+#
+function wait_for_port_use {
+    for i in `seq 1 50`; do
+        netstat --numeric-ports --numeric-hosts -l --protocol=tcpip \
+            | grep -qw ":${1}" && return
+        sleep 0.1
+    done
+}
+
+#
+# fetch_rate - fetch $1 NREQS times as listed in CONFIG and print MB/s
+# usage: fetch_rate <filename> [curl args]
+#
+function fetch_rate {
+    size=`stat -c %s tiny/$1`
+    shift
+    start=`date +%s.%N`
+    curl --silent --max-time 60 --config ${CONFIG} "$@"
+    end=`date +%s.%N`
+    echo "${size} ${NREQS} ${start} ${end}" \
+        | awk '{ printf "%10.2f", $1 * $2 / ($4 - $3) / 1000000 }'
+}
+
+#
+# write_config - list NREQS fetches of file $1 from Tiny in CONFIG,
+#     with distinct URIs ("/./file", "/././file", ...) if $2 is "miss"
+#
+function write_config {
+    path=""
+    : > ${CONFIG}
+    for i in `seq 1 ${NREQS}`; do
+        [ "$2" == "miss" ] && path="${path}./"
+        echo "url = \"http://localhost:${tiny_port}/${path}$1\"" >> ${CONFIG}
+        echo "output = \"/dev/null\"" >> ${CONFIG}
+    done
+}
+
+tiny_port=`./free-port.sh`
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use ${tiny_port}
+
+proxy_port=`expr ${tiny_port} + 1`
+while netstat --numeric-ports -l --protocol=tcpip | grep -qw ":${proxy_port}"
+do
+    proxy_port=`expr ${proxy_port} + 1`
+done
+${PROXY} "$@" ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use ${proxy_port}
+
+echo "${PROXY} $@, ${NREQS} requests per file, MB/s"
+printf "%-14s %10s %10s %10s\n" "file" "direct" "miss" "hit"
+for file in ${FILES}; do
+    printf "%-14s" ${file}
+    write_config ${file} hit
+    fetch_rate ${file}
+    write_config ${file} miss
+    fetch_rate ${file} --proxy http://localhost:${proxy_port}
+    write_config ${file} hit
+    fetch_rate ${file} --proxy http://localhost:${proxy_port}
+    echo
+done
+
+if [ -n "${CLIENTS}" ]; then
+    for args in "-k" "" "-k -u"; do
+        ./load_bench -c ${CLIENTS} -d ${SECS} ${args} ${proxy_port} \
+            http://localhost:${tiny_port}/home.html
+    done
+fi
+
+kill ${proxy_pid} ${tiny_pid} 2> /dev/null
+wait ${proxy_pid} ${tiny_pid} 2> /dev/null
+rm -f ${CONFIG}
@@ -0,0 +1,331 @@
+/*
+ *                     cache_bench.c
+ *
+ * Trace-driven comparison of the cache's eviction policies (evict.c),
+ * each with and without the TinyLFU admission filter. Every request of
+ * the trace is replayed against one shard of a given byte budget, the
+ * way proxy_cache.c drives the policy: a lookup is counted for the
+ * filter, a hit is reported to the policy, and a miss on an object of
+ * at most MAX_OBJECT_SIZE inserts it, evicting until it fits unless the
+ * filter turns it away. Reported are the hit ratios by requests and by
+ * bytes, and the millions of requests replayed per second.
+ *
+ * Without -f, two synthetic traces are used: Zipf-distributed requests
+ * over a fixed set of objects, and the same with a quarter of the
+ * requests going to objects that are never asked for again. Sizes are
+ * mostly a few KB with a tail up to MAX_OBJECT_SIZE. A trace file has
+ * one request per line, "<key> <size in bytes>".
+ *
+ *     usage: ./cache_bench [-n requests] [-o objects] [-a alpha]
+ *                          [-c bytes,...] [-f trace]
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include "evict.h"
+
+#define MAX_CACHE_SIZE  1049000   /* As in proxy.h */
+#define MAX_OBJECT_SIZE 102400
+#define MAX_BUDGETS     16
+#define MAX_KEY         1024
+
+typedef struct trace {
+    char *name;
+    unsigned int *ids;            /* Object of every request */
+    unsigned int nrequests;
+    unsigned int *sizes;          /* Size of every object */
+    unsigned int nobjects;
+} trace;
+
+static const evict_policy *policies[] = {
+    &evict_lru, &evict_clock, &evict_s3fifo
+};
+#define NPOLICIES (sizeof(policies) / sizeof(policies[0]))
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/*
+ * rng - xorshift64, so every run replays the same traces
+ */
+static unsigned long long rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rng_unit(void)
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * object_size - 70% of objects 512B-8KB, 25% 8-32KB, 5% 32-100KB
+ */
+static unsigned int object_size(void)
+{
+    double u = rng_unit();
+
+    if (u < 0.70)
+        return 512 + rng() % (8192 - 512);
+    if (u < 0.95)
+        return 8192 + rng() % (32768 - 8192);
+    return 32768 + rng() % (MAX_OBJECT_SIZE - 32768);
+}
+
+/*
+ * zipf_trace - n requests over nobj objects, object k asked for with
+ *     probability proportional to 1 / (k+1)^alpha; with oneoff set, a
+ *     quarter of the requests are for new objects that never come back
+ */
+static void zipf_trace(trace *t, char *name, unsigned int n,
+                       unsigned int nobj, double alpha, int oneoff)
+{
+    double *cdf = malloc(nobj * sizeof(double)), sum = 0, u;
+    unsigned int i, k, lo, hi, next = nobj;
+
+    for (k = 0; k < nobj; k++)
+        cdf[k] = (sum += 1.0 / pow(k + 1, alpha));
+    t->name = name;
+    t->nrequests = n;
+    t->ids = malloc(n * sizeof(unsigned int));
+    t->nobjects = oneoff ? nobj + n : nobj;
+    t->sizes = malloc(t->nobjects * sizeof(unsigned int));
+    for (k = 0; k < t->nobjects; k++)
+        t->sizes[k] = object_size();
+    for (i = 0; i < n; i++) {
+        if (oneoff && rng() % 4 == 0) {
+            t->ids[i] = next++;
+            continue;
+        }
+        // The first k whose cumulative weight reaches u.
+        u = rng_unit() * sum;
+        for (lo = 0, hi = nobj - 1; lo < hi; ) {
+            k = (lo + hi) / 2;
+            if (cdf[k] < u)
+                lo = k + 1;
+            else
+                hi = k;
+        }
+        t->ids[i] = lo;
+    }
+    t->nobjects = next;
+    free(cdf);
+}
+
+/*
+ * file_trace - read "<key> <size>" lines, numbering keys as they first
+ *     appear; an object keeps the size of its first request
+ */
+static void file_trace(trace *t, char *path)
+{
+    FILE *fp;
+    char key[MAX_KEY], **keys;
+    unsigned int size, cap = 1024, ncap = 1 << 16, h, *slots;
+    unsigned int n = 0, nobj = 0;
+    char *p;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    t->name = path;
+    t->ids = malloc(cap * sizeof(unsigned int));
+    t->sizes = malloc(ncap * sizeof(unsigned int));
+    keys = malloc(ncap * sizeof(char *));
+    // Open addressing over 2 * ncap slots of key number + 1.
+    slots = calloc(2 * ncap, sizeof(unsigned int));
+    while (fscanf(fp, "%1023s %u", key, &size) == 2) {
+        for (h = 2166136261u, p = key; *p; p++)
+            h = (h ^ (unsigned char)*p) * 16777619u;
+        for (h &= 2 * ncap - 1; slots[h]; h = (h + 1) & (2 * ncap - 1))
+            if (!strcmp(keys[slots[h] - 1], key))
+                break;
+        if (slots[h] == 0) {
+            if (nobj == ncap) {
+                fprintf(stderr, "%s: more than %u keys\n", path, ncap);
+                exit(1);
+            }
+            keys[nobj] = strdup(key);
+            t->sizes[nobj] = size;
+            slots[h] = ++nobj;
+        }
+        if (n == cap)
+            t->ids = realloc(t->ids, (cap *= 2) * sizeof(unsigned int));
+        t->ids[n++] = slots[h] - 1;
+    }
+    fclose(fp);
+    t->nrequests = n;
+    t->nobjects = nobj;
+    while (nobj)
+        free(keys[--nobj]);
+    free(keys);
+    free(slots);
+}
+
+/*
+ * id_hash - spread object numbers over the hash space like tag hashes
+ */
+static unsigned int id_hash(unsigned int id)
+{
+    id ^= id >> 16;
+    id *= 0x7feb352du;
+    id ^= id >> 15;
+    id *= 0x846ca68bu;
+    return id ^ (id >> 16);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * replay - run the trace against one shard of budget bytes and print a
+ *     line of results
+ */
+static void replay(trace *t, size_t budget, const evict_policy *policy,
+                   int admission)
+{
+    evict_node *nodes = calloc(t->nobjects, sizeof(evict_node)), *v;
+    char *cached = calloc(t->nobjects, 1);
+    unsigned long long bytes = 0, hit_bytes = 0;
+    unsigned int i, id, size, h, hits = 0;
+    size_t used = 0;
+    evict_state es;
+    double start, secs;
+    char label[32];
+
+    evict_init(&es, policy, budget, admission);
+    start = now();
+    for (i = 0; i < t->nrequests; i++) {
+        id = t->ids[i];
+        size = t->sizes[id];
+        h = id_hash(id);
+        bytes += size;
+        evict_record(&es, h);
+        if (cached[id]) {
+            hits++;
+            hit_bytes += size;
+            evict_hit(&es, &nodes[id]);
+            continue;
+        }
+        if (size > MAX_OBJECT_SIZE || size > budget)
+            continue;
+        if (used + size > budget && !evict_admit(&es, h, evict_victim(&es)))
+            continue;
+        while (used + size > budget) {
+            v = evict_victim(&es);
+            evict_remove(&es, v);
+            cached[v - nodes] = 0;
+            used -= v->size;
+        }
+        evict_insert(&es, &nodes[id], h, size);
+        cached[id] = 1;
+        used += size;
+    }
+    secs = now() - start;
+    evict_free(&es);
+    free(nodes);
+    free(cached);
+    snprintf(label, sizeof(label), "%s%s", policy->name,
+             admission ? "+tinylfu" : "");
+    printf("%10zu  %-16s %6.2f %8.2f %9.2f\n", budget, label,
+           100.0 * hits / t->nrequests,
+           bytes ? 100.0 * hit_bytes / bytes : 0.0,
+           t->nrequests / secs / 1e6);
+}
+
+/*
+ * run - replay the trace for every budget, policy and filter setting
+ */
+static void run(trace *t, size_t *budgets, int nbudgets)
+{
+    int b, admission;
+    size_t p;
+
+    printf("%s: %u requests, %u objects\n", t->name, t->nrequests,
+           t->nobjects);
+    printf("%10s  %-16s %6s %8s %9s\n", "bytes", "policy", "hit%",
+           "byte hit%", "Mreq/s");
+    for (b = 0; b < nbudgets; b++)
+        for (admission = 0; admission < 2; admission++)
+            for (p = 0; p < NPOLICIES; p++)
+                replay(t, budgets[b], policies[p], admission);
+    printf("\n");
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-n requests] [-o objects] [-a alpha] "
+            "[-c bytes,...] [-f trace]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t budgets[MAX_BUDGETS] = {
+        MAX_CACHE_SIZE / 4, MAX_CACHE_SIZE, 4 * MAX_CACHE_SIZE,
+        16 * MAX_CACHE_SIZE
+    };
+    int nbudgets = 4, opt;
+    unsigned int n = 2000000, nobj = 20000;
+    double alpha = 0.9;
+    char *file = NULL, *p, name[64];
+    trace t;
+
+    while ((opt = getopt(argc, argv, "n:o:a:c:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            if ((n = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'o':
+            if ((nobj = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'a':
+            if ((alpha = atof(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            for (nbudgets = 0, p = strtok(optarg, ",");
+                 p && nbudgets < MAX_BUDGETS; p = strtok(NULL, ","))
+                if ((budgets[nbudgets++] = strtoul(p, NULL, 10)) == 0)
+                    usage(argv[0]);
+            if (nbudgets == 0)
+                usage(argv[0]);
+            break;
+        case 'f':
+            file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (file) {
+        file_trace(&t, file);
+        run(&t, budgets, nbudgets);
+        return 0;
+    }
+    snprintf(name, sizeof(name), "zipf %.2f", alpha);
+    zipf_trace(&t, name, n, nobj, alpha, 0);
+    run(&t, budgets, nbudgets);
+    free(t.ids);
+    free(t.sizes);
+    snprintf(name, sizeof(name), "zipf %.2f + one-off objects", alpha);
+    zipf_trace(&t, name, n, nobj, alpha, 1);
+    run(&t, budgets, nbudgets);
+    return 0;
+}
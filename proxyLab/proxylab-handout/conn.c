@@ -0,0 +1,1047 @@
+/*
+ *                     conn.c
+ *
+ * Client connection state machine of the event-driven modes, shared by
+ * the epoll reactor (reactor.c) and the io_uring rings (uring.c):
+ *
+ *   CONN_READ_REQUEST -> CONN_CONNECT -> CONN_SEND_REQUEST -> CONN_RELAY
+ *
+ * Every step does its I/O through the conn_io of the connection's event
+ * loop, and returns as soon as that would have to wait: the reactor
+ * calls a step again once epoll reports the socket ready, a ring once
+ * the operation it queued for the step has completed. A connection has
+ * at most one operation in flight, so the steps are the same for both.
+ *
+ * A request that misses while another fetch of the same object is in
+ * flight instead streams that fetch's cache fill (CONN_JOIN). The fill
+ * wakes the connection through its loop's eventfd and ready list. In
+ * HTTP/1.1 upstream mode a connection taken from the idle pool goes
+ * straight to CONN_SEND_REQUEST, and once the framer has seen the whole
+ * response the origin socket is parked in the pool again.
+ *
+ * A stale cached object is revalidated like a miss, with a conditional
+ * request; a 304 makes the connection send the refreshed object from
+ * the cache (CONN_SEND_HIT) instead of relaying the response. A large
+ * body that is not going into the cache may be handed to the event
+ * loop (CONN_SPLICE), which the reactor moves with splice(2).
+ *
+ * Client connections are persistent when the client asks for it and the
+ * response is delimited: after the response the connection goes back to
+ * CONN_READ_REQUEST. Requests are read into their own buffer, so the
+ * ones pipelined behind the current request wait there for their turn.
+ *
+ * Every event loop runs a timing wheel (timer.c) with one timer per
+ * connection, which is re-armed whenever the connection's state calls
+ * for another timeout: idle between requests, the whole request header,
+ * each origin connect, the origin's response header, and progress on
+ * the response body. A connection that times out is closed, answered
+ * with a 504 or moved on to the next origin address, once the operation
+ * it has in flight, if any, has been cancelled.
+ *
+ * Admission control (admit.c) turns a connection away with a 503 once
+ * too many are open, and caps the fetches in flight per origin: a miss
+ * past that cap waits in CONN_QUEUED, with no I/O pending, until a
+ * fetch from the same origin finishes and wakes it through the ready
+ * list, or the queue timeout sheds it with a 503.
+ *
+ * An origin the resolver cache does not know is looked up by a resolver
+ * thread (dns.c), not by the event loop: the connection waits in
+ * CONN_RESOLVE until the lookup wakes it through the ready list.
+ *
+ * An event loop whose accept runs out of descriptors or memory stops
+ * watching its listener, which would otherwise stay ready and spin the
+ * loop, until one of its connections closes or ACCEPT_BACKOFF_MS has
+ * passed (conn_accept_pause).
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <netinet/tcp.h>
+#include "conn.h"
+#include "sysdep.h"
+
+/* Seconds of each timeout, by enum conn_timeout */
+static const int timeout_secs[] = {
+    0, CLIENT_IDLE_TIMEOUT, HEADER_TIMEOUT, CONNECT_TIMEOUT, HEADER_TIMEOUT,
+    BODY_TIMEOUT, ADMIT_QUEUE_TIMEOUT, CONNECT_TIMEOUT
+};
+
+static void conn_arm(conn_t *c);
+static void conn_expire(conn_t *c);
+static int do_read_request(conn_t *c);
+static int start_request(conn_t *c);
+static int finish_request(conn_t *c);
+static int start_fetch(conn_t *c);
+static int do_queued(conn_t *c);
+static int connect_origin(conn_t *c);
+static int do_resolve(conn_t *c);
+static int origin_failed(conn_t *c);
+static int start_connect(conn_t *c);
+static int do_connect(conn_t *c);
+static int do_send_request(conn_t *c);
+static int do_relay(conn_t *c);
+static void relay_header(conn_t *c);
+static void origin_done(conn_t *c);
+static int not_modified(conn_t *c);
+static int origin_error(conn_t *c, char *cause, char *longmsg);
+static int origin_timeout(conn_t *c);
+static int send_stale(conn_t *c);
+static int send_busy(conn_t *c);
+static int send_hit(conn_t *c);
+static int do_send_hit(conn_t *c);
+static int do_join(conn_t *c);
+static void conn_wake(void *arg);
+static int send_error(conn_t *c, char *cause, char *errnum,
+                      char *shortmsg, char *longmsg);
+
+/*
+ * conn_loop_init - set up the shared part of an event loop whose
+ *     connections do their I/O through io, and are woken through evfd
+ */
+void conn_loop_init(conn_loop *lp, const conn_io *io, int evfd)
+{
+    lp->io = io;
+    lp->evfd = evfd;
+    lp->dead = NULL;
+    lp->ready = NULL;
+    pthread_mutex_init(&lp->ready_lock, NULL);
+    timer_wheel_init(&lp->wheel);
+    lp->accept_paused = 0;
+    lp->accept_tm.pprev = NULL;
+    lp->accept_warned = 0;
+}
+
+/*
+ * conn_admit - take in the accepted connfd, or turn it away with a 503
+ *     and close it if there are too many; returns 1 if it was taken
+ */
+int conn_admit(int connfd)
+{
+    int one = 1;
+
+    if (!admit_conn()) {
+        admit_reject(connfd);
+        Close(connfd);
+        return 0;
+    }
+    // Responses are written in pieces; do not let Nagle hold the
+    // last one back waiting for a delayed ack.
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 1;
+}
+
+/*
+ * conn_init - start a zeroed connection, with its in and buf in place,
+ *     on the admitted connfd in loop lp
+ */
+void conn_init(conn_t *c, conn_loop *lp, int connfd)
+{
+    c->state = CONN_READ_REQUEST;
+    c->clientfd = connfd;
+    c->serverfd = -1;
+    c->in[0] = '\0';
+    request_init(&c->hr);
+    c->loop = lp;
+    c->waiter.wake = conn_wake;
+    c->waiter.arg = c;
+    c->admit.wake = conn_wake;
+    c->admit.arg = c;
+    c->query.out = &c->addrs;
+    c->query.wake = conn_wake;
+    c->query.arg = c;
+}
+
+/*
+ * conn_drive - run a connection's state machine until it has to wait
+ *     for I/O or a fill
+ *
+ * Every step returns 1 when it moved to a new state and 0 when it has
+ * to wait (or closed the connection).
+ */
+void conn_drive(conn_t *c)
+{
+    int progress = 1;
+
+    c->active = c->loop->wheel.now;
+    while (progress && !c->busy) {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            progress = do_read_request(c);
+            break;
+        case CONN_QUEUED:
+            progress = do_queued(c);
+            break;
+        case CONN_RESOLVE:
+            progress = do_resolve(c);
+            break;
+        case CONN_CONNECT:
+            progress = do_connect(c);
+            break;
+        case CONN_SEND_REQUEST:
+            progress = do_send_request(c);
+            break;
+        case CONN_RELAY:
+            progress = do_relay(c);
+            break;
+        case CONN_SPLICE:
+            progress = c->loop->io->do_splice(c);
+            break;
+        case CONN_SEND_HIT:
+            progress = do_send_hit(c);
+            break;
+        case CONN_JOIN:
+            progress = do_join(c);
+            break;
+        case CONN_SEND_ERROR:
+            if (c->loop->io->send(c, c->buf, c->len, &c->off))
+                conn_close(c);
+            progress = 0;
+            break;
+        case CONN_CLOSED:
+            progress = 0;
+            break;
+        }
+    }
+    conn_arm(c);
+}
+
+/*
+ * conn_arm - start the timeout the connection's state calls for, unless
+ *     it is already running. A response body is timed by its progress,
+ *     which conn_expire checks; anything else must be done in time.
+ */
+static void conn_arm(conn_t *c)
+{
+    enum conn_timeout to;
+
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+        to = c->in_len ? TIMEOUT_HEADER : TIMEOUT_IDLE;
+        break;
+    case CONN_QUEUED:
+        to = TIMEOUT_QUEUE;
+        break;
+    case CONN_RESOLVE:
+        to = TIMEOUT_RESOLVE;
+        break;
+    case CONN_CONNECT:
+        to = TIMEOUT_CONNECT;
+        break;
+    case CONN_SEND_REQUEST:
+        to = TIMEOUT_RESPONSE;
+        break;
+    case CONN_RELAY:
+        to = c->answered ? TIMEOUT_BODY : TIMEOUT_RESPONSE;
+        break;
+    case CONN_CLOSED:
+        to = TIMEOUT_NONE;
+        break;
+    default:
+        to = TIMEOUT_BODY;
+        break;
+    }
+    if (to == c->timeout)
+        return;
+    c->timeout = to;
+    if (to == TIMEOUT_NONE)
+        timer_cancel(&c->loop->wheel, &c->tm);
+    else
+        timer_set(&c->loop->wheel, &c->tm, timeout_secs[to] * 1000UL);
+}
+
+/*
+ * conn_expire - the connection's timer fired: set it again for a body
+ *     that made progress in the meantime, and otherwise time out, once
+ *     the operation in flight, if any, has been cancelled
+ */
+static void conn_expire(conn_t *c)
+{
+    unsigned long quiet, limit = timeout_secs[c->timeout] * 1000UL;
+
+    if (c->timeout == TIMEOUT_BODY) {
+        quiet = (c->loop->wheel.now - c->active) * TIMER_TICK_MS;
+        if (quiet < limit) {
+            timer_set(&c->loop->wheel, &c->tm, limit - quiet);
+            return;
+        }
+    }
+    if (c->busy) {
+        c->expired = 1;
+        c->loop->io->cancel(c);
+        return;
+    }
+    conn_timed_out(c);
+}
+
+/*
+ * conn_timed_out - give up on what the connection was waiting for: the
+ *     origin, which may have another address to try, a slot at it, or
+ *     the client
+ */
+void conn_timed_out(conn_t *c)
+{
+    switch (c->timeout) {
+    case TIMEOUT_CONNECT:
+    case TIMEOUT_RESPONSE:
+        log_debug("Timed out waiting for %s:%s", c->host, c->port);
+        if (origin_timeout(c))
+            conn_drive(c);
+        return;
+    case TIMEOUT_QUEUE:
+        log_debug("No slot at %s:%s in time", c->host, c->port);
+        admit_origin_cancel(c->host, c->port, &c->admit);
+        send_busy(c);
+        conn_drive(c);
+        return;
+    case TIMEOUT_RESOLVE:
+        log_debug("Could not resolve %s:%s in time", c->host, c->port);
+        dns_cancel(&c->query);
+        if (origin_timeout(c))
+            conn_drive(c);
+        return;
+    default:
+        log_debug("Timed out on client fd %d", c->clientfd);
+        conn_close(c);
+        return;
+    }
+}
+
+/*
+ * do_read_request - accumulate the next request, parsing each read as
+ *     it arrives, until the blank line that ends its header block; it
+ *     may already be buffered
+ */
+static int do_read_request(conn_t *c)
+{
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        if ((rc = request_parse(&c->hr, c->in, c->in_len)) == REQ_DONE) {
+            c->req_end = c->hr.off;
+            return start_request(c);
+        }
+        if (rc == REQ_BAD_LINE)
+            return send_error(c, "request", "400", "Bad Request",
+                              "Proxy could not parse the request line");
+        if (rc == REQ_TOO_LARGE || c->in_len == CONN_IN - 1)
+            return send_error(c, "header", "400", "Bad Request",
+                              "Request header too large");
+        n = c->loop->io->read(c, c->clientfd, c->in + c->in_len,
+                              CONN_IN - 1 - c->in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                conn_close(c);
+            return 0;
+        }
+        if (n == 0) {
+            conn_close(c);
+            return 0;
+        }
+        c->in_len += n;
+        c->in[c->in_len] = '\0';
+    }
+}
+
+/*
+ * start_request - parse the buffered request, then serve it from the
+ *     cache or start fetching it from the origin server
+ */
+static int start_request(conn_t *c)
+{
+    char method[MAXLINE], uri[MAXLINE];
+
+    // Parse request
+    if (!view_is(c->hr.method, "GET"))
+        return send_error(c, view_str(method, sizeof(method), c->hr.method),
+                          "501", "Not Implemented",
+                          "Proxy does not implement this method");
+    view_str(uri, sizeof(uri), c->hr.uri);
+    if (request_target(&c->hr) < 0)
+        return send_error(c, uri, "400", "Bad Request",
+                          "Proxy could not parse the request URI");
+    c->client = request_keepalive(&c->hr);
+
+    // First find in cache, or join a fetch of the object in flight.
+    switch (cache_acquire(&proxy_cache, uri, &c->hit, &c->fill)) {
+    case CACHE_HIT:
+        c->how = "HIT";
+        return send_hit(c);
+    case CACHE_JOIN:
+        c->len = c->off = c->obj_off = 0;
+        c->how = "JOIN";
+        c->state = CONN_JOIN;
+        return 1;
+    case CACHE_STALE:
+        c->stale = c->hit;
+        c->hit = NULL;
+        break;
+    }
+    c->how = "MISS";
+    c->leader = 1;
+    c->fill->credentials = request_credentials(&c->hr);
+    return start_fetch(c);
+}
+
+/*
+ * finish_request - the response has been sent: close the connection,
+ *     or keep it for the client's next request
+ */
+static int finish_request(conn_t *c)
+{
+    // The request line is still at the start of in.
+    log_access(c->in, c->how, strcmp(c->how, "MISS") ? 200 : c->fr.status);
+    if (c->client == CLIENT_CLOSE) {
+        conn_close(c);
+        return 0;
+    }
+    if (c->serverfd >= 0)
+        Close(c->serverfd);
+    if (c->hit)
+        release_cache_block(&proxy_cache, c->hit);
+    if (c->stale)
+        release_cache_block(&proxy_cache, c->stale);
+    if (c->origin_held)
+        admit_origin_done(c->host, c->port);
+    Free(c->host);
+    Free(c->port);
+    c->serverfd = -1;
+    c->hit = c->stale = NULL;
+    c->host = c->port = NULL;
+    c->leader = c->reused = c->answered = c->origin_held = 0;
+    c->server_eof = c->hdr_done = 0;
+    c->len = c->off = c->obj_off = 0;
+
+    // Requests pipelined behind this one move to the front.
+    c->in_len -= c->req_end;
+    memmove(c->in, c->in + c->req_end, c->in_len + 1);
+    request_init(&c->hr);
+    c->state = CONN_READ_REQUEST;
+    // The next request gets the whole of its timeouts.
+    c->timeout = TIMEOUT_NONE;
+    return 1;
+}
+
+/*
+ * start_fetch - rewrite the parsed request and start sending it to the
+ *     origin, once it has a slot there
+ */
+static int start_fetch(conn_t *c)
+{
+    char host[MAXLINE], port[MAXLINE];
+
+    c->host = strdup(view_str(host, sizeof(host), c->hr.host));
+    c->port = strdup(view_str(port, sizeof(port), c->hr.port));
+    log_debug("Parsed host %s, port %s, pathname %.*s", host, port,
+              (int)c->hr.path.len, c->hr.path.p);
+    switch (admit_origin(c->host, c->port, &c->admit)) {
+    case ADMIT_QUEUED:
+        c->state = CONN_QUEUED;
+        return 0;
+    case ADMIT_SHED:
+        return send_busy(c);
+    }
+    c->origin_held = 1;
+    return connect_origin(c);
+}
+
+/*
+ * do_queued - go on to the origin once a finished fetch has handed its
+ *     slot to this connection
+ */
+static int do_queued(conn_t *c)
+{
+    if (!__atomic_load_n(&c->admit.granted, __ATOMIC_ACQUIRE))
+        return 0;
+    c->origin_held = 1;
+    return connect_origin(c);
+}
+
+/*
+ * connect_origin - lay out the rewritten request, which points into the
+ *     client's request in in, then take an idle connection to the origin
+ *     from the pool, or resolve the origin and start connecting to it.
+ *     A lookup the resolver cache cannot answer goes to a resolver
+ *     thread, and the connection waits for it in CONN_RESOLVE.
+ */
+static int connect_origin(conn_t *c)
+{
+    int fd, rc;
+
+    if ((c->niov = build_request(c->iov, &c->hr, c->stale)) < 0)
+        return send_error(c, "header", "400", "Bad Request",
+                          "Request has too many headers to forward");
+    c->iov_next = c->iov;
+    log_request(c->iov, c->niov, c->host);
+    framer_init(&c->fr);
+    // A client older than HTTP/1.1 cannot take a chunked body.
+    c->unchunk = c->client != CLIENT_HTTP11;
+    if (upstream_keepalive && (fd = upstream_get(c->host, c->port)) >= 0) {
+        c->serverfd = fd;
+        c->reused = 1;
+        c->state = CONN_SEND_REQUEST;
+        c->loop->io->watch(c, fd);
+        return 1;
+    }
+    c->reused = 0;
+
+    c->query.host = c->host;
+    c->query.port = c->port;
+    if ((rc = dns_lookup_async(&c->query)) == DNS_QUEUED) {
+        c->state = CONN_RESOLVE;
+        return 0;
+    }
+    if (rc != 0)
+        return origin_error(c, c->host,
+                            "Proxy could not resolve the origin server");
+    c->next_addr = 0;
+    return start_connect(c);
+}
+
+/*
+ * do_resolve - start connecting once the resolver thread has looked
+ *     the origin up
+ */
+static int do_resolve(conn_t *c)
+{
+    if (!dns_query_done(&c->query))
+        return 0;
+    if (c->query.rc != 0)
+        return origin_error(c, c->host,
+                            "Proxy could not resolve the origin server");
+    c->next_addr = 0;
+    return start_connect(c);
+}
+
+/*
+ * origin_failed - the origin dropped the connection before any of the
+ *     response arrived. A pooled connection may just have been timed out
+ *     by the origin, so the request goes out again; otherwise the client
+ *     gets a 502.
+ */
+static int origin_failed(conn_t *c)
+{
+    Close(c->serverfd);
+    c->serverfd = -1;
+    if (c->reused)
+        return connect_origin(c);
+    return origin_error(c, c->host,
+                        "Proxy could not get a response from the origin server");
+}
+
+/*
+ * start_connect - begin connecting to the next candidate origin address
+ */
+static int start_connect(conn_t *c)
+{
+    for (; c->next_addr < c->addrs.n; c->next_addr++) {
+        if (c->loop->io->connect(c, &c->addrs.addr[c->next_addr]) == 0) {
+            c->state = CONN_CONNECT;
+            // Every address gets CONNECT_TIMEOUT of its own.
+            c->timeout = TIMEOUT_NONE;
+            return 1;
+        }
+    }
+    // The origin may have moved; resolve it again next time.
+    dns_forget(c->host, c->port);
+    return origin_error(c, "origin",
+                        "Proxy could not connect to the origin server");
+}
+
+/*
+ * origin_error - no response can be had from the origin: send the
+ *     client the stale copy being revalidated if that is allowed, and a
+ *     502 otherwise
+ */
+static int origin_error(conn_t *c, char *cause, char *longmsg)
+{
+    if (c->stale == NULL || !cache_serve_stale(c->stale))
+        return send_error(c, cause, "502", "Bad Gateway", longmsg);
+    cache_fill_abort(c->fill);
+    c->fill = NULL;
+    c->leader = 0;
+    c->how = "STALE";
+    return send_stale(c);
+}
+
+/*
+ * origin_timeout - the origin was not looked up, did not accept the
+ *     connection or did not answer in time: try its next address if it
+ *     was the connect, otherwise send the client the stale copy being
+ *     revalidated if that is allowed, and a 504
+ */
+static int origin_timeout(conn_t *c)
+{
+    if (c->serverfd >= 0)
+        Close(c->serverfd);
+    c->serverfd = -1;
+    if (c->state == CONN_CONNECT && c->next_addr + 1 < c->addrs.n) {
+        c->next_addr++;
+        return start_connect(c);
+    }
+    if (c->stale == NULL || !cache_serve_stale(c->stale))
+        return send_error(c, c->host, "504", "Gateway Timeout",
+                          "Proxy timed out waiting for the origin server");
+    return origin_error(c, c->host, NULL);
+}
+
+/*
+ * do_connect - finish the connect in flight, falling back to the next
+ *     address if it failed
+ */
+static int do_connect(conn_t *c)
+{
+    int rc;
+
+    if ((rc = c->loop->io->connected(c)) == 0)
+        return 0;
+    if (rc < 0) {
+        Close(c->serverfd);
+        c->serverfd = -1;
+        c->next_addr++;
+        return start_connect(c);
+    }
+    c->state = CONN_SEND_REQUEST;
+    return 1;
+}
+
+/*
+ * do_send_request - write the rest of the rewritten request to the
+ *     origin
+ */
+static int do_send_request(conn_t *c)
+{
+    int rc;
+
+    if ((rc = c->loop->io->send_iov(c, c->serverfd)) < 0)
+        return origin_failed(c);
+    if (rc == 0)
+        return 0;
+    c->len = c->off = 0;
+    c->state = CONN_RELAY;
+    return 1;
+}
+
+/*
+ * do_relay - copy the origin's response to the client until it is
+ *     complete, then hand a reusable origin connection back to the pool.
+ *     The response header is collected whole first, to be rewritten.
+ */
+static int do_relay(conn_t *c)
+{
+    const conn_io *io = c->loop->io;
+    ssize_t n;
+    size_t used, kept, start;
+
+    while (1) {
+        if (c->hdr_done && c->off < c->len) {
+            if (!io->send(c, c->buf, c->len, &c->off))
+                return 0;
+            continue;
+        }
+        if (c->hdr_done && !c->server_eof && c->fill && c->leader
+            && !cache_fill_active(c->fill)) {
+            cache_fill_abort(c->fill);
+            c->fill = NULL;
+        }
+        if (c->hdr_done && !c->server_eof && !c->fill && io->splice
+            && io->splice(c))
+            return 1;
+        if (c->server_eof && !c->hdr_done) {
+            relay_header(c);
+            continue;
+        }
+        if (c->server_eof) {
+            // A response cut short by the origin is not cached.
+            if (c->fill && (c->fr.state == FRAME_DONE
+                            || c->fr.state == FRAME_UNTIL_EOF))
+                cache_fill_end(c->fill);
+            else if (c->fill)
+                cache_fill_abort(c->fill);
+            c->fill = NULL;
+            origin_done(c);
+            if (c->fr.state != FRAME_DONE)
+                c->client = CLIENT_CLOSE;
+            return finish_request(c);
+        }
+        start = c->hdr_done ? 0 : c->len;
+        n = io->read(c, c->serverfd, c->buf + start, MAXBUF - start);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return 0;
+            if (!c->answered)
+                return origin_failed(c);
+            conn_close(c);
+            return 0;
+        }
+        if (n == 0) {
+            if (!c->answered)
+                return origin_failed(c);
+            c->server_eof = 1;
+        } else {
+            c->answered = 1;
+            if (c->unchunk)
+                kept = framer_dechunk(&c->fr, c->buf + start, n, &used);
+            else
+                kept = used = framer_feed(&c->fr, c->buf + start, n);
+            if (c->fr.state == FRAME_DONE) {
+                // Bytes past the end of the response are not ours to
+                // relay, and leave the connection unusable.
+                if (used < (size_t)n)
+                    c->fr.keepalive = 0;
+                c->server_eof = 1;
+            }
+            n = kept;
+        }
+        if (c->hdr_done) {
+            c->len = n;
+            c->off = 0;
+            if (c->fill)
+                cache_fill_append(c->fill, c->buf, n);
+        } else {
+            c->len += n;
+            if (c->stale && c->fr.status == 304 && c->fr.state == FRAME_DONE)
+                return not_modified(c);
+            if ((c->fr.state != FRAME_STATUS && c->fr.state != FRAME_HEADER)
+                || c->len == MAXBUF)
+                relay_header(c);
+        }
+    }
+}
+
+/*
+ * relay_header - replace the hop-by-hop headers of the response at the
+ *     start of buf by a Connection header for this client, and tee it
+ *     into the fill. A header that cannot be parsed, or does not fit in
+ *     buf, is relayed as is and the connection closed after it. A body
+ *     relayed without its chunk framing loses its Transfer-Encoding.
+ */
+static void relay_header(conn_t *c)
+{
+    size_t rest = 0;
+
+    c->hdr_done = 1;
+    c->off = 0;
+    if (framer_header_done(&c->fr)) {
+        rest = c->len - c->fr.hdr_len;
+        c->client = response_keepalive(&c->fr, c->client);
+        c->len = strip_hop_headers(c->buf, c->fr.hdr_len, c->len);
+    } else
+        c->client = CLIENT_CLOSE;
+    if (c->fill)
+        cache_fill_append(c->fill, c->buf, c->len);
+    if (c->unchunk && c->fr.chunked)
+        c->len = drop_header(c->buf, c->len - rest, c->len,
+                             "Transfer-Encoding");
+    if (framer_header_done(&c->fr))
+        c->len = add_conn_header(c->buf, c->len - rest, c->len, c->client);
+    log_debug("Response header from %s:%s\n%.*s", c->host, c->port,
+              (int)(c->len - rest), c->buf);
+}
+
+/*
+ * origin_done - the whole response has been read: park a reusable
+ *     origin connection in the pool, once the event loop has let go of
+ *     it, and close it otherwise
+ */
+static void origin_done(conn_t *c)
+{
+    if (upstream_keepalive && framer_reusable(&c->fr)
+        && c->loop->io->unwatch(c, c->serverfd) == 0)
+        upstream_put(c->host, c->port, c->serverfd);
+    else
+        Close(c->serverfd);
+    c->serverfd = -1;
+}
+
+/*
+ * not_modified - the origin answered the revalidation with the 304 in
+ *     buf: refresh the stale object through the fill and send it to the
+ *     client from the cache
+ */
+static int not_modified(conn_t *c)
+{
+    cache_fill_append(c->fill, c->buf, c->len);
+    cache_fill_end(c->fill);
+    c->fill = NULL;
+    c->leader = 0;
+    origin_done(c);
+    c->how = "REVAL";
+    return send_stale(c);
+}
+
+/*
+ * send_stale - send the client the object that was being revalidated,
+ *     as if it had been a hit
+ */
+static int send_stale(conn_t *c)
+{
+    c->hit = c->stale;
+    c->stale = NULL;
+    return send_hit(c);
+}
+
+/*
+ * send_busy - the origin has no slot for the request: send the client
+ *     the stale copy being revalidated if that is allowed, and the
+ *     precomputed 503 otherwise
+ */
+static int send_busy(conn_t *c)
+{
+    if (c->stale && cache_serve_stale(c->stale))
+        return origin_error(c, c->host, NULL);
+    c->len = admit_busy_response(c->buf);
+    c->off = 0;
+    c->state = CONN_SEND_ERROR;
+    log_access(c->in, "SHED", 503);
+    return 1;
+}
+
+/*
+ * send_hit - lay out the cached object for the client: its header as
+ *     rewritten in buf, then its body straight from the cache
+ */
+static int send_hit(conn_t *c)
+{
+    cache_block *cb = c->hit;
+
+    c->len = client_head(c->buf, cb->content, cb->hdr_len, &c->client);
+    c->iov[0].iov_base = c->buf;
+    c->iov[0].iov_len = c->len;
+    c->iov[1].iov_base = cb->content + cb->hdr_len;
+    c->iov[1].iov_len = cb->block_size - cb->hdr_len;
+    c->iov_next = c->iov;
+    c->niov = 2;
+    c->state = CONN_SEND_HIT;
+    return 1;
+}
+
+/*
+ * do_send_hit - write the cached object to the client, header and body
+ *     together
+ */
+static int do_send_hit(conn_t *c)
+{
+    int rc;
+
+    if ((rc = c->loop->io->send_iov(c, c->clientfd)) < 0) {
+        conn_close(c);
+        return 0;
+    }
+    if (rc == 0)
+        return 0;
+    return finish_request(c);
+}
+
+/*
+ * do_join - relay the fill another connection is feeding for the same
+ *     object; if it will not be cached after all and nothing has been
+ *     sent yet, fetch the object from the origin instead
+ */
+static int do_join(conn_t *c)
+{
+    const conn_io *io = c->loop->io;
+    char *data;
+    int rc;
+
+    while (1) {
+        if (!io->send(c, c->buf, c->len, &c->off))
+            return 0;
+        rc = cache_fill_read(c->fill, c->obj_off, &data, &c->waiter);
+        if (rc == FILL_AGAIN)
+            return 0;
+        if (rc == 0) {
+            cache_fill_leave(c->fill, &c->waiter);
+            c->fill = NULL;
+            return finish_request(c);
+        }
+        if (rc == FILL_FAILED && c->obj_off > 0) {
+            conn_close(c);
+            return 0;
+        }
+        if (rc == FILL_FAILED) {
+            cache_fill_leave(c->fill, &c->waiter);
+            c->fill = NULL;
+            // The client's request is still parsed in its buffer.
+            c->how = "MISS";
+            return start_fetch(c);
+        }
+        if (c->obj_off == 0) {
+            // Whatever is readable starts with the whole header block.
+            c->len = client_head(c->buf, data, c->fill->hdr_len, &c->client);
+            c->off = 0;
+            c->obj_off = c->fill->hdr_len;
+            continue;
+        }
+        // data is the fill's buffer from obj_off on.
+        if (!io->send(c, data - c->obj_off, c->obj_off + rc, &c->obj_off))
+            return 0;
+    }
+}
+
+/*
+ * conn_wake - fill, admission and lookup callback: queue a connection
+ *     on its loop's ready list and kick the loop. Runs on the thread that
+ *     grew the fill, freed the slot or resolved the origin.
+ */
+static void conn_wake(void *arg)
+{
+    conn_t *c = (conn_t *)arg;
+    conn_loop *lp = c->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lp->ready_lock);
+    if (!c->ready_queued) {
+        c->ready_queued = 1;
+        c->next_ready = lp->ready;
+        lp->ready = c;
+    }
+    pthread_mutex_unlock(&lp->ready_lock);
+    if (write(lp->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+/*
+ * conn_run_ready - drive every connection woken since the loop last
+ *     read its eventfd; one with I/O in flight picks up the fill when
+ *     that completes
+ */
+void conn_run_ready(conn_loop *lp)
+{
+    conn_t *c, *next;
+
+    pthread_mutex_lock(&lp->ready_lock);
+    c = lp->ready;
+    lp->ready = NULL;
+    pthread_mutex_unlock(&lp->ready_lock);
+
+    // A connection stays marked queued until it is driven, so a wakeup
+    // in the meantime cannot relink it onto a new list under us.
+    for (; c; c = next) {
+        pthread_mutex_lock(&lp->ready_lock);
+        next = c->next_ready;
+        c->ready_queued = 0;
+        pthread_mutex_unlock(&lp->ready_lock);
+        conn_drive(c);
+    }
+}
+
+/*
+ * conn_batch_end - after a batch of events: time out the connections
+ *     that stalled, free the ones closed in the batch, and accept again
+ *     if a pause is over
+ */
+void conn_batch_end(conn_loop *lp)
+{
+    conn_t *c, **pp;
+    timer *t, *next;
+    int resume = 0;
+
+    // Connections that just ran have their timers pushed back
+    // already, so only the ones that stalled expire.
+    for (t = timer_expire(&lp->wheel); t; t = next) {
+        next = t->next;
+        if (t == &lp->accept_tm)
+            resume = 1;
+        else
+            conn_expire((conn_t *)((char *)t - offsetof(conn_t, tm)));
+    }
+
+    // Both sockets of a connection may appear in one batch, so closed
+    // connections are only freed once the batch is done. A closed
+    // reader can no longer be woken, but may still be queued from
+    // before it closed.
+    pthread_mutex_lock(&lp->ready_lock);
+    for (pp = &lp->ready; *pp; ) {
+        if ((*pp)->state == CONN_CLOSED)
+            *pp = (*pp)->next_ready;
+        else
+            pp = &(*pp)->next_ready;
+    }
+    pthread_mutex_unlock(&lp->ready_lock);
+    // Their descriptors are free again, so a paused accept may go on.
+    if (lp->dead)
+        resume = 1;
+    while ((c = lp->dead) != NULL) {
+        lp->dead = c->next_dead;
+        lp->io->free(c);
+    }
+    if (lp->accept_paused && resume) {
+        timer_cancel(&lp->wheel, &lp->accept_tm);
+        lp->accept_paused = 0;
+        lp->io->accept(lp);
+    }
+}
+
+/*
+ * conn_accept_pause - the loop's accept failed with err, for which
+ *     accept_overloaded holds, and it has stopped taking connections;
+ *     have conn_batch_end start it again once a connection closes, or
+ *     after ACCEPT_BACKOFF_MS
+ */
+void conn_accept_pause(conn_loop *lp, int err)
+{
+    // Warn a second apart at most, since each close ends the pause.
+    if (lp->wheel.now >= lp->accept_warned) {
+        log_warn("accept: %s, pausing", strerror(err));
+        lp->accept_warned = lp->wheel.now + 1000 / TIMER_TICK_MS;
+    }
+    lp->accept_paused = 1;
+    timer_set(&lp->wheel, &lp->accept_tm, ACCEPT_BACKOFF_MS);
+}
+
+/*
+ * send_error - replace whatever is buffered with an error response
+ *     for the client
+ */
+static int send_error(conn_t *c, char *cause, char *errnum,
+                      char *shortmsg, char *longmsg)
+{
+    c->len = build_clienterror(c->buf, cause, errnum, shortmsg, longmsg);
+    c->off = 0;
+    c->state = CONN_SEND_ERROR;
+    return 1;
+}
+
+/*
+ * conn_close - release the sockets of a connection and queue it to be
+ *     freed at the end of the current batch. It never has an operation
+ *     in flight here, so nothing can complete for it later.
+ */
+void conn_close(conn_t *c)
+{
+    if (c->state == CONN_CLOSED)
+        return;
+    timer_cancel(&c->loop->wheel, &c->tm);
+    c->timeout = TIMEOUT_NONE;
+    // Closing the last reference also drops the fd from an epoll set.
+    Close(c->clientfd);
+    if (c->serverfd >= 0)
+        Close(c->serverfd);
+    c->loop->io->close(c);
+    if (c->origin_held)
+        admit_origin_done(c->host, c->port);
+    else if (c->state == CONN_QUEUED)
+        admit_origin_cancel(c->host, c->port, &c->admit);
+    if (c->state == CONN_RESOLVE)
+        dns_cancel(&c->query);
+    admit_conn_done();
+    Free(c->host);
+    Free(c->port);
+    if (c->hit)
+        release_cache_block(&proxy_cache, c->hit);
+    if (c->stale)
+        release_cache_block(&proxy_cache, c->stale);
+    if (c->fill && c->leader)
+        cache_fill_abort(c->fill);
+    else if (c->fill)
+        cache_fill_leave(c->fill, &c->waiter);
+    c->state = CONN_CLOSED;
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
@@ -0,0 +1,173 @@
+/*
+ *                     conn.h
+ *
+ * The client connection state machine of the event-driven modes, shared
+ * by the epoll reactor (reactor.c) and the io_uring rings (uring.c). It
+ * knows HTTP, the cache, the upstream pool and admission control, but
+ * not how a socket is read or written: every event loop fills in a
+ * conn_io with its own ways of doing that, and drives its connections
+ * through conn_drive whenever one may make progress.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "proxy.h"
+#include "proxy_cache.h"
+#include "upstream.h"
+#include "dns.h"
+#include "timer.h"
+#include "admit.h"
+
+#define CONN_IN   MAXBUF                     /* Bytes of a conn's in */
+#define CONN_OUT  (MAXBUF + CONN_HDR_ROOM)   /* Bytes of a conn's buf */
+
+enum conn_state {
+    CONN_READ_REQUEST,  /* Accumulating the client's request header */
+    CONN_QUEUED,        /* Waiting for a slot at the origin */
+    CONN_RESOLVE,       /* Waiting for a resolver thread's lookup */
+    CONN_CONNECT,       /* Connect to the origin in flight */
+    CONN_SEND_REQUEST,  /* Writing the rewritten request to the origin */
+    CONN_RELAY,         /* Copying the origin's response to the client */
+    CONN_SPLICE,        /* Moving an uncached body the event loop's way */
+    CONN_SEND_HIT,      /* Writing a cached object to the client */
+    CONN_JOIN,          /* Relaying another connection's cache fill */
+    CONN_SEND_ERROR,    /* Writing a locally generated error response */
+    CONN_CLOSED         /* Torn down, freed after the current batch */
+};
+
+/* What a connection's timer is running for */
+enum conn_timeout {
+    TIMEOUT_NONE,
+    TIMEOUT_IDLE,       /* No next request yet (CLIENT_IDLE_TIMEOUT) */
+    TIMEOUT_HEADER,     /* Rest of the request header (HEADER_TIMEOUT) */
+    TIMEOUT_CONNECT,    /* Connect to one address (CONNECT_TIMEOUT) */
+    TIMEOUT_RESPONSE,   /* Origin's response header (HEADER_TIMEOUT) */
+    TIMEOUT_BODY,       /* Progress on the response (BODY_TIMEOUT) */
+    TIMEOUT_QUEUE,      /* Slot at the origin (ADMIT_QUEUE_TIMEOUT) */
+    TIMEOUT_RESOLVE     /* Lookup of the origin (CONNECT_TIMEOUT) */
+};
+
+struct conn_loop;
+
+/*
+ * A client connection. The event loop allocates it with room for what
+ * it keeps of its own after it, and points in and buf at CONN_IN and
+ * CONN_OUT bytes.
+ */
+typedef struct conn {
+    enum conn_state state;
+    int clientfd;
+    int serverfd;
+    struct conn_loop *loop;      /* Event loop that owns this connection */
+    int busy;                    /* An operation is in flight (io_uring) */
+    int expired;                 /* Timed out, op in flight cancelled */
+    dns_addrs addrs;             /* Origin addresses being tried */
+    dns_query query;             /* Lookup of the origin that missed */
+    int next_addr;               /* Index of the connect in flight */
+    char *host;                  /* Origin of the request being fetched */
+    char *port;
+    struct iovec iov[REQ_IOV_MAX];  /* Rewritten request, or a hit */
+    struct iovec *iov_next;      /* First piece not completely sent */
+    int niov;                    /* Pieces left from iov_next on */
+    int reused;                  /* serverfd came from the idle pool */
+    int answered;                /* Some of the response has arrived */
+    http_framer fr;              /* Finds the end of the response */
+    size_t len;                  /* Valid bytes in buf */
+    size_t off;                  /* Bytes of buf already written out */
+    size_t obj_off;              /* Bytes of the fill consumed */
+    int server_eof;              /* Origin is done with the response */
+    int hdr_done;                /* Response header relayed to the client */
+    int client;                  /* CLIENT_* reuse of the client connection */
+    int unchunk;                 /* Relay a chunked body without its framing */
+    cache_block *hit;            /* Cached object being sent, if any */
+    cache_block *stale;          /* Cached object being revalidated */
+    cache_fill *fill;            /* Fill this connection leads or reads */
+    char *how;                   /* HIT, JOIN or MISS, for the access log */
+    int leader;                  /* This connection feeds the fill */
+    fill_waiter waiter;          /* Wakes a reader when the fill grows */
+    admit_waiter admit;          /* Wakes it when the origin has a slot */
+    int origin_held;             /* Holds a slot at the origin */
+    int ready_queued;            /* On the loop's ready list */
+    struct conn *next_ready;
+    struct conn *next_dead;      /* Link on the loop's dead list */
+    timer tm;                    /* Fires when the timeout runs out */
+    enum conn_timeout timeout;   /* What tm is running for */
+    unsigned long active;        /* Wheel tick the conn last ran on */
+    size_t in_len;               /* Valid bytes in in */
+    size_t req_end;              /* End of the current request in in */
+    http_request hr;             /* The current request, parsed from in */
+    char *in;                    /* Requests read from the client */
+    char *buf;                   /* Response, or an error for it */
+} conn_t;
+
+/*
+ * How an event loop does I/O for its connections. The calls that move
+ * data follow read(2) and write(2) on a nonblocking socket: one that
+ * would have to wait fails with EAGAIN, or returns 0, and the step that
+ * made it is run again by conn_drive once the loop has seen the socket
+ * become ready, or the operation complete.
+ */
+typedef struct conn_io {
+    /* read(2) from fd */
+    ssize_t (*read)(conn_t *c, int fd, char *data, size_t n);
+    /* Write data[*off..len) to the client: 1 once it is all out, 0 if
+       it has to wait or the connection was closed */
+    int (*send)(conn_t *c, char *data, size_t len, size_t *off);
+    /* Write the pieces left from c->iov_next to fd: 1 once all are
+       out, 0 if it has to wait, -1 if the write failed */
+    int (*send_iov)(conn_t *c, int fd);
+    /* Open c->serverfd for address a and start connecting it; -1 if
+       no socket could be had */
+    int (*connect)(conn_t *c, struct dns_addr *a);
+    /* How the connect on c->serverfd went: 1 connected, 0 not yet,
+       -1 failed */
+    int (*connected)(conn_t *c);
+    /* Start watching a pooled origin connection now in use */
+    void (*watch)(conn_t *c, int fd);
+    /* Stop watching the origin connection; 0 if it may go back to the
+       pool */
+    int (*unwatch)(conn_t *c, int fd);
+    /* Take over the rest of an uncached body, moving to CONN_SPLICE;
+       0 if not. NULL if the loop has no better way than read and send. */
+    int (*splice)(conn_t *c);
+    /* Run a connection in CONN_SPLICE, as the steps in conn.c do */
+    int (*do_splice)(conn_t *c);
+    /* Cancel the operation in flight of a busy connection */
+    void (*cancel)(conn_t *c);
+    /* Release what the loop holds for a connection being closed */
+    void (*close)(conn_t *c);
+    /* Free a connection closed in the batch that just ended */
+    void (*free)(conn_t *c);
+    /* Take connections on the loop's listener again after
+       conn_accept_pause */
+    void (*accept)(struct conn_loop *lp);
+} conn_io;
+
+/* The part of an event loop that conn.c works with, first in it */
+typedef struct conn_loop {
+    const conn_io *io;
+    timer_wheel wheel;           /* Timeouts of the connections */
+    conn_t *dead;                /* Connections closed in this batch */
+    int evfd;                    /* Wakes the loop for ready conns */
+    pthread_mutex_t ready_lock;  /* Protects ready */
+    conn_t *ready;               /* Connections woken by other threads */
+    int accept_paused;           /* Out of descriptors, not accepting */
+    timer accept_tm;             /* Ends the pause if nothing closes */
+    unsigned long accept_warned; /* Wheel tick of the next warning */
+} conn_loop;
+
+void conn_loop_init(conn_loop *lp, const conn_io *io, int evfd);
+int conn_admit(int connfd);
+void conn_init(conn_t *c, conn_loop *lp, int connfd);
+void conn_drive(conn_t *c);
+void conn_timed_out(conn_t *c);
+void conn_close(conn_t *c);
+void conn_run_ready(conn_loop *lp);
+void conn_batch_end(conn_loop *lp);
+void conn_accept_pause(conn_loop *lp, int err);
+
+#endif /* __CONN_H__ */
@@ -0,0 +1,530 @@
+/*
+ *                     disk.c
+ *
+ * The disk tier: an append-only log of records, each a disk_rec header,
+ * the URI with its NUL and the response, and a hash index of the URIs
+ * in it, under one mutex. The log file is written and read without the
+ * mutex held: an append first claims its bytes at the end of the log,
+ * and only indexes the record once it has been written. A record that
+ * is replaced or forgotten stays in the file as dead bytes until the
+ * next compaction.
+ *
+ * The compactor copies the records it picked without the mutex, then
+ * takes it to move the index over to the new log, copying whatever was
+ * appended in the meantime. The log is a disk_log that is reference
+ * counted, so a reader that found an object in the old log can still
+ * read it there after the rename.
+ *
+ * A log kept across a restart is indexed again by reading its records
+ * in order, so a later copy of an object wins over an earlier one. The
+ * log is cut at the first record that is not whole, such as one that
+ * was being written when the proxy stopped.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include "disk.h"
+
+#define DISK_MAGIC 0x70786f62u    /* Starts every record */
+#define COPY_BUF   (64 * 1024)    /* Bytes moved per read by the compactor */
+
+/* Header of a record; the tag and the response follow it */
+typedef struct disk_rec {
+    unsigned int magic;
+    unsigned int tag_len;         /* Bytes of the tag, NUL included */
+    unsigned int size;            /* Bytes of the response */
+    unsigned int hdr_len;
+    long expires;
+    int must_revalidate;
+    unsigned int hash;            /* The cache's hash of the tag */
+} disk_rec;
+
+typedef struct disk_log {
+    int fd;
+    int refcnt;                   /* The tier's while current, and readers' */
+} disk_log;
+
+typedef struct disk_entry {
+    char *tag;
+    unsigned int hash;
+    off_t off;                    /* Offset of the record in the log */
+    unsigned int len;             /* Bytes of the whole record */
+    unsigned int size;
+    unsigned int hdr_len;
+    long expires;
+    int must_revalidate;
+    struct disk_entry *next;      /* Next entry in the hash bucket */
+} disk_entry;
+
+/* A record the compactor copies: where it was and where it goes */
+typedef struct disk_move {
+    off_t from;
+    off_t to;
+    unsigned int len;
+} disk_move;
+
+int disk_enabled;
+
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static char *log_path;
+static size_t log_limit;          /* Bytes the log may take */
+static disk_log *cur;             /* Log being appended to */
+static off_t log_end;             /* Bytes claimed in cur */
+static int compact_wanted;        /* A spill found the log full */
+static disk_entry *buckets[DISK_BUCKETS];
+static disk_stats stats;          /* Protected by disk_lock */
+
+static void *compactor(void *vargp);
+static void load_log(void);
+static void index_record(char *tag, unsigned int hash, off_t off,
+                         disk_rec *rec);
+static void compact(void);
+static int pick_records(disk_move **movesp);
+static disk_move *find_move(disk_move *moves, int n, off_t from);
+static disk_entry **disk_find(char *tag, unsigned int hash);
+static void drop_entry(disk_entry **pp);
+static void log_put(disk_log *lg);
+static int copy_bytes(int from, off_t off, int to, off_t to_off,
+                      size_t len, char *buf);
+static int cmp_entry(const void *a, const void *b);
+
+/*
+ * disk_init - turn the disk tier on, with a log of at most limit bytes
+ *     at path, and start the compactor. If keep is set, the objects
+ *     already in the log are indexed again; otherwise it starts empty.
+ */
+void disk_init(char *path, size_t limit, int keep)
+{
+    pthread_t tid;
+
+    log_path = Malloc(strlen(path) + 1);
+    strcpy(log_path, path);
+    log_limit = limit;
+    cur = Malloc(sizeof(disk_log));
+    cur->fd = Open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0600);
+    cur->refcnt = 1;
+    log_end = 0;
+    if (keep)
+        load_log();
+    disk_enabled = 1;
+    Pthread_create(&tid, NULL, compactor, NULL);
+}
+
+/*
+ * disk_put - append an object evicted from memory to the log, in place
+ *     of any older copy; it is dropped if the log is full
+ */
+void disk_put(char *tag, unsigned int hash, char *content,
+              unsigned int size, unsigned int hdr_len, long expires,
+              int must_revalidate)
+{
+    disk_rec rec;
+    struct iovec iov[3];
+    size_t tag_len = strlen(tag) + 1;
+    size_t len = sizeof(rec) + tag_len + size;
+    disk_log *lg;
+    off_t off;
+    int ok;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = DISK_MAGIC;
+    rec.tag_len = tag_len;
+    rec.size = size;
+    rec.hdr_len = hdr_len;
+    rec.expires = expires;
+    rec.must_revalidate = must_revalidate;
+    rec.hash = hash;
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = tag;
+    iov[1].iov_len = tag_len;
+    iov[2].iov_base = content;
+    iov[2].iov_len = size;
+
+    pthread_mutex_lock(&disk_lock);
+    if (log_end + len > log_limit) {
+        stats.dropped++;
+        compact_wanted = 1;
+        pthread_cond_signal(&compact_cond);
+        pthread_mutex_unlock(&disk_lock);
+        return;
+    }
+    off = log_end;
+    log_end += len;
+    lg = cur;
+    lg->refcnt++;
+    pthread_mutex_unlock(&disk_lock);
+
+    ok = (pwritev(lg->fd, iov, 3, off) == (ssize_t)len);
+    if (!ok)
+        log_warn("disk: cannot write to %s: %s", log_path, strerror(errno));
+
+    pthread_mutex_lock(&disk_lock);
+    // A compaction that moved the index on has left this record behind.
+    if (ok && lg == cur) {
+        index_record(tag, hash, off, &rec);
+        stats.spills++;
+    }
+    log_put(lg);
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * disk_lookup - find the fresh object for tag in the log; the log is
+ *     held open for the disk_read that must follow. Returns -1 if there
+ *     is none, dropping an expired one.
+ */
+int disk_lookup(char *tag, unsigned int hash, disk_object *obj)
+{
+    disk_entry *e, **pp;
+    int rc = -1;
+
+    pthread_mutex_lock(&disk_lock);
+    if ((e = *(pp = disk_find(tag, hash))) != NULL) {
+        if (e->expires > time(NULL)) {
+            obj->log = cur;
+            obj->off = e->off + sizeof(disk_rec) + strlen(e->tag) + 1;
+            obj->size = e->size;
+            obj->hdr_len = e->hdr_len;
+            obj->expires = e->expires;
+            obj->must_revalidate = e->must_revalidate;
+            cur->refcnt++;
+            rc = 0;
+        } else
+            drop_entry(pp);
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return rc;
+}
+
+/*
+ * disk_read - read the response of an object found by disk_lookup into
+ *     buf, which has room for obj->size bytes, and let go of the log;
+ *     returns -1 if it could not be read
+ */
+int disk_read(disk_object *obj, char *buf)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < obj->size) {
+        if ((n = pread(obj->log->fd, buf + done, obj->size - done,
+                       obj->off + done)) > 0)
+            done += n;
+        else if (n == 0 || errno != EINTR)
+            break;
+    }
+    if (done < obj->size)
+        log_warn("disk: cannot read from %s", log_path);
+    pthread_mutex_lock(&disk_lock);
+    if (done == obj->size)
+        stats.hits++;
+    log_put(obj->log);
+    pthread_mutex_unlock(&disk_lock);
+    return (done == obj->size) ? 0 : -1;
+}
+
+/*
+ * disk_forget - drop the object for tag, which is cached in memory now
+ */
+void disk_forget(char *tag, unsigned int hash)
+{
+    disk_entry **pp;
+
+    pthread_mutex_lock(&disk_lock);
+    if (*(pp = disk_find(tag, hash)) != NULL)
+        drop_entry(pp);
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * disk_get_stats - a consistent copy of the counters
+ */
+void disk_get_stats(disk_stats *st)
+{
+    pthread_mutex_lock(&disk_lock);
+    *st = stats;
+    st->end = log_end;
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * compactor - compact the log whenever a spill finds it full
+ */
+static void *compactor(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&disk_lock);
+        while (!compact_wanted)
+            pthread_cond_wait(&compact_cond, &disk_lock);
+        pthread_mutex_unlock(&disk_lock);
+        compact();
+        pthread_mutex_lock(&disk_lock);
+        compact_wanted = 0;
+        pthread_mutex_unlock(&disk_lock);
+    }
+    return NULL;
+}
+
+/*
+ * compact - copy the records worth keeping into a new log and switch
+ *     the index over to it. Records appended while the copy runs are
+ *     copied after it, under the lock. If the new log cannot be written,
+ *     the index is emptied instead, so that the tier starts over.
+ */
+static void compact(void)
+{
+    char tmp[MAXLINE], *buf;
+    disk_move *moves, *m;
+    disk_entry *e, **pp;
+    disk_log *old, *lg;
+    off_t end = 0;
+    int i, n, fd, ok = 1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", log_path);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        log_warn("disk: cannot create %s: %s", tmp, strerror(errno));
+        return;
+    }
+    buf = Malloc(COPY_BUF);
+
+    pthread_mutex_lock(&disk_lock);
+    n = pick_records(&moves);
+    old = cur;
+    old->refcnt++;
+    pthread_mutex_unlock(&disk_lock);
+
+    for (i = 0; i < n && ok; i++) {
+        moves[i].to = end;
+        ok = (copy_bytes(old->fd, moves[i].from, fd, end, moves[i].len,
+                         buf) == 0);
+        end += moves[i].len;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+    for (i = 0; i < DISK_BUCKETS; i++) {
+        for (pp = &buckets[i]; (e = *pp) != NULL; ) {
+            if (ok && (m = find_move(moves, n, e->off)) != NULL)
+                e->off = m->to;
+            else if (ok && copy_bytes(old->fd, e->off, fd, end, e->len,
+                                      buf) == 0) {
+                e->off = end;
+                end += e->len;
+            } else {
+                drop_entry(pp);
+                continue;
+            }
+            pp = &e->next;
+        }
+    }
+    if (!ok) {
+        log_warn("disk: cannot compact %s, emptying it", log_path);
+        end = 0;
+        if (ftruncate(fd, 0) < 0)
+            log_warn("disk: cannot truncate %s", tmp);
+    }
+    if (rename(tmp, log_path) < 0)
+        log_warn("disk: cannot rename %s: %s", tmp, strerror(errno));
+    lg = Malloc(sizeof(disk_log));
+    lg->fd = fd;
+    lg->refcnt = 1;
+    cur = lg;
+    log_end = end;
+    stats.compactions++;
+    log_put(old);                 /* The tier's reference */
+    log_put(old);                 /* Ours */
+    pthread_mutex_unlock(&disk_lock);
+    Free(moves);
+    Free(buf);
+}
+
+/*
+ * load_log - index the records of a log left by an earlier run, up to
+ *     the first one that is not whole, and cut the log there
+ */
+static void load_log(void)
+{
+    char tag[MAXLINE];
+    disk_rec rec;
+    struct stat st;
+    off_t off = 0, len;
+    long now = time(NULL);
+    int n = 0;
+
+    if (fstat(cur->fd, &st) < 0)
+        return;
+    while (pread(cur->fd, &rec, sizeof(rec), off) == sizeof(rec)
+           && rec.magic == DISK_MAGIC && rec.tag_len > 0
+           && rec.tag_len <= MAXLINE && rec.size <= MAX_OBJECT_SIZE
+           && rec.hdr_len <= rec.size
+           && off + (len = sizeof(rec) + rec.tag_len + rec.size) <= st.st_size
+           && pread(cur->fd, tag, rec.tag_len, off + sizeof(rec))
+              == rec.tag_len
+           && tag[rec.tag_len - 1] == '\0') {
+        if (rec.expires > now)
+            index_record(tag, rec.hash, off, &rec);
+        else if (*disk_find(tag, rec.hash) != NULL)
+            drop_entry(disk_find(tag, rec.hash));
+        off += len;
+        n++;
+    }
+    if (off < st.st_size && ftruncate(cur->fd, off) < 0)
+        log_warn("disk: cannot truncate %s", log_path);
+    log_end = off;
+    log_info("disk: indexed %lu fresh objects from %d records in %s",
+             stats.entries, n, log_path);
+}
+
+/*
+ * index_record - point the index entry for tag at the record rec, at
+ *     off in the current log; the lock must be held, or the tier not
+ *     yet on
+ */
+static void index_record(char *tag, unsigned int hash, off_t off,
+                         disk_rec *rec)
+{
+    disk_entry *e, **pp;
+
+    if ((e = *(pp = disk_find(tag, hash))) == NULL) {
+        e = Malloc(sizeof(disk_entry));
+        e->tag = Malloc(rec->tag_len);
+        memcpy(e->tag, tag, rec->tag_len);
+        e->hash = hash;
+        e->next = NULL;
+        *pp = e;
+        stats.entries++;
+    } else
+        stats.live -= e->len;
+    e->off = off;
+    e->len = sizeof(*rec) + rec->tag_len + rec->size;
+    e->size = rec->size;
+    e->hdr_len = rec->hdr_len;
+    e->expires = rec->expires;
+    e->must_revalidate = rec->must_revalidate;
+    stats.live += e->len;
+}
+
+/*
+ * pick_records - drop expired objects, then the oldest ones, until the
+ *     rest take at most half of the log's limit, and return how many
+ *     are left, with where their records are in *movesp in log order;
+ *     the lock must be held
+ */
+static int pick_records(disk_move **movesp)
+{
+    disk_entry **all, *e;
+    disk_move *moves;
+    long now = time(NULL);
+    int i, n = 0, kept = 0;
+
+    all = Malloc((stats.entries + 1) * sizeof(disk_entry *));
+    for (i = 0; i < DISK_BUCKETS; i++)
+        for (e = buckets[i]; e; e = e->next)
+            all[n++] = e;
+    qsort(all, n, sizeof(disk_entry *), cmp_entry);
+    moves = Malloc((n + 1) * sizeof(disk_move));
+    for (i = 0; i < n; i++) {
+        e = all[i];
+        if (e->expires <= now || stats.live > log_limit / 2)
+            drop_entry(disk_find(e->tag, e->hash));
+        else {
+            moves[kept].from = e->off;
+            moves[kept].len = e->len;
+            kept++;
+        }
+    }
+    Free(all);
+    *movesp = moves;
+    return kept;
+}
+
+/*
+ * find_move - the move of the record at from, or NULL if it was not
+ *     copied; moves are sorted by from
+ */
+static disk_move *find_move(disk_move *moves, int n, off_t from)
+{
+    int lo = 0, hi = n - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (moves[mid].from == from)
+            return &moves[mid];
+        if (moves[mid].from < from)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/*
+ * disk_find - return the link that points at the entry for tag, or at
+ *     the NULL ending its bucket if there is none; the lock must be held
+ */
+static disk_entry **disk_find(char *tag, unsigned int hash)
+{
+    disk_entry **pp = &buckets[hash % DISK_BUCKETS];
+
+    while (*pp && ((*pp)->hash != hash || strcmp((*pp)->tag, tag)))
+        pp = &(*pp)->next;
+    return pp;
+}
+
+/*
+ * drop_entry - unlink and free the entry *pp points at
+ */
+static void drop_entry(disk_entry **pp)
+{
+    disk_entry *e = *pp;
+
+    *pp = e->next;
+    stats.entries--;
+    stats.live -= e->len;
+    Free(e->tag);
+    Free(e);
+}
+
+/*
+ * log_put - drop a reference to a log, closing it with the last; the
+ *     lock must be held
+ */
+static void log_put(disk_log *lg)
+{
+    if (--lg->refcnt > 0)
+        return;
+    close(lg->fd);
+    Free(lg);
+}
+
+/*
+ * copy_bytes - copy len bytes at off in from to to_off in to, through
+ *     buf of COPY_BUF bytes; returns -1 on a failed or short transfer
+ */
+static int copy_bytes(int from, off_t off, int to, off_t to_off,
+                      size_t len, char *buf)
+{
+    ssize_t n;
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = (len < COPY_BUF) ? len : COPY_BUF;
+        if ((n = pread(from, buf, chunk, off)) <= 0
+            || pwrite(to, buf, n, to_off) != n)
+            return -1;
+        off += n;
+        to_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+    off_t x = (*(disk_entry **)a)->off, y = (*(disk_entry **)b)->off;
+
+    return (x > y) - (x < y);
+}
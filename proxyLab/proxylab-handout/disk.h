@@ -0,0 +1,69 @@
+/*
+ *                     disk.h
+ *
+ * Second cache tier on disk, turned on with "-d file". Objects evicted
+ * from the memory cache while still fresh are appended to a log file,
+ * and an index in memory maps their URIs to where they are in it. A
+ * miss in memory that finds its object here reads it back with pread
+ * and promotes it into the memory cache, taking it out of the log's
+ * index; evicted again, it is appended again. An object the memory
+ * cache does not admit stays in the log and is read from it each time.
+ *
+ * The log never grows past its limit ("-D megabytes"). A spill that
+ * would not fit wakes the compactor thread and is dropped. The
+ * compactor copies the records still indexed into a new log, dropping
+ * expired ones and then the oldest until they fill at most half of the
+ * limit, and renames it over the old one. Readers that are still
+ * reading the old log keep it open until they are done.
+ *
+ * Every record carries its URI and freshness as well as the response,
+ * so the log can be read back on its own: with "-w" (warm restart) the
+ * log is kept and indexed again at startup instead of being emptied.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "proxy.h"
+
+#define DISK_BUCKETS      (64 * 1024)  /* Hash buckets of the index */
+#define DISK_DEFAULT_MB   1024         /* Default limit of the log */
+
+struct disk_log;
+
+/* Where an object found in the index is, and what it is */
+typedef struct disk_object {
+    struct disk_log *log;         /* Held open until disk_read */
+    off_t off;                    /* Offset of the response in the log */
+    unsigned int size;            /* Bytes of the response */
+    unsigned int hdr_len;         /* Bytes of its header block */
+    long expires;
+    int must_revalidate;
+} disk_object;
+
+typedef struct disk_stats {
+    unsigned long hits;           /* Objects promoted from the log */
+    unsigned long spills;         /* Objects appended to the log */
+    unsigned long dropped;        /* Spills that found the log full */
+    unsigned long compactions;
+    unsigned long entries;        /* Objects indexed now */
+    unsigned long live;           /* Bytes of their records */
+    unsigned long end;            /* Bytes of the log */
+} disk_stats;
+
+/* Nonzero when the disk tier is on */
+extern int disk_enabled;
+
+void disk_init(char *path, size_t limit, int keep);
+void disk_put(char *tag, unsigned int hash, char *content,
+              unsigned int size, unsigned int hdr_len, long expires,
+              int must_revalidate);
+int disk_lookup(char *tag, unsigned int hash, disk_object *obj);
+int disk_read(disk_object *obj, char *buf);
+void disk_forget(char *tag, unsigned int hash);
+void disk_get_stats(disk_stats *st);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,397 @@
+/*
+ *                     dns.c
+ *
+ * Resolver cache: a hash table of (host, port) entries under one mutex.
+ * Lookups copy the addresses out, so no caller ever holds on to an
+ * entry, and getaddrinfo runs without the lock held. Concurrent misses
+ * on the same host may each resolve it; the last answer is kept.
+ * Expired entries are dropped when their bucket is next searched.
+ *
+ * Queued lookups wait in a FIFO under a second mutex, resolve_lock, for
+ * DNS_RESOLVERS threads started with the first of them. A thread copies
+ * the host and port out, so a query may be cancelled and its memory
+ * reused while getaddrinfo runs; resolving[] records which query each
+ * thread works for, and a cancel just clears it. The answer is stored
+ * and the query woken with resolve_lock held, so once dns_query_done
+ * has seen it the thread is finished with the query.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <poll.h>
+#include "dns.h"
+
+typedef struct dns_entry {
+    char *host;
+    char *port;
+    unsigned int hash;
+    int error;                    /* getaddrinfo error, 0 if resolved */
+    long expires;                 /* When to resolve again, in us */
+    dns_addrs addrs;
+    struct dns_entry *next;       /* Next entry in the hash bucket */
+} dns_entry;
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static dns_entry *buckets[DNS_BUCKETS];
+static dns_stats stats;           /* Protected by dns_lock */
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+static dns_query *queue_head;     /* Lookups no thread has taken yet */
+static dns_query **queue_tail = &queue_head;
+static dns_query *resolving[DNS_RESOLVERS]; /* Each thread's query */
+
+static int dns_cached(char *host, char *port, unsigned int h,
+                      dns_addrs *out, int *rc);
+static void resolve_start(void);
+static void *resolver(void *vargp);
+static int connect_timeout(int fd, struct dns_addr *a);
+static dns_entry **dns_find(char *host, char *port, unsigned int h,
+                            long now);
+static void dns_store(char *host, char *port, unsigned int h, int error,
+                      dns_addrs *addrs, long now);
+static long now_us(void);
+
+/*
+ * dns_lookup - the addresses of host:port, from the cache or else from
+ *     getaddrinfo; returns 0, or the getaddrinfo error code
+ */
+int dns_lookup(char *host, char *port, dns_addrs *out)
+{
+    unsigned int h = hash_origin(host, port);
+    struct addrinfo hints, *listp, *p;
+    long start, spent;
+    int rc;
+
+    start = now_us();
+    if (dns_cached(host, port, h, out, &rc))
+        return rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    out->n = 0;
+    if ((rc = getaddrinfo(host, port, &hints, &listp)) == 0) {
+        for (p = listp; p && out->n < DNS_MAX_ADDRS; p = p->ai_next) {
+            if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+                continue;
+            out->addr[out->n].family = p->ai_family;
+            out->addr[out->n].socktype = p->ai_socktype;
+            out->addr[out->n].protocol = p->ai_protocol;
+            out->addr[out->n].len = p->ai_addrlen;
+            memcpy(&out->addr[out->n].addr, p->ai_addr, p->ai_addrlen);
+            out->n++;
+        }
+        freeaddrinfo(listp);
+    }
+    spent = now_us() - start;
+
+    pthread_mutex_lock(&dns_lock);
+    stats.misses++;
+    if (rc)
+        stats.failures++;
+    stats.resolve_us += spent;
+    if (spent > (long)stats.resolve_max_us)
+        stats.resolve_max_us = spent;
+    // Running out of memory says nothing about the host.
+    if (rc != EAI_SYSTEM && rc != EAI_MEMORY)
+        dns_store(host, port, h, rc, out, start + spent);
+    pthread_mutex_unlock(&dns_lock);
+    if (rc)
+        log_warn("Could not resolve %s:%s: %s", host, port,
+                 gai_strerror(rc));
+    return rc;
+}
+
+/*
+ * dns_lookup_async - dns_lookup without blocking: answers from the cache
+ *     as it does, and otherwise queues q for a resolver thread and
+ *     returns DNS_QUEUED; q->wake is called once the lookup is done
+ */
+int dns_lookup_async(dns_query *q)
+{
+    int rc;
+
+    if (dns_cached(q->host, q->port, hash_origin(q->host, q->port),
+                   q->out, &rc))
+        return rc;
+    pthread_once(&resolve_once, resolve_start);
+    pthread_mutex_lock(&resolve_lock);
+    q->done = 0;
+    q->next = NULL;
+    *queue_tail = q;
+    queue_tail = &q->next;
+    pthread_cond_signal(&resolve_cond);
+    pthread_mutex_unlock(&resolve_lock);
+    return DNS_QUEUED;
+}
+
+/*
+ * dns_query_done - whether the lookup of q is done, with q->rc and
+ *     q->out set; no resolver thread uses q any more once it is
+ */
+int dns_query_done(dns_query *q)
+{
+    if (!__atomic_load_n(&q->done, __ATOMIC_ACQUIRE))
+        return 0;
+    // Wait for the thread to return from q->wake.
+    pthread_mutex_lock(&resolve_lock);
+    pthread_mutex_unlock(&resolve_lock);
+    return 1;
+}
+
+/*
+ * dns_cancel - stop waiting for the queued lookup q, which is then no
+ *     longer used; a lookup already running still fills the cache
+ */
+void dns_cancel(dns_query *q)
+{
+    dns_query **qp;
+    int i;
+
+    pthread_mutex_lock(&resolve_lock);
+    for (qp = &queue_head; *qp; qp = &(*qp)->next) {
+        if (*qp == q) {
+            if ((*qp = q->next) == NULL)
+                queue_tail = qp;
+            break;
+        }
+    }
+    for (i = 0; i < DNS_RESOLVERS; i++)
+        if (resolving[i] == q)
+            resolving[i] = NULL;
+    pthread_mutex_unlock(&resolve_lock);
+}
+
+/*
+ * dns_forget - drop what is cached for host:port, for instance when
+ *     none of its addresses accepts a connection any more
+ */
+void dns_forget(char *host, char *port)
+{
+    unsigned int h = hash_origin(host, port);
+    dns_entry **ep, *e;
+
+    pthread_mutex_lock(&dns_lock);
+    if ((e = *(ep = dns_find(host, port, h, now_us()))) != NULL) {
+        *ep = e->next;
+        stats.entries--;
+        Free(e->host);
+        Free(e);
+    }
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * dns_open_clientfd - open_clientfd through the resolver cache, giving
+ *     each address CONNECT_TIMEOUT seconds: returns a connected socket,
+ *     -2 if host:port does not resolve, and -1 if none of its addresses
+ *     accepts the connection, with errno ETIMEDOUT if the last one did
+ *     not answer in time
+ */
+int dns_open_clientfd(char *host, char *port)
+{
+    dns_addrs addrs;
+    struct dns_addr *a;
+    int i, fd, timed_out = 0;
+
+    if (dns_lookup(host, port, &addrs) != 0)
+        return -2;
+    for (i = 0; i < addrs.n; i++) {
+        a = &addrs.addr[i];
+        if ((fd = socket(a->family, a->socktype, a->protocol)) < 0)
+            continue;
+        if ((timed_out = connect_timeout(fd, a)) == 0)
+            return fd;
+        Close(fd);
+    }
+    // The host may have moved; look it up again next time.
+    dns_forget(host, port);
+    if (timed_out > 0)
+        errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * dns_get_stats - a consistent copy of the counters
+ */
+void dns_get_stats(dns_stats *st)
+{
+    pthread_mutex_lock(&dns_lock);
+    *st = stats;
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/*
+ * dns_cached - look host:port up in the cache alone: 1, with its
+ *     dns_lookup result in rc, if it is there, and 0 if not
+ */
+static int dns_cached(char *host, char *port, unsigned int h,
+                      dns_addrs *out, int *rc)
+{
+    dns_entry *e;
+
+    pthread_mutex_lock(&dns_lock);
+    if ((e = *dns_find(host, port, h, now_us())) == NULL) {
+        pthread_mutex_unlock(&dns_lock);
+        return 0;
+    }
+    if ((*rc = e->error) == 0) {
+        *out = e->addrs;
+        stats.hits++;
+    } else
+        stats.negative_hits++;
+    pthread_mutex_unlock(&dns_lock);
+    return 1;
+}
+
+/*
+ * resolve_start - start the resolver threads, once
+ */
+static void resolve_start(void)
+{
+    pthread_t tid;
+    long i;
+
+    for (i = 0; i < DNS_RESOLVERS; i++)
+        Pthread_create(&tid, NULL, resolver, (void *)i);
+}
+
+/*
+ * resolver - resolve queued lookups forever, as resolver thread vargp
+ */
+static void *resolver(void *vargp)
+{
+    long i = (long)vargp;
+    char host[MAXLINE], port[MAXLINE];
+    dns_addrs addrs;
+    dns_query *q;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    pthread_mutex_lock(&resolve_lock);
+    while (1) {
+        while ((q = queue_head) == NULL)
+            pthread_cond_wait(&resolve_cond, &resolve_lock);
+        if ((queue_head = q->next) == NULL)
+            queue_tail = &queue_head;
+        resolving[i] = q;
+        snprintf(host, sizeof(host), "%s", q->host);
+        snprintf(port, sizeof(port), "%s", q->port);
+        pthread_mutex_unlock(&resolve_lock);
+
+        rc = dns_lookup(host, port, &addrs);
+
+        pthread_mutex_lock(&resolve_lock);
+        if (resolving[i] == q) {
+            resolving[i] = NULL;
+            q->rc = rc;
+            if (rc == 0)
+                *q->out = addrs;
+            __atomic_store_n(&q->done, 1, __ATOMIC_RELEASE);
+            q->wake(q->arg);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * connect_timeout - connect the blocking socket fd to a, waiting at most
+ *     CONNECT_TIMEOUT seconds; returns 0 once connected, 1 if the time
+ *     ran out, and -1 if the connect failed
+ */
+static int connect_timeout(int fd, struct dns_addr *a)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int flags, err = 0, rc;
+
+    // Only the connect is nonblocking; the caller gets a blocking fd.
+    if ((flags = fcntl(fd, F_GETFL)) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return -1;
+    if (connect(fd, (SA *)&a->addr, a->len) < 0) {
+        if (errno != EINPROGRESS)
+            return -1;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        while ((rc = poll(&pfd, 1, CONNECT_TIMEOUT * 1000)) < 0
+               && errno == EINTR)
+            ;
+        if (rc == 0)
+            return 1;
+        if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+            || err != 0)
+            return -1;
+    }
+    return fcntl(fd, F_SETFL, flags) < 0 ? -1 : 0;
+}
+
+/*
+ * dns_find - the link that points to the live entry for host:port, or
+ *     to the end of its bucket. Expired entries passed on the way are
+ *     freed. Call with dns_lock held.
+ */
+static dns_entry **dns_find(char *host, char *port, unsigned int h,
+                            long now)
+{
+    dns_entry **ep, *e;
+
+    ep = &buckets[h % DNS_BUCKETS];
+    while ((e = *ep) != NULL) {
+        if (e->expires <= now) {
+            *ep = e->next;
+            stats.entries--;
+            Free(e->host);
+            Free(e);
+            continue;
+        }
+        if (e->hash == h && !strcmp(e->host, host)
+            && !strcmp(e->port, port))
+            break;
+        ep = &e->next;
+    }
+    return ep;
+}
+
+/*
+ * dns_store - cache the outcome of resolving host:port, unless the
+ *     table is full. Call with dns_lock held.
+ */
+static void dns_store(char *host, char *port, unsigned int h, int error,
+                      dns_addrs *addrs, long now)
+{
+    dns_entry **ep, *e;
+    size_t hostlen = strlen(host) + 1, portlen = strlen(port) + 1;
+
+    if ((e = *(ep = dns_find(host, port, h, now))) == NULL) {
+        if (stats.entries >= DNS_MAX_ENTRIES)
+            return;
+        // Host and port share one allocation with the entry's key.
+        e = Malloc(sizeof(dns_entry));
+        e->host = Malloc(hostlen + portlen);
+        memcpy(e->host, host, hostlen);
+        e->port = e->host + hostlen;
+        memcpy(e->port, port, portlen);
+        e->hash = h;
+        e->next = NULL;
+        *ep = e;
+        stats.entries++;
+    }
+    e->error = error;
+    // A resolver that is down is asked again soon, but not by every
+    // request in the meantime.
+    e->expires = now + 1000000L * (error == EAI_AGAIN ? DNS_AGAIN_TTL
+                                   : error ? DNS_NEG_TTL : DNS_TTL);
+    if (!error)
+        e->addrs = *addrs;
+}
+
+static long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,78 @@
+/*
+ *                     dns.h
+ *
+ * Resolver cache for origin servers. getaddrinfo is a blocking call
+ * that goes to the resolver for the same few origins over and over, so
+ * its results are kept per (host, port) for DNS_TTL seconds, and
+ * failures for DNS_NEG_TTL seconds (DNS_AGAIN_TTL when the resolver
+ * itself failed). getaddrinfo does not report record TTLs, so these
+ * fixed lifetimes stand in for them. Counters of hits, misses and time
+ * spent resolving show how much the cache saves.
+ *
+ * An event loop must not block in getaddrinfo, so it looks a host up
+ * with dns_lookup_async instead: a miss is queued as a dns_query for a
+ * small pool of resolver threads, and the query's wake callback is
+ * called from one of them once its answer is in, as fill and admission
+ * waiters are.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "proxy.h"
+
+#define DNS_BUCKETS     256   /* Hash buckets of the host table */
+#define DNS_MAX_ENTRIES 4096  /* Hosts cached at most */
+#define DNS_MAX_ADDRS   4     /* Addresses kept per host */
+#define DNS_TTL         60    /* Seconds a resolved host is kept */
+#define DNS_NEG_TTL     5     /* Seconds a failed lookup is kept */
+#define DNS_AGAIN_TTL   1     /* ... if the resolver failed temporarily */
+#define DNS_RESOLVERS   4     /* Threads resolving queued lookups */
+#define DNS_QUEUED      1     /* dns_lookup_async handed the lookup on */
+
+/* The addresses of a host, copied out of the cache for one caller */
+typedef struct dns_addrs {
+    int n;
+    struct dns_addr {
+        int family;
+        int socktype;
+        int protocol;
+        socklen_t len;
+        struct sockaddr_storage addr;
+    } addr[DNS_MAX_ADDRS];
+} dns_addrs;
+
+/* A lookup run by a resolver thread for an event loop */
+typedef struct dns_query {
+    char *host;                   /* What to look up, kept by the caller */
+    char *port;
+    dns_addrs *out;               /* Where the addresses go */
+    int rc;                       /* dns_lookup's result, once done */
+    int done;                     /* rc and out are set */
+    void (*wake)(void *arg);      /* Called once done, off the loop */
+    void *arg;
+    struct dns_query *next;       /* Next lookup in the queue */
+} dns_query;
+
+typedef struct dns_stats {
+    unsigned long hits;           /* Lookups answered from the cache */
+    unsigned long negative_hits;  /* ... with a cached failure */
+    unsigned long misses;         /* Lookups that called getaddrinfo */
+    unsigned long failures;       /* ... and got an error */
+    unsigned long resolve_us;     /* Time spent in getaddrinfo */
+    unsigned long resolve_max_us; /* Longest single getaddrinfo */
+    int entries;                  /* Hosts in the cache now */
+} dns_stats;
+
+int dns_lookup(char *host, char *port, dns_addrs *out);
+int dns_lookup_async(dns_query *q);
+int dns_query_done(dns_query *q);
+void dns_cancel(dns_query *q);
+void dns_forget(char *host, char *port);
+int dns_open_clientfd(char *host, char *port);
+void dns_get_stats(dns_stats *st);
+
+#endif /* __DNS_H__ */
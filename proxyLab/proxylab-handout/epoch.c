@@ -0,0 +1,217 @@
+/*
+ *                     epoch.c
+ *
+ * Three-epoch reclamation. Every thread that reads has a record with the
+ * global epoch it saw on entry and whether it is inside a section. An
+ * object retired while the global epoch is e goes on limbo list e % 3.
+ * The epoch only advances from e to e + 1 when every active reader has
+ * seen e, so by then no reader can still hold an object retired in
+ * e - 1, and that list is freed.
+ *
+ * Retiring is rare next to reading (blocks are only retired when they
+ * are evicted or replaced), so the limbo lists share one lock, and the
+ * epoch is only advanced when something is retired. Records are reused
+ * the way log.c reuses rings: an exiting thread releases its record and
+ * the next thread to read claims it.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "epoch.h"
+
+typedef struct epoch_rec {
+    unsigned long epoch;          /* Global epoch when the section began */
+    int active;                   /* Inside epoch_enter/epoch_exit */
+    int owned;                    /* A live thread uses this record */
+    struct epoch_rec *next;       /* All records, newest first */
+} epoch_rec;
+
+static unsigned long global_epoch;
+static epoch_rec *recs;                 /* Every record ever created */
+static pthread_mutex_t recs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_entry *limbo[3];           /* Retired, by epoch % 3 */
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rec_key;
+static __thread epoch_rec *my_rec;      /* Record of the calling thread */
+
+static epoch_rec *rec_claim(void);
+static void rec_release(void *arg);
+static void make_key(void);
+static epoch_entry *try_advance(void);
+static void free_all(epoch_entry *e);
+
+/*
+ * epoch_enter - start a read-side section
+ */
+void epoch_enter(void)
+{
+    epoch_rec *r = my_rec ? my_rec : rec_claim();
+
+    // Be seen as active before reading the epoch, and have read it
+    // before reading anything it protects.
+    __atomic_store_n(&r->active, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch,
+                                                __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * epoch_exit - end the read-side section; nothing read in it may be
+ *     used afterwards unless it was otherwise pinned
+ */
+void epoch_exit(void)
+{
+    __atomic_store_n(&my_rec->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * epoch_retire - e has been unlinked: call release(e) once no reader
+ *     can still see it
+ */
+void epoch_retire(epoch_entry *e, void (*release)(epoch_entry *e))
+{
+    epoch_entry *done;
+
+    e->release = release;
+    pthread_mutex_lock(&limbo_lock);
+    e->next = limbo[global_epoch % 3];
+    limbo[global_epoch % 3] = e;
+    done = try_advance();
+    pthread_mutex_unlock(&limbo_lock);
+    free_all(done);
+}
+
+/*
+ * epoch_barrier - wait until everything retired so far has been freed,
+ *     and whatever is retired meanwhile too; for tearing down
+ */
+void epoch_barrier(void)
+{
+    epoch_entry *done;
+    int i, left = 1;
+
+    while (left) {
+        pthread_mutex_lock(&limbo_lock);
+        done = try_advance();
+        for (i = 0, left = 0; i < 3; i++)
+            left |= (limbo[i] != NULL);
+        pthread_mutex_unlock(&limbo_lock);
+        free_all(done);
+        if (left)
+            sched_yield();
+    }
+}
+
+/*
+ * epoch_sync - wait until everything retired before the call has been
+ *     handed to its release function; unlike epoch_barrier, it is not
+ *     held up by what other threads retire in the meantime
+ */
+void epoch_sync(void)
+{
+    unsigned long target;
+    epoch_entry *done;
+    int left = 1;
+
+    // What was retired before now is on the list of this epoch or an
+    // older one, which is freed when the epoch moves on twice.
+    target = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) + 2;
+    while (left) {
+        pthread_mutex_lock(&limbo_lock);
+        done = (global_epoch < target) ? try_advance() : NULL;
+        left = (global_epoch < target);
+        pthread_mutex_unlock(&limbo_lock);
+        free_all(done);
+        if (left)
+            sched_yield();
+    }
+}
+
+/*
+ * try_advance - move the global epoch on if every active reader has
+ *     seen it, returning the objects that became safe to free; the
+ *     limbo lock must be held
+ */
+static epoch_entry *try_advance(void)
+{
+    unsigned long e = global_epoch;
+    epoch_entry *done;
+    epoch_rec *r;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next)
+        if (__atomic_load_n(&r->active, __ATOMIC_RELAXED)
+            && __atomic_load_n(&r->epoch, __ATOMIC_RELAXED) != e)
+            return NULL;
+    __atomic_store_n(&global_epoch, e + 1, __ATOMIC_SEQ_CST);
+    // Retired in e - 1, which is list (e + 1 + 1) % 3.
+    done = limbo[(e + 2) % 3];
+    limbo[(e + 2) % 3] = NULL;
+    return done;
+}
+
+static void free_all(epoch_entry *e)
+{
+    epoch_entry *next;
+
+    for (; e; e = next) {
+        next = e->next;
+        e->release(e);
+    }
+}
+
+/*
+ * rec_claim - give the calling thread a record: a released one if
+ *     there is one, otherwise a new one
+ */
+static epoch_rec *rec_claim(void)
+{
+    epoch_rec *r;
+    int unowned;
+
+    pthread_once(&key_once, make_key);
+    for (r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (r == NULL) {
+        if ((r = calloc(1, sizeof(epoch_rec))) == NULL) {
+            perror("epoch_enter");
+            exit(1);
+        }
+        r->owned = 1;
+        pthread_mutex_lock(&recs_lock);
+        r->next = recs;
+        __atomic_store_n(&recs, r, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&recs_lock);
+    }
+    my_rec = r;
+    pthread_setspecific(rec_key, r);
+    return r;
+}
+
+/*
+ * rec_release - a thread exited; its record goes to the next thread
+ */
+static void rec_release(void *arg)
+{
+    epoch_rec *r = arg;
+
+    __atomic_store_n(&r->active, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&rec_key, rec_release);
+}
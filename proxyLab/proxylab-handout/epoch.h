@@ -0,0 +1,32 @@
+/*
+ *                     epoch.h
+ *
+ * Epoch-based reclamation for data read without locks. A reader brackets
+ * its accesses with epoch_enter and epoch_exit; a writer that unlinks an
+ * object hands it to epoch_retire instead of freeing it. The object is
+ * freed once every thread that was reading when it was unlinked has left
+ * its epoch, so a reader never sees freed memory. Read-side sections
+ * should be short: one that never ends holds up all reclamation.
+ *
+ * This file does not depend on csapp.c.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/* Embedded in an object that may be retired */
+typedef struct epoch_entry {
+    struct epoch_entry *next;     /* Next object retired in its epoch */
+    void (*release)(struct epoch_entry *e);
+} epoch_entry;
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(epoch_entry *e, void (*release)(epoch_entry *e));
+void epoch_barrier(void);
+void epoch_sync(void);
+
+#endif /* __EPOCH_H__ */
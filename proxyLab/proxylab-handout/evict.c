@@ -0,0 +1,387 @@
+/*
+ *                     evict.c
+ *
+ * The cache's eviction policies and its TinyLFU admission filter. A
+ * queue is a circular list around a sentinel, newest at the front, so
+ * every policy evicts from root.prev. victim only chooses the next
+ * block to evict; the caller unlinks it with evict_remove, or keeps it
+ * if the admission filter turns the new block away.
+ *
+ * Hits under clock and s3fifo only store to the node's freq byte, with
+ * relaxed atomics, so they need no lock at all; an lru hit relinks the
+ * node and must hold the owner's lock. The sketch is updated without a
+ * lock as well: two lookups counted at once may count as one, which
+ * only makes the estimate a little lower.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "evict.h"
+
+#define SMALL       0     /* s3fifo queues */
+#define MAIN        1
+#define SMALL_SHARE 10    /* Percent of the budget for the small FIFO */
+#define S3_FREQ_MAX 3     /* s3fifo hit counter saturates here */
+#define SKETCH_ROWS 4
+#define SKETCH_MAX  15    /* Counters saturate here, as 4-bit ones would */
+#define SKETCH_AGE  10    /* Halve after this many lookups per counter */
+
+static void lru_insert(evict_state *es, evict_node *n);
+static void lru_hit(evict_state *es, evict_node *n);
+static evict_node *lru_victim(evict_state *es);
+static void clock_hit(evict_state *es, evict_node *n);
+static evict_node *clock_victim(evict_state *es);
+static void s3fifo_insert(evict_state *es, evict_node *n);
+static void s3fifo_hit(evict_state *es, evict_node *n);
+static evict_node *s3fifo_victim(evict_state *es);
+static void queue_push(evict_state *es, int q, evict_node *n);
+static void queue_unlink(evict_state *es, evict_node *n);
+static evict_node *queue_oldest(evict_state *es, int q);
+static unsigned int sketch_estimate(evict_state *es, unsigned int hash);
+static unsigned int sketch_slot(evict_state *es, unsigned int hash, int row);
+static unsigned int pow2_at_least(size_t n, unsigned int min);
+static unsigned char freq_get(evict_node *n);
+static void freq_set(evict_node *n, unsigned char f);
+static void *evict_calloc(size_t n, size_t size);
+
+const evict_policy evict_lru = { "lru", 1, lru_insert, lru_hit,
+                                 lru_victim };
+const evict_policy evict_clock = { "clock", 0, lru_insert, clock_hit,
+                                   clock_victim };
+const evict_policy evict_s3fifo = { "s3fifo", 0, s3fifo_insert, s3fifo_hit,
+                                    s3fifo_victim };
+
+static const evict_policy *policies[] = {
+    &evict_lru, &evict_clock, &evict_s3fifo, NULL
+};
+
+/*
+ * evict_policy_find - the policy called name, or NULL
+ */
+const evict_policy *evict_policy_find(char *name)
+{
+    const evict_policy **p;
+
+    for (p = policies; *p; p++)
+        if (!strcmp((*p)->name, name))
+            return *p;
+    return NULL;
+}
+
+/*
+ * evict_init - an empty state for budget bytes under policy, with the
+ *     TinyLFU sketch if admission is set. The ghost table and the sketch
+ *     are sized for blocks of a few KB on average.
+ */
+void evict_init(evict_state *es, const evict_policy *policy, size_t budget,
+                int admission)
+{
+    int i;
+
+    memset(es, 0, sizeof(*es));
+    es->policy = policy;
+    es->budget = budget;
+    for (i = 0; i < 2; i++)
+        es->q[i].root.prev = es->q[i].root.next = &es->q[i].root;
+    if (policy == &evict_s3fifo) {
+        es->nghost = pow2_at_least(budget / 4096, 64);
+        es->ghost = evict_calloc(es->nghost, sizeof(unsigned int));
+    }
+    if (admission) {
+        es->width = pow2_at_least(budget / 1024, 64);
+        es->sketch = evict_calloc(SKETCH_ROWS * es->width, 1);
+    }
+}
+
+/*
+ * evict_free - free what evict_init allocated; the nodes are the owner's
+ */
+void evict_free(evict_state *es)
+{
+    free(es->ghost);
+    free(es->sketch);
+}
+
+/*
+ * evict_insert - start tracking a new block of size bytes
+ */
+void evict_insert(evict_state *es, evict_node *n, unsigned int hash,
+                  unsigned int size)
+{
+    n->hash = hash;
+    n->size = size;
+    freq_set(n, 0);
+    es->policy->insert(es, n);
+}
+
+/*
+ * evict_hit - note that the block was looked up
+ */
+void evict_hit(evict_state *es, evict_node *n)
+{
+    es->policy->hit(es, n);
+}
+
+/*
+ * evict_remove - stop tracking the block
+ */
+void evict_remove(evict_state *es, evict_node *n)
+{
+    queue_unlink(es, n);
+}
+
+/*
+ * evict_victim - the block to evict next, still tracked, or NULL if
+ *     there is none
+ */
+evict_node *evict_victim(evict_state *es)
+{
+    return es->policy->victim(es);
+}
+
+/*
+ * evict_record - count a lookup of hash for the admission filter; every
+ *     counter is halved once there have been SKETCH_AGE lookups per
+ *     counter, so that old popularity fades
+ */
+void evict_record(evict_state *es, unsigned int hash)
+{
+    unsigned char *c, v;
+    unsigned int i;
+    int row;
+
+    if (es->sketch == NULL)
+        return;
+    for (row = 0; row < SKETCH_ROWS; row++) {
+        c = &es->sketch[sketch_slot(es, hash, row)];
+        if ((v = __atomic_load_n(c, __ATOMIC_RELAXED)) < SKETCH_MAX)
+            __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+    }
+    // Only the lookup that reaches the limit halves the counters.
+    if (__atomic_add_fetch(&es->samples, 1, __ATOMIC_RELAXED)
+        == SKETCH_AGE * es->width) {
+        for (i = 0; i < SKETCH_ROWS * es->width; i++) {
+            c = &es->sketch[i];
+            __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) >> 1,
+                             __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(&es->samples, SKETCH_AGE * es->width / 2,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * evict_admit - whether a new block for hash may displace victim: with
+ *     the filter on, only if it has been looked up more often lately
+ */
+int evict_admit(evict_state *es, unsigned int hash, evict_node *victim)
+{
+    if (es->sketch == NULL || victim == NULL)
+        return 1;
+    return sketch_estimate(es, hash) > sketch_estimate(es, victim->hash);
+}
+
+/* lru and clock: one queue, newest first */
+static void lru_insert(evict_state *es, evict_node *n)
+{
+    queue_push(es, 0, n);
+}
+
+static void lru_hit(evict_state *es, evict_node *n)
+{
+    // A block removed since it was looked up is left alone.
+    if (n->prev == NULL)
+        return;
+    queue_unlink(es, n);
+    queue_push(es, 0, n);
+}
+
+static evict_node *lru_victim(evict_state *es)
+{
+    return queue_oldest(es, 0);
+}
+
+static void clock_hit(evict_state *es, evict_node *n)
+{
+    if (!freq_get(n))
+        freq_set(n, 1);
+}
+
+/*
+ * clock_victim - sweep from the oldest block, giving every block whose
+ *     bit is set a second chance at the front with the bit cleared
+ */
+static evict_node *clock_victim(evict_state *es)
+{
+    evict_node *n;
+
+    while ((n = queue_oldest(es, 0)) != NULL && freq_get(n)) {
+        freq_set(n, 0);
+        lru_hit(es, n);
+    }
+    return n;
+}
+
+/*
+ * s3fifo_insert - a new block enters the small FIFO, unless the ghost
+ *     table says it was dropped from there recently
+ */
+static void s3fifo_insert(evict_state *es, evict_node *n)
+{
+    unsigned int *g = &es->ghost[n->hash & (es->nghost - 1)];
+
+    if (*g == n->hash) {
+        *g = 0;
+        queue_push(es, MAIN, n);
+    } else
+        queue_push(es, SMALL, n);
+}
+
+static void s3fifo_hit(evict_state *es, evict_node *n)
+{
+    unsigned char f = freq_get(n);
+
+    if (f < S3_FREQ_MAX)
+        freq_set(n, f + 1);
+}
+
+/*
+ * s3fifo_victim - take from the small FIFO while it holds its share of
+ *     the budget (or the main one is empty), moving blocks hit there to
+ *     the main FIFO and remembering the others as ghosts; otherwise take
+ *     from the main FIFO, where a hit block goes around again with one
+ *     hit less
+ */
+static evict_node *s3fifo_victim(evict_state *es)
+{
+    evict_node *n;
+
+    while (1) {
+        if ((n = queue_oldest(es, SMALL)) != NULL
+            && (es->q[SMALL].bytes * 100 >= es->budget * SMALL_SHARE
+                || queue_oldest(es, MAIN) == NULL)) {
+            if (freq_get(n)) {
+                freq_set(n, 0);
+                queue_unlink(es, n);
+                queue_push(es, MAIN, n);
+                continue;
+            }
+            es->ghost[n->hash & (es->nghost - 1)] = n->hash;
+            return n;
+        }
+        if ((n = queue_oldest(es, MAIN)) == NULL || freq_get(n) == 0)
+            return n;
+        freq_set(n, freq_get(n) - 1);
+        queue_unlink(es, n);
+        queue_push(es, MAIN, n);
+    }
+}
+
+/*
+ * queue_push - put n at the front of queue q
+ */
+static void queue_push(evict_state *es, int q, evict_node *n)
+{
+    evict_queue *eq = &es->q[q];
+
+    n->queue = q;
+    n->prev = &eq->root;
+    n->next = eq->root.next;
+    eq->root.next->prev = n;
+    eq->root.next = n;
+    eq->bytes += n->size;
+}
+
+/*
+ * queue_unlink - take n out of its queue
+ */
+static void queue_unlink(evict_state *es, evict_node *n)
+{
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+    n->prev = n->next = NULL;
+    es->q[n->queue].bytes -= n->size;
+}
+
+/*
+ * queue_oldest - the node at the back of queue q, or NULL if it is empty
+ */
+static evict_node *queue_oldest(evict_state *es, int q)
+{
+    evict_node *n = es->q[q].root.prev;
+
+    return (n == &es->q[q].root) ? NULL : n;
+}
+
+/*
+ * sketch_estimate - how often hash was looked up lately: the smallest
+ *     of its counters
+ */
+static unsigned int sketch_estimate(evict_state *es, unsigned int hash)
+{
+    unsigned int min = SKETCH_MAX, c;
+    int row;
+
+    for (row = 0; row < SKETCH_ROWS; row++) {
+        c = __atomic_load_n(&es->sketch[sketch_slot(es, hash, row)],
+                            __ATOMIC_RELAXED);
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
+
+/*
+ * sketch_slot - the counter for hash in a row of the sketch; each row
+ *     scrambles the hash with a different odd multiplier
+ */
+static unsigned int sketch_slot(evict_state *es, unsigned int hash, int row)
+{
+    static const unsigned int seeds[SKETCH_ROWS] = {
+        0x9e3779b1u, 0x85ebca6bu, 0xc2b2ae35u, 0x27d4eb2fu
+    };
+    unsigned int h = (hash ^ (hash >> 15)) * seeds[row];
+
+    return row * es->width + ((h ^ (h >> 16)) & (es->width - 1));
+}
+
+/*
+ * pow2_at_least - the smallest power of 2 that is at least n and min
+ */
+static unsigned int pow2_at_least(size_t n, unsigned int min)
+{
+    unsigned int p = min;
+
+    while (p < n)
+        p *= 2;
+    return p;
+}
+
+/*
+ * freq_get, freq_set - the hit counter of a node, which hits change
+ *     without the owner's lock
+ */
+static unsigned char freq_get(evict_node *n)
+{
+    return __atomic_load_n(&n->freq, __ATOMIC_RELAXED);
+}
+
+static void freq_set(evict_node *n, unsigned char f)
+{
+    __atomic_store_n(&n->freq, f, __ATOMIC_RELAXED);
+}
+
+static void *evict_calloc(size_t n, size_t size)
+{
+    void *p;
+
+    if ((p = calloc(n, size)) == NULL) {
+        perror("evict_init");
+        exit(1);
+    }
+    return p;
+}
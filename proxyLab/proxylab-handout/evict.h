@@ -0,0 +1,88 @@
+/*
+ *                     evict.h
+ *
+ * Eviction policies for the object cache. Every shard orders its blocks
+ * for eviction in an evict_state, through the evict_policy picked at
+ * startup with "-e":
+ *
+ *   lru     One list; a hit moves the block to its front.
+ *   clock   One FIFO with a reference bit per block (second chance). A
+ *           hit only sets the bit; the list changes only on eviction.
+ *   s3fifo  A small FIFO holding 10% of the bytes, which new blocks
+ *           enter, and a main FIFO for the blocks hit while in it. The
+ *           hashes of blocks dropped from the small FIFO are remembered
+ *           in a ghost table, and such a block goes straight to the main
+ *           FIFO when it comes back. Hits only bump a counter.
+ *
+ * Whatever the policy, the TinyLFU admission filter ("-t") counts
+ * lookups in a count-min sketch that is halved now and then. A new
+ * block only displaces an old one if it has been asked for more often.
+ *
+ * Like request.c, this file does not depend on csapp.c, so the cache
+ * benchmark can link it on its own.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __EVICT_H__
+#define __EVICT_H__
+
+#include <stddef.h>
+
+/* What a policy keeps in each cached block */
+typedef struct evict_node {
+    struct evict_node *prev;      /* Position in its queue, newest */
+    struct evict_node *next;      /* first */
+    unsigned int hash;            /* Hash of the block's tag */
+    unsigned int size;            /* Bytes it takes of the budget */
+    unsigned char queue;          /* Which queue of the state it is in */
+    unsigned char freq;           /* Hits noted by clock and s3fifo */
+} evict_node;
+
+typedef struct evict_queue {
+    evict_node root;              /* Sentinel: root.next is the newest */
+    size_t bytes;                 /* Sizes of the nodes in the queue */
+} evict_queue;
+
+struct evict_policy;
+
+typedef struct evict_state {
+    const struct evict_policy *policy;
+    size_t budget;                /* Bytes the shard may cache */
+    evict_queue q[2];             /* s3fifo: small and main; others: q[0] */
+    unsigned int *ghost;          /* s3fifo: hashes dropped from small */
+    unsigned int nghost;          /* Slots in ghost, a power of 2 */
+    unsigned char *sketch;        /* TinyLFU counters, NULL when off */
+    unsigned int width;           /* Counters per sketch row, a power of 2 */
+    unsigned int samples;         /* Lookups since the last halving */
+} evict_state;
+
+typedef struct evict_policy {
+    char *name;
+    int locked_hit;               /* hit changes the queues, under the lock */
+    void (*insert)(evict_state *es, evict_node *n);
+    void (*hit)(evict_state *es, evict_node *n);
+    evict_node *(*victim)(evict_state *es);
+} evict_policy;
+
+extern const evict_policy evict_lru;
+extern const evict_policy evict_clock;
+extern const evict_policy evict_s3fifo;
+
+const evict_policy *evict_policy_find(char *name);
+void evict_init(evict_state *es, const evict_policy *policy, size_t budget,
+                int admission);
+void evict_free(evict_state *es);
+
+/* All of these need the owner's lock, except evict_record, and evict_hit
+   for a policy without locked_hit */
+void evict_insert(evict_state *es, evict_node *n, unsigned int hash,
+                  unsigned int size);
+void evict_hit(evict_state *es, evict_node *n);
+void evict_remove(evict_state *es, evict_node *n);
+evict_node *evict_victim(evict_state *es);
+void evict_record(evict_state *es, unsigned int hash);
+int evict_admit(evict_state *es, unsigned int hash, evict_node *victim);
+
+#endif /* __EVICT_H__ */
@@ -0,0 +1,298 @@
+/*
+ *                     load_bench.c
+ *
+ * Closed-loop HTTP load generator for comparing the proxy's concurrency
+ * modes. Every one of -c client threads keeps a single request to the
+ * proxy outstanding at a time for -d seconds, and times each response
+ * from the first byte of the request to the last byte of the body. With
+ * -k a thread keeps its connection open across requests (HTTP/1.1);
+ * otherwise it connects anew for every request, which puts the accept
+ * path under load as well. With -u every request names the same file
+ * by a different path, spelling a counter in "./" and "/" segments the
+ * way bench.sh does, so that every request misses the cache and goes
+ * to the origin. Reported are requests per second and the 50th, 99th
+ * and 99.9th percentile latency.
+ *
+ * Responses must carry a Content-length; the bench does not follow
+ * chunked or close-delimited bodies.
+ *
+ *     usage: ./load_bench [-c clients] [-d secs] [-k] [-u]
+ *                         <proxy port> <url>
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BENCH_BUF    (64 * 1024)
+#define BENCH_REQ    4096
+#define UNIQUE_BITS  32           /* Segments spelling the -u counter */
+
+typedef struct client {
+    pthread_t tid;
+    int id;
+    unsigned long done;           /* Responses received */
+    unsigned long errors;         /* Connections that failed or closed */
+    double *lat;                  /* Latency of every response, in us */
+    size_t nlat, cap;
+} client;
+
+static char *port, *url;
+static int url_root;              /* Length of url up to its path */
+static int keepalive, unique, nclients = 16;
+static volatile int stop;
+static struct addrinfo *proxy_addr;
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c clients] [-d secs] [-k] [-u] "
+            "<proxy port> <url>\n", prog);
+    exit(1);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * open_proxy - a connected socket to the proxy, or -1
+ */
+static int open_proxy(void)
+{
+    int fd, one = 1;
+
+    if ((fd = socket(proxy_addr->ai_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/*
+ * exchange - send req on fd and read the whole response to it; returns
+ *     0, or -1 if the connection failed or the response is unusable
+ */
+static int exchange(int fd, char *req, size_t len, char *buf)
+{
+    size_t have = 0, hdr = 0;
+    long body = -1;
+    ssize_t n;
+    char *end, *p;
+
+    for (p = req; len > 0; p += n, len -= n)
+        if ((n = write(fd, p, len)) <= 0)
+            return -1;
+    while (1) {
+        if (hdr == 0) {
+            if ((n = read(fd, buf + have, BENCH_BUF - 1 - have)) <= 0)
+                return -1;
+            have += n;
+            buf[have] = '\0';
+            if ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+                if (have == BENCH_BUF - 1)
+                    return -1;
+                continue;
+            }
+            hdr = end + 4 - buf;
+            for (p = strstr(buf, "\r\n"); p && p < end;
+                 p = strstr(p + 2, "\r\n"))
+                if (!strncasecmp(p + 2, "Content-length:", 15))
+                    body = atol(p + 17);
+            if (body < 0)
+                return -1;
+        }
+        // The body is only counted, not kept.
+        if (have - hdr >= (size_t)body)
+            return 0;
+        if ((n = read(fd, buf, BENCH_BUF)) <= 0)
+            return -1;
+        have += n;
+    }
+}
+
+/*
+ * unique_path - the path of url with the bits of n spelled in front of
+ *     it, "./" for a one and "/" for a zero
+ */
+static void unique_path(char *path, unsigned long n)
+{
+    int i;
+
+    for (i = 0; i < UNIQUE_BITS; i++, n >>= 1)
+        path += sprintf(path, "%s", (n & 1) ? "./" : "/");
+    strcpy(path, url + url_root + 1);
+}
+
+/*
+ * record - keep one latency sample
+ */
+static void record(client *cl, double us)
+{
+    if (cl->nlat == cl->cap) {
+        cl->cap = cl->cap ? 2 * cl->cap : 4096;
+        if ((cl->lat = realloc(cl->lat, cl->cap * sizeof(double))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    cl->lat[cl->nlat++] = us;
+}
+
+/*
+ * client_thread - issue requests back to back until told to stop
+ */
+static void *client_thread(void *vargp)
+{
+    client *cl = (client *)vargp;
+    char req[BENCH_REQ], path[BENCH_REQ / 2], *buf;
+    unsigned long seq = 0;
+    double start;
+    int fd = -1, len;
+
+    if ((buf = malloc(BENCH_BUF)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    while (!stop) {
+        if (unique) {
+            // Client ids are the low bits, so no two clients collide.
+            unique_path(path, seq++ * nclients + cl->id);
+            len = snprintf(req, sizeof(req), "GET %.*s/%s HTTP/1.%d\r\n"
+                           "Host: bench\r\n\r\n", url_root, url, path,
+                           keepalive);
+        } else
+            len = snprintf(req, sizeof(req), "GET %s HTTP/1.%d\r\n"
+                           "Host: bench\r\n\r\n", url, keepalive);
+        start = now_us();
+        if (fd < 0 && (fd = open_proxy()) < 0) {
+            cl->errors++;
+            usleep(1000);
+            continue;
+        }
+        if (exchange(fd, req, len, buf) < 0) {
+            cl->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        record(cl, now_us() - start);
+        cl->done++;
+        if (!keepalive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    struct addrinfo hints;
+    client *cls;
+    int secs = 5, opt, i, rc;
+    char *p;
+    unsigned long done = 0, errors = 0;
+    double *all, elapsed;
+    size_t n = 0;
+
+    while ((opt = getopt(argc, argv, "c:d:ku")) != -1) {
+        switch (opt) {
+        case 'c':
+            if ((nclients = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'd':
+            if ((secs = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        case 'u':
+            unique = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2)
+        usage(argv[0]);
+    port = argv[optind];
+    url = argv[optind + 1];
+    if ((p = strstr(url, "://")) == NULL || (p = strchr(p + 3, '/')) == NULL
+        || strlen(url) >= BENCH_REQ / 4)
+        usage(argv[0]);
+    url_root = p - url;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo("localhost", port, &hints, &proxy_addr)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        exit(1);
+    }
+
+    if ((cls = calloc(nclients, sizeof(client))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    elapsed = now_us();
+    for (i = 0; i < nclients; i++) {
+        cls[i].id = i;
+        pthread_create(&cls[i].tid, NULL, client_thread, &cls[i]);
+    }
+    sleep(secs);
+    stop = 1;
+    for (i = 0; i < nclients; i++) {
+        pthread_join(cls[i].tid, NULL);
+        done += cls[i].done;
+        errors += cls[i].errors;
+        n += cls[i].nlat;
+    }
+    elapsed = (now_us() - elapsed) / 1e6;
+
+    if ((all = malloc((n ? n : 1) * sizeof(double))) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (n = 0, i = 0; i < nclients; i++) {
+        memcpy(all + n, cls[i].lat, cls[i].nlat * sizeof(double));
+        n += cls[i].nlat;
+    }
+    qsort(all, n, sizeof(double), cmp_double);
+    printf("%d clients%s%s: %lu requests in %.1f s, %.0f req/s, %lu errors\n",
+           nclients, keepalive ? ", keep-alive" : "",
+           unique ? ", all misses" : "", done, elapsed, done / elapsed,
+           errors);
+    if (n)
+        printf("latency p50 %.0f us, p99 %.0f us, p99.9 %.0f us\n",
+               all[n / 2], all[n * 99 / 100], all[n * 999 / 1000]);
+    return 0;
+}
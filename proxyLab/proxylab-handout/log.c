@@ -0,0 +1,418 @@
+/*
+ *                     log.c
+ *
+ * Rings drained by one writer thread. Each ring has a single producer
+ * at a time (the thread that has claimed it) and a single consumer
+ * (whoever holds drain_lock, normally the writer), so the two only share
+ * the ring's head and tail counters. Records are variable length; one that
+ * does not fit before the end of the ring is preceded by a pad record
+ * that fills the rest of it.
+ *
+ * A record of log_write_addr holds the raw socket address instead of
+ * text, and the writer formats it, numerically, when it drains it; a
+ * thread that accepts connections never formats an address at all.
+ *
+ * A thread claims a ring, with a compare-and-swap, only for the length of
+ * one log call, trying the ring it used last first. A new ring is made
+ * only when every ring is claimed, up to LOG_RINGS_PER_CPU for each CPU;
+ * past that, the caller yields until one is free. Thread-per-connection
+ * mode thus needs a few rings rather than one per connection. Rings are
+ * never freed. A message is formatted in its ring rather than on the
+ * stack, which keeps log calls cheap for threads with small stacks.
+ *
+ * This file does not depend on csapp.c, so Tiny can link it as well.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <netdb.h>
+#include "log.h"
+
+#define LEVEL_PAD 0xff          /* Record that only fills the ring's end */
+
+/* Header of a record in a ring, followed by the message */
+typedef struct log_rec {
+    unsigned int len;           /* Bytes of the record, header included */
+    unsigned short msg_len;     /* Bytes of the message */
+    unsigned char level;
+    unsigned char addr;         /* Message is a log_addr_msg, not text */
+    struct timespec ts;         /* When the message was logged */
+} log_rec;
+
+// Records start 8-byte aligned, so even the smallest gap left at the
+// end of a ring has room for a pad record's len and level.
+#define REC_ALIGN   8
+#define REC_SIZE(n) ((sizeof(log_rec) + (n) + REC_ALIGN - 1) \
+                     / REC_ALIGN * REC_ALIGN)
+
+/* Message of a log_write_addr record, up to the length of the address */
+typedef struct log_addr_msg {
+    const char *what;           /* Static text to put before the address */
+    struct sockaddr_storage sa;
+} log_addr_msg;
+
+typedef struct log_ring {
+    unsigned long head;         /* Bytes consumed, written by the consumer */
+    unsigned long tail;         /* Bytes produced, written by the owner */
+    unsigned long dropped;      /* Messages the owner could not fit */
+    int owned;                  /* A thread is logging into this ring */
+    int id;                     /* Shown in every message from the ring */
+    struct log_ring *next;      /* All rings, newest first */
+    char buf[LOG_RING];
+    char msg[LOG_MSG_MAX];      /* Where the owner formats a message */
+} log_ring;
+
+int log_level = LEVEL_INFO;
+
+static int log_fd = -1;                 /* Output, -1 until log_init */
+static pid_t log_pid;                   /* Process that started the writer */
+static log_ring *rings;                 /* Every ring ever created */
+static int nrings;
+static int max_rings = 1;               /* Set by log_init */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread log_ring *my_ring;      /* Ring the calling thread used last */
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static void log_put(log_ring *r, int level, int addr, const char *msg,
+                    int n);
+static int format_addr(log_addr_msg *m, int n, char *out, size_t size);
+static log_ring *ring_claim(void);
+static int ring_try(log_ring *r);
+static void ring_release(log_ring *r);
+static void *log_writer(void *vargp);
+static int drain_all(char *batch);
+static void write_all(char *data, size_t n);
+
+/*
+ * log_init - send messages to fd from now on and start the writer
+ */
+void log_init(int fd, int level)
+{
+    pthread_t tid;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    log_level = level;
+    log_fd = fd;
+    log_pid = getpid();
+    max_rings = LOG_RINGS_PER_CPU * (ncpus > 0 ? ncpus : 1);
+    if (pthread_create(&tid, NULL, log_writer, NULL) != 0) {
+        fprintf(stderr, "log_init: cannot start the log writer\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+    // The csapp wrappers exit on errors; let their last words out.
+    atexit(log_flush);
+}
+
+/*
+ * log_level_parse - the level called name, or -1 if there is none
+ */
+int log_level_parse(const char *name)
+{
+    int i;
+
+    for (i = LEVEL_ERROR; i <= LEVEL_DEBUG; i++)
+        if (!strcasecmp(name, level_names[i]))
+            return i;
+    return -1;
+}
+
+/*
+ * log_write - format a message into a ring claimed for the call. Before
+ *     log_init, messages go straight to stderr instead.
+ */
+void log_write(int level, const char *fmt, ...)
+{
+    static char early[LOG_MSG_MAX];     /* Only main runs before log_init */
+    char *msg = early;
+    log_ring *r = NULL;
+    va_list ap;
+    int n;
+
+    if (log_fd >= 0) {
+        if ((r = ring_claim()) == NULL)
+            return;
+        msg = r->msg;
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(msg, LOG_MSG_MAX, fmt, ap);
+    va_end(ap);
+    if (n >= LOG_MSG_MAX)
+        n = LOG_MSG_MAX - 1;
+    // Header dumps end in CRLFs; the writer ends every message itself.
+    while (n > 0 && (msg[n - 1] == '\n' || msg[n - 1] == '\r'))
+        n--;
+    if (r == NULL) {
+        if (n >= 0)
+            fprintf(stderr, "%s %.*s\n", level_names[level], n, msg);
+        return;
+    }
+    if (n >= 0)
+        log_put(r, level, 0, msg, n);
+    ring_release(r);
+}
+
+/*
+ * log_write_addr - log "what (host, port)" for the len bytes of socket
+ *     address at addr, leaving the formatting to the writer. what must
+ *     be a string that outlives the record, like a literal.
+ */
+void log_write_addr(int level, const char *what, const void *addr,
+                    unsigned int len)
+{
+    log_addr_msg m;
+    char text[NI_MAXHOST + 256];
+    log_ring *r;
+    int n;
+
+    if (len > sizeof(m.sa))
+        len = sizeof(m.sa);
+    m.what = what;
+    memcpy(&m.sa, addr, len);
+    n = offsetof(log_addr_msg, sa) + len;
+    if (log_fd < 0) {
+        format_addr(&m, n, text, sizeof(text));
+        fprintf(stderr, "%s %s\n", level_names[level], text);
+        return;
+    }
+    if ((r = ring_claim()) == NULL)
+        return;
+    log_put(r, level, 1, (char *)&m, n);
+    ring_release(r);
+}
+
+/*
+ * log_put - append a record of the n bytes of msg to r, which the
+ *     caller has claimed, or count it as dropped if it does not fit
+ */
+static void log_put(log_ring *r, int level, int addr, const char *msg,
+                    int n)
+{
+    unsigned long head, tail, pos, pad, need;
+    log_rec *rec;
+
+    // Only the claimer moves tail; the consumer only moves head.
+    tail = r->tail;
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    pos = tail & (LOG_RING - 1);
+    need = REC_SIZE(n);
+    pad = (LOG_RING - pos < need) ? LOG_RING - pos : 0;
+    if (LOG_RING - (tail - head) < pad + need) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (pad) {
+        rec = (log_rec *)(r->buf + pos);
+        rec->len = pad;
+        rec->level = LEVEL_PAD;
+        tail += pad;
+        pos = 0;
+    }
+    rec = (log_rec *)(r->buf + pos);
+    rec->len = need;
+    rec->msg_len = n;
+    rec->level = level;
+    rec->addr = addr;
+    clock_gettime(CLOCK_REALTIME_COARSE, &rec->ts);
+    memcpy(rec + 1, msg, n);
+    __atomic_store_n(&r->tail, tail + need, __ATOMIC_RELEASE);
+}
+
+/*
+ * format_addr - the text of an address record of n bytes, numeric so
+ *     that no name is looked up; returns its length
+ */
+static int format_addr(log_addr_msg *m, int n, char *out, size_t size)
+{
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+
+    if (getnameinfo((struct sockaddr *)&m->sa,
+                    n - offsetof(log_addr_msg, sa), host, sizeof(host),
+                    port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        strcpy(host, "?"), strcpy(port, "?");
+    n = snprintf(out, size, "%s (%s, %s)", m->what, host, port);
+    return n < (int)size ? n : (int)size - 1;
+}
+
+/*
+ * log_flush - write out everything logged so far. Only the process that
+ *     called log_init does so: a forked child may have been forked
+ *     while the writer held drain_lock.
+ */
+void log_flush(void)
+{
+    // Not on the stack: this runs from atexit on whichever thread
+    // exits, which may have a small stack. drain_all only uses it with
+    // drain_lock held.
+    static char batch[LOG_BATCH];
+
+    if (log_fd < 0 || getpid() != log_pid)
+        return;
+    while (drain_all(batch) > 0)
+        ;
+}
+
+/*
+ * ring_claim - claim a ring for one log call: the one the calling thread
+ *     used last if it is free, else any free one, else a new one. At the
+ *     cap, wait for one to be released. NULL if a ring cannot be made.
+ */
+static log_ring *ring_claim(void)
+{
+    log_ring *r;
+    int full;
+
+    while (1) {
+        if (my_ring && ring_try(my_ring))
+            return my_ring;
+        for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+            if (r != my_ring && ring_try(r))
+                return my_ring = r;
+        pthread_mutex_lock(&rings_lock);
+        if (!(full = (nrings >= max_rings))
+            && (r = calloc(1, sizeof(log_ring))) != NULL) {
+            r->owned = 1;
+            r->id = nrings++;
+            r->next = rings;
+            __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&rings_lock);
+        if (!full)
+            return r ? (my_ring = r) : NULL;
+        // Every ring is held by a log call, which will not take long.
+        sched_yield();
+    }
+}
+
+/*
+ * ring_try - claim r if no other thread has; returns 1 if it did
+ */
+static int ring_try(log_ring *r)
+{
+    int unowned = 0;
+
+    // Acquire: see the tail that the previous claimer left.
+    return __atomic_compare_exchange_n(&r->owned, &unowned, 1, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*
+ * ring_release - end a log call; the ring may be claimed by others
+ */
+static void ring_release(log_ring *r)
+{
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_writer - drain the rings forever, napping while they are empty
+ */
+static void *log_writer(void *vargp)
+{
+    char *batch = malloc(LOG_BATCH);
+    struct timespec nap = { 0, LOG_FLUSH_MS * 1000000L };
+
+    if (batch == NULL)
+        return NULL;
+    while (1)
+        if (drain_all(batch) == 0)
+            nanosleep(&nap, NULL);
+    return NULL;
+}
+
+/*
+ * drain_all - move every record in the rings to the output, formatted
+ *     in batch; returns the number of records written
+ */
+static int drain_all(char *batch)
+{
+    log_ring *r;
+    log_rec *rec;
+    unsigned long head, tail, dropped;
+    size_t len = 0;
+    int count = 0;
+    struct tm tm;
+    time_t last = 0;
+    char stamp[32];
+
+    pthread_mutex_lock(&drain_lock);
+    stamp[0] = '\0';
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        head = r->head;
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            rec = (log_rec *)(r->buf + (head & (LOG_RING - 1)));
+            head += rec->len;
+            if (rec->level == LEVEL_PAD)
+                continue;
+            // Longest prefix is "YYYY-mm-dd HH:MM:SS.mmm LEVEL [id] ".
+            if (len + (rec->addr ? LOG_MSG_MAX : rec->msg_len) + 64
+                > LOG_BATCH) {
+                write_all(batch, len);
+                len = 0;
+            }
+            if (rec->ts.tv_sec != last) {
+                last = rec->ts.tv_sec;
+                localtime_r(&last, &tm);
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            }
+            len += sprintf(batch + len, "%s.%03ld %-5s [%d] ", stamp,
+                           rec->ts.tv_nsec / 1000000,
+                           level_names[rec->level], r->id);
+            if (rec->addr)
+                len += format_addr((log_addr_msg *)(rec + 1), rec->msg_len,
+                                   batch + len, LOG_BATCH - 1 - len);
+            else {
+                memcpy(batch + len, rec + 1, rec->msg_len);
+                len += rec->msg_len;
+            }
+            batch[len++] = '\n';
+            count++;
+        }
+        __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+        if ((dropped = __atomic_exchange_n(&r->dropped, 0,
+                                           __ATOMIC_RELAXED)) > 0) {
+            if (len + 64 > LOG_BATCH) {
+                write_all(batch, len);
+                len = 0;
+            }
+            len += sprintf(batch + len, "log: %lu messages dropped by [%d]\n",
+                           dropped, r->id);
+        }
+    }
+    write_all(batch, len);
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+/*
+ * write_all - write n bytes to the log output, giving up on errors
+ */
+static void write_all(char *data, size_t n)
+{
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = write(log_fd, data, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        data += rc;
+        n -= rc;
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ *                     log.h
+ *
+ * Asynchronous logging for the proxy and Tiny. A thread that logs only
+ * formats its message into a ring buffer that it claims for the call;
+ * there are about as many rings as CPUs, however many threads log, and
+ * no system call is made on the logger's behalf. A background writer
+ * thread drains the rings, stamps each message with its time, level and
+ * ring, and writes them out in large batches. A thread that finds its
+ * ring full drops the message rather than wait, and the writer reports
+ * how many were dropped.
+ *
+ * Socket addresses are logged raw, with log_debug_addr, and only the
+ * writer turns them into numeric text: no name is ever looked up, and
+ * an accept loop does no formatting of its own.
+ *
+ * Messages below log_level are skipped before they are formatted.
+ * Building with -DLOG_NODEBUG removes log_debug calls, arguments and
+ * all, from the code.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#define LOG_RING     (64 * 1024)  /* Bytes of each ring, power of 2 */
+#define LOG_RINGS_PER_CPU 2       /* Most rings there may be per CPU */
+#define LOG_MSG_MAX  8192         /* Longest message, longer ones are cut */
+#define LOG_BATCH    (64 * 1024)  /* Bytes the writer gathers per write */
+#define LOG_FLUSH_MS 20           /* Writer's nap when the rings are empty */
+
+enum log_levels {
+    LEVEL_ERROR,                /* Something failed */
+    LEVEL_WARN,                 /* Something looks wrong */
+    LEVEL_INFO,                 /* One line per request (access log) */
+    LEVEL_DEBUG                 /* Request and response tracing */
+};
+
+/* Messages above this level are skipped */
+extern int log_level;
+
+void log_init(int fd, int level);
+int log_level_parse(const char *name);
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_write_addr(int level, const char *what, const void *addr,
+                    unsigned int len);
+void log_flush(void);
+
+#define log_at(level, ...)                          \
+    do {                                            \
+        if ((level) <= log_level)                   \
+            log_write((level), __VA_ARGS__);        \
+    } while (0)
+
+#define log_error(...) log_at(LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LEVEL_INFO, __VA_ARGS__)
+#ifdef LOG_NODEBUG
+#define log_debug(...) do { } while (0)
+#define log_debug_addr(what, addr, len) do { } while (0)
+#else
+#define log_debug(...) log_at(LEVEL_DEBUG, __VA_ARGS__)
+#define log_debug_addr(what, addr, len)                         \
+    do {                                                        \
+        if (LEVEL_DEBUG <= log_level)                           \
+            log_write_addr(LEVEL_DEBUG, (what), (addr), (len)); \
+    } while (0)
+#endif
+
+#endif /* __LOG_H__ */
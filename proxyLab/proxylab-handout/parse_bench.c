@@ -0,0 +1,292 @@
+/*
+ *                     parse_bench.c
+ *
+ * Microbenchmark of request parsing: the line-at-a-time parser the
+ * proxy used to have (rio_readlineb per header line, sscanf over the
+ * request line, strstr and strncpy to split the URI, and a scan of the
+ * collected header block for Connection headers) against request.c.
+ * Both take a request from a read buffer to host, port, path and the
+ * connection's reuse, and are timed over the same requests.
+ *
+ *     usage: ./parse_bench [-n iterations]
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include "request.h"
+
+#define MAXLINE 8192
+#define MAXBUF  8192
+
+static char *requests[] = {
+    "GET http://localhost:8080/home.html HTTP/1.0\r\n"
+    "Host: localhost:8080\r\n"
+    "\r\n",
+
+    "GET http://www.cmu.edu:80/hub/index.html HTTP/1.1\r\n"
+    "Host: www.cmu.edu\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+    "Gecko/20120305 Firefox/10.0.3\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.cmu.edu/hub/\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=light\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+
+    "GET http://cdn.example.com/static/js/app.8c2b3f1e.bundle.min.js"
+    "?v=20120305&lang=en HTTP/1.1\r\n"
+    "Host: cdn.example.com\r\n"
+    "User-Agent: curl/7.29.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+};
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+/* Enough of rio to read lines out of a memory buffer the same way */
+typedef struct {
+    char *p;
+    char *end;
+} mem_rio;
+
+struct result {
+    char host[MAXLINE];
+    char port[MAXLINE];
+    size_t path_len;
+    int client;
+};
+
+/*
+ * old_readlineb - rio_readlineb over mem_rio: one byte at a time
+ */
+static ssize_t old_readlineb(mem_rio *rp, char *usrbuf, size_t maxlen)
+{
+    size_t n;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if (rp->p == rp->end)
+            break;
+        c = *rp->p++;
+        *bufp++ = c;
+        if (c == '\n') {
+            n++;
+            break;
+        }
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+static int old_header_is(char *line, char *name, char **valuep)
+{
+    size_t len = strlen(name);
+
+    if (strncasecmp(line, name, len) || line[len] != ':')
+        return 0;
+    for (line += len + 1; *line == ' ' || *line == '\t'; line++)
+        ;
+    *valuep = line;
+    return 1;
+}
+
+static int has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+    char *p, c;
+
+    for (p = value; *p && *p != '\r' && *p != '\n'; p++) {
+        if (strncasecmp(p, token, len)
+            || (p != value && p[-1] != ',' && p[-1] != ' '))
+            continue;
+        c = p[len];
+        if (c == '\0' || c == ',' || c == ' ' || c == ';' || c == '\r'
+            || c == '\n')
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * old_parse - the previous doit up to the cache lookup
+ */
+static int old_parse(mem_rio *rio, struct result *r)
+{
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char req[MAXBUF], pathname[MAXLINE];
+    char *temp, *first, *next, *p, *line, *value;
+    int len, n, major = 1, minor = 0, asked = -1;
+
+    if (old_readlineb(rio, buf, MAXLINE) <= 0)
+        return -1;
+    len = strlen(buf);
+    memcpy(req, buf, len + 1);
+    do {
+        line = req + len;
+        if (len >= MAXBUF - 1
+            || (n = old_readlineb(rio, line, MAXBUF - len)) < 0)
+            return -1;
+        len += n;
+    } while (n > 0 && strcmp(line, "\r\n") && strcmp(line, "\n"));
+
+    sscanf(req, "%*s %*s HTTP/%d.%d", &major, &minor);
+    r->client = (major > 1 || (major == 1 && minor >= 1)) ? 2 : 0;
+    for (line = strchr(req, '\n'); line && line[1] != '\r'
+             && line[1] != '\n' && line[1] != '\0';
+         line = strchr(line, '\n')) {
+        line++;
+        if (old_header_is(line, "Connection", &value)
+            || old_header_is(line, "Proxy-Connection", &value)) {
+            if (has_token(value, "close"))
+                asked = 0;
+            else if (has_token(value, "keep-alive") && asked)
+                asked = 1;
+        } else if ((old_header_is(line, "Content-length", &value)
+                    && atol(value) != 0)
+                   || old_header_is(line, "Transfer-Encoding", &value))
+            r->client = 0;
+    }
+    if (asked == 0)
+        r->client = 0;
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3
+        || strcasecmp(method, "GET"))
+        return -1;
+
+    sprintf(r->port, "80");
+    if ((temp = strstr(buf, "http://")) == NULL)
+        return -1;
+    first = temp + 7;
+    if ((temp = strstr(first, "/")) == NULL)
+        return -1;
+    next = temp;
+    if ((temp = strstr(next, " ")) == NULL)
+        return -1;
+    p = temp;
+    strncpy(pathname, next, p - next);
+    pathname[p - next] = '\0';
+    if (((temp = strstr(first, ":")) != NULL) && (temp < next)) {
+        strncpy(r->port, temp + 1, next - temp - 1);
+        r->port[next - temp - 1] = '\0';
+        next = temp;
+    }
+    strncpy(r->host, first, next - first);
+    r->host[next - first] = '\0';
+    r->path_len = strlen(pathname);
+    return 0;
+}
+
+/*
+ * new_parse - the same with request.c: one copy of the read buffer,
+ *     one pass over it, and copies of only host and port
+ */
+static int new_parse(mem_rio *rio, struct result *r)
+{
+    char req[MAXBUF], uri[MAXLINE];
+    http_request hr;
+    http_header *h;
+    size_t n = rio->end - rio->p;
+    int asked = -1;
+
+    request_init(&hr);
+    memcpy(req, rio->p, n);
+    if (request_parse(&hr, req, n) != REQ_DONE)
+        return -1;
+    rio->p += hr.off;
+    r->client = (hr.major > 1 || (hr.major == 1 && hr.minor >= 1)) ? 2 : 0;
+    for (h = hr.headers; h < hr.headers + hr.nheaders; h++) {
+        if (view_is(h->name, "Connection")
+            || view_is(h->name, "Proxy-Connection")) {
+            if (has_token(h->value.p, "close"))
+                asked = 0;
+            else if (has_token(h->value.p, "keep-alive") && asked)
+                asked = 1;
+        } else if ((view_is(h->name, "Content-length")
+                    && atol(h->value.p) != 0)
+                   || view_is(h->name, "Transfer-Encoding"))
+            r->client = 0;
+    }
+    if (asked == 0)
+        r->client = 0;
+    if (!view_is(hr.method, "GET"))
+        return -1;
+    view_str(uri, sizeof(uri), hr.uri);
+    if (request_target(&hr) < 0)
+        return -1;
+    view_str(r->host, sizeof(r->host), hr.host);
+    view_str(r->port, sizeof(r->port), hr.port);
+    r->path_len = hr.path.len;
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * run - parse every sample request iters times; returns ns per request
+ */
+static double run(int (*parse)(mem_rio *, struct result *), long iters,
+                  size_t *paths)
+{
+    struct result r;
+    mem_rio rio;
+    double start;
+    long i;
+    size_t k;
+
+    *paths = 0;
+    start = now();
+    for (i = 0; i < iters; i++) {
+        for (k = 0; k < NREQUESTS; k++) {
+            rio.p = requests[k];
+            rio.end = requests[k] + strlen(requests[k]);
+            if (parse(&rio, &r) < 0) {
+                fprintf(stderr, "request %zu did not parse\n", k);
+                exit(1);
+            }
+            *paths += r.path_len + r.client;
+        }
+    }
+    return (now() - start) * 1e9 / (iters * NREQUESTS);
+}
+
+int main(int argc, char **argv)
+{
+    long iters = 1000000;
+    double t_old, t_new;
+    size_t check_old, check_new;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n' || (iters = atol(optarg)) < 1) {
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+    t_old = run(old_parse, iters, &check_old);
+    t_new = run(new_parse, iters, &check_new);
+    if (check_old != check_new) {
+        fprintf(stderr, "parsers disagree\n");
+        exit(1);
+    }
+    printf("%zu requests x %ld iterations, ns per request\n", NREQUESTS,
+           iters);
+    printf("%-12s %8.1f\n", "line-based", t_old);
+    printf("%-12s %8.1f\n", "request.c", t_new);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#!/bin/bash
+#
+# privacy.sh - Checks that the cache does not hand one client's private
+#     response to another. home.html is fetched through the proxy under
+#     three URIs ("/home.html", "/./home.html", "/././home.html"): once
+#     without credentials, once with an Authorization header and once
+#     with a Cookie. Tiny is then killed and every URI fetched again
+#     without credentials. Only the first may come from the cache; the
+#     other two must fail like any fetch from a dead origin.
+#
+#     usage: ./privacy.sh [-p proxy] [-- proxy args]
+#
+
+PROXY=./proxy
+FILE=home.html
+TIMEOUT=5
+
+while getopts "p:" opt; do
+    case $opt in
+        p) PROXY=$OPTARG ;;
+        *) echo "usage: $0 [-p proxy] [-- proxy args]"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+HOME_DIR=`pwd`
+OUT=`mktemp`
+
+#
+# wait_for_port_use - spins until something listens on TCP port $1
+#
+function wait_for_port_use {
+    for i in `seq 1 50`; do
+        netstat --numeric-ports --numeric-hosts -l --protocol=tcpip \
+            | grep -qw ":${1}" && return
+        sleep 0.1
+    done
+}
+
+#
+# fetch - fetch path $1 from Tiny through the proxy into OUT, with the
+#     request header $2 if given
+#
+function fetch {
+    : > ${OUT}
+    curl --silent --path-as-is --max-time ${TIMEOUT} \
+        --proxy http://localhost:${proxy_port} ${2:+--header "$2"} \
+        --output ${OUT} \
+        "http://localhost:${tiny_port}/$1"
+}
+
+tiny_port=`./free-port.sh`
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd ${HOME_DIR}
+wait_for_port_use ${tiny_port}
+
+proxy_port=`expr ${tiny_port} + 1`
+while netstat --numeric-ports -l --protocol=tcpip | grep -qw ":${proxy_port}"
+do
+    proxy_port=`expr ${proxy_port} + 1`
+done
+${PROXY} "$@" ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use ${proxy_port}
+
+fetch ${FILE}
+fetch ./${FILE} "Authorization: Basic dXNlcjpzZWNyZXQ="
+fetch ././${FILE} "Cookie: session=secret"
+kill ${tiny_pid} 2> /dev/null
+wait ${tiny_pid} 2> /dev/null
+
+failed=0
+for check in "${FILE} cached" "./${FILE} Authorization" \
+             "././${FILE} Cookie"; do
+    set -- ${check}
+    fetch $1
+    if cmp -s ${OUT} tiny/${FILE}; then
+        served=1
+    else
+        served=0
+    fi
+    if [ "$2" == "cached" -a ${served} -eq 1 ] \
+       || [ "$2" != "cached" -a ${served} -eq 0 ]; then
+        echo "Success: /$1 (fetched with $2)"
+    else
+        echo "Failure: /$1 (fetched with $2)"
+        failed=1
+    fi
+done
+
+kill ${proxy_pid} 2> /dev/null
+wait ${proxy_pid} 2> /dev/null
+rm -f ${OUT}
+exit ${failed}
@@ -10,172 +10,1271 @@
  * 
  */
 #include <stdio.h>
-#include "csapp.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include <stdint.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include "proxy.h"
+#include "reactor.h"
+#include "uring.h"
+#include "sysdep.h"
+#include "sbuf.h"
+#include "proxy_cache.h"
+#include "upstream.h"
+#include "relay.h"
+#include "dns.h"
+#include "arena.h"
+#include "admit.h"
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
 static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+static const char *keepalive_hdr = "Connection: keep-alive\r\n";
+static const char *crlf = "\r\n";
+
+/* Client headers the proxy replaces, or that are hop-by-hop; Host is
+   only replaced if the client did not send one */
+static char *own_hdrs[] = {
+    "User-Agent", "Connection", "Proxy-Connection", "Keep-Alive",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-length",
+    // The response goes into a cache shared by every client, so it must
+    // not depend on what this client already has.
+    "Range", "If-Range", "If-Match", "If-None-Match", "If-Modified-Since",
+    "If-Unmodified-Since", NULL
+};
 
 
+#define DEF_NWORKERS    16  /* Worker threads in prethread mode */
+#define DEF_QUEUE_DEPTH 64  /* Queued connections in prethread mode */
+#define RELAY_BUF (64 * 1024) /* Bytes of response body moved per read */
+#define WORKER_STACK (64 * 1024) /* Stack of a thread serving connections */
+#define REQ_FIRST 1024      /* Request buffer to start with; it doubles */
+
 void *thread(void *args);
-void read_requesthdrs(rio_t *rp);
+void *worker(void *vargp);
+void *reporter(void *vargp);
+void prethread_run(int listenfd, int nworkers);
+void serve_client(int fd);
+int doit(int fd, rio_t *rio, arena *a);
+int read_request(rio_t *rp, char **reqp, http_request *hr, arena *a);
+int send_object(int fd, char *content, unsigned int size,
+                unsigned int hdr_len, int *client, arena *a);
+int serve_from_fill(int fd, cache_fill *fill, int *client, arena *a);
+int fetch_from_server(int fd, char *host, char *port, http_request *hr,
+                      cache_fill *fill, int *client, int *status,
+                      arena *a);
+ssize_t read_body(rio_t *rp, http_framer *fr, char *buf, size_t n);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void parse_request(char *buf, char *host, char *port, char *pathname);
-void forward_to_server(int connfd, char *pathname, char *host);
 
 void serve_static(int fd, char *filename, int filesize);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
-         char *shortmsg, char *longmsg);
+void usage(char *prog);
+static int add_iov(struct iovec *iov, int n, const char *p, size_t len);
+static int own_header(http_view name);
+static char *view_dup(arena *a, http_view v);
+static void set_timeout(int fd, int opt, int secs);
+static int strip_headers(char *buf, int hdr_len, int len, char **names);
+static int accept_client(int listenfd);
+
+sbuf_t sbuf; /* Shared buffer of connected descriptors */
+cache proxy_cache; /* Web objects shared by all connections */
+static char *snapshot; /* Where the cache is saved on SIGTERM, if anywhere */
+static pthread_attr_t worker_attr; /* Small stacks for connection threads */
 
 /* $begin tinymain */
 int main(int argc, char **argv) 
 {
-    int listenfd, *connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd, connfd, *listenfds;
     pthread_t tid;
+    sigset_t mask;
+    char *mode = "thread";
+    int opt, nthreads = 0, qdepth = DEF_QUEUE_DEPTH, nshards = CACHE_SHARDS;
+    int keepalive = 0, idle_timeout = UPSTREAM_IDLE_TIMEOUT, sharded = 0, i;
+    int level = LEVEL_INFO, admission = 0, disk_mb = DISK_DEFAULT_MB;
+    int max_conns = ADMIT_CONNS, origin_max = ADMIT_ORIGIN;
+    const evict_policy *policy = &evict_lru;
+    char *disk_path = NULL;
+
     /* Check command line args */
-    if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+    while ((opt = getopt(argc, argv, "m:n:Rq:s:e:td:D:w:ki:c:o:l:")) != -1) {
+        switch (opt) {
+            case 'm':
+                mode = optarg;
+                break;
+            case 'n':
+                if ((nthreads = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'R':
+                sharded = 1;
+                break;
+            case 'q':
+                if ((qdepth = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 's':
+                if ((nshards = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'e':
+                if ((policy = evict_policy_find(optarg)) == NULL)
+                    usage(argv[0]);
+                break;
+            case 't':
+                admission = 1;
+                break;
+            case 'd':
+                disk_path = optarg;
+                break;
+            case 'D':
+                if ((disk_mb = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'w':
+                snapshot = optarg;
+                break;
+            case 'k':
+                keepalive = 1;
+                break;
+            case 'i':
+                if ((idle_timeout = atoi(optarg)) < 1)
+                    usage(argv[0]);
+                break;
+            case 'c':
+                if ((max_conns = atoi(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            case 'o':
+                if ((origin_max = atoi(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            case 'l':
+                if ((level = log_level_parse(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    if (!strcmp(mode, "epoll") || !strcmp(mode, "uring")) {
+        if (nthreads == 0)
+            nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    } else if (sharded)
+        usage(argv[0]);
+
+    // Only the reporter thread takes SIGUSR1 and SIGTERM, via sigwait,
+    // so they are blocked before any other thread starts.
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    log_init(STDOUT_FILENO, level);
 
-    listenfd = Open_listenfd(argv[1]);
+    /* Cache initiation */
+    cache_init(&proxy_cache, MAX_CACHE_SIZE, nshards, policy, admission);
+    if (disk_path)
+        disk_init(disk_path, (size_t)disk_mb * 1024 * 1024, snapshot != NULL);
+    if (snapshot)
+        cache_load(&proxy_cache, snapshot);
+    if (keepalive)
+        upstream_init(idle_timeout);
+    admit_init(max_conns, origin_max);
+    // A peer that closes early shows up as EPIPE instead of a signal.
+    Signal(SIGPIPE, SIG_IGN);
+    if (!strcmp(mode, "prethread"))
+        sbuf_init(&sbuf, qdepth);
+    // Connection buffers live in arenas, so the stack only holds frames.
+    pthread_attr_init(&worker_attr);
+    pthread_attr_setstacksize(&worker_attr, WORKER_STACK);
+    Pthread_create(&tid, NULL, reporter, NULL);
+
+    if (sharded) {
+        // One listener per reactor, each preferred for its own CPU.
+        listenfds = Malloc(nthreads * sizeof(int));
+        for (i = 0; i < nthreads; i++)
+            if ((listenfds[i] = reactor_listen(argv[optind],
+                                               cpu_nth(i))) < 0)
+                unix_error("Open_listenfd error");
+    } else {
+        listenfd = Open_listenfd(argv[optind]);
+        listenfds = &listenfd;
+    }
+    if (!strcmp(mode, "epoll")) {
+        // Event-driven: a fixed set of reactor threads does all the work.
+        reactor_run(listenfds, nthreads, sharded);
+    } else if (!strcmp(mode, "uring")) {
+        // The same, but with the I/O itself submitted through io_uring.
+        uring_run(listenfds, nthreads, sharded);
+    } else if (!strcmp(mode, "prethread")) {
+        prethread_run(listenfd, nthreads ? nthreads : DEF_NWORKERS);
+    } else if (strcmp(mode, "thread")) {
+        usage(argv[0]);
+    }
+    if (set_nonblocking(listenfd) < 0)
+        unix_error("fcntl error");
     while (1) {
-    clientlen = sizeof(clientaddr);
-    //line:netp:tiny:accept
-    connfd = Malloc(sizeof(connfd));
-    connfd[0] = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-    Pthread_create(&tid, NULL, thread, (void *)connfd);
+        connfd = accept_client(listenfd);
+        // The descriptor itself is the thread's argument.
+        Pthread_create(&tid, &worker_attr, thread, (void *)(intptr_t)connfd);
     }
 }
 /* $end tinymain */
 
 /*
- * thread - handle one HTTP request/response transaction
+ * usage - print the command line options and exit
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-m thread|prethread|epoll|uring] [-n nthreads] "
+            "[-R] [-q depth] [-s shards] [-e policy] [-t] [-d file [-D mb]] "
+            "[-w file] [-k] [-i secs] [-c conns] [-o fetches] [-l level] "
+            "<port>\n", prog);
+    fprintf(stderr, "  -m  concurrency mode (default: thread per connection)\n");
+    fprintf(stderr, "  -n  worker threads (prethread, default %d) or reactor "
+            "threads\n      (epoll and uring, default one per CPU)\n",
+            DEF_NWORKERS);
+    fprintf(stderr, "  -R  one SO_REUSEPORT listener per reactor thread, "
+            "each thread pinned\n      to a CPU (epoll and uring)\n");
+    fprintf(stderr, "  -q  connection queue depth in prethread mode "
+            "(default %d)\n", DEF_QUEUE_DEPTH);
+    fprintf(stderr, "  -s  independently locked cache shards (default %d)\n",
+            CACHE_SHARDS);
+    fprintf(stderr, "  -e  cache eviction policy: lru (default), clock or "
+            "s3fifo\n");
+    fprintf(stderr, "  -t  admit new cache objects through a TinyLFU "
+            "filter\n");
+    fprintf(stderr, "  -d  spill objects evicted from memory to a log in "
+            "file\n");
+    fprintf(stderr, "  -D  megabytes the log may take (default %d)\n",
+            DISK_DEFAULT_MB);
+    fprintf(stderr, "  -w  save the cache to file on SIGTERM and load it "
+            "at startup,\n      keeping the -d log too\n");
+    fprintf(stderr, "  -k  HTTP/1.1 upstream, reusing idle origin connections\n");
+    fprintf(stderr, "  -i  seconds an origin connection may stay idle "
+            "(default %d)\n", UPSTREAM_IDLE_TIMEOUT);
+    fprintf(stderr, "  -c  client connections in the proxy at once, past "
+            "which they are\n      answered 503 (default %d, 0 for no "
+            "limit)\n", ADMIT_CONNS);
+    fprintf(stderr, "  -o  fetches in flight per origin, past which they "
+            "wait in a short\n      queue (default %d, 0 for no limit)\n",
+            ADMIT_ORIGIN);
+    fprintf(stderr, "  -l  log level: error, warn, info (one line per "
+            "request, default) or debug\n");
+    exit(1);
+}
+
+/*
+ * prethread_run - accept connections into a bounded queue drained by a
+ *     fixed pool of worker threads. The acceptor blocks once the queue
+ *     (set up by main) is full, so at most nworkers + its depth
+ *     connections are in the proxy and the rest wait in the kernel's
+ *     listen backlog.
+ */
+/* $begin prethread_run */
+void prethread_run(int listenfd, int nworkers)
+{
+    int i;
+    pthread_t tid;
+
+    for (i = 0; i < nworkers; i++)      /* Create worker threads */
+        Pthread_create(&tid, &worker_attr, worker, NULL);
+
+    if (set_nonblocking(listenfd) < 0)
+        unix_error("fcntl error");
+    while (1)
+        sbuf_insert(&sbuf, accept_client(listenfd)); /* Insert connfd */
+}
+/* $end prethread_run */
+
+/*
+ * accept_client - accept the next connection on listenfd that admission
+ *     control lets in, answering those it does not with a 503. Out of
+ *     descriptors or memory, it pauses ACCEPT_BACKOFF_MS at a time until
+ *     connections being served close some, instead of giving up.
+ */
+static int accept_client(int listenfd)
+{
+    int connfd, overloaded = 0;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept_next(listenfd, (SA *)&clientaddr,
+                                  &clientlen, 0)) < 0) {
+            if (!accept_overloaded(errno))
+                unix_error("Accept error");
+            // Once per spell, not every ACCEPT_BACKOFF_MS.
+            if (!overloaded++)
+                log_warn("accept: %s, pausing", strerror(errno));
+            usleep(ACCEPT_BACKOFF_MS * 1000);
+            continue;
+        }
+        log_debug_addr("Accepted connection from", &clientaddr, clientlen);
+        if (admit_conn())
+            return connfd;
+        admit_reject(connfd);
+        Close(connfd);
+    }
+}
+
+/*
+ * worker - serve connections taken from the shared buffer forever
+ */
+void *worker(void *vargp)
+{
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+        serve_client(connfd);
+        Close(connfd);
+        admit_conn_done();
+    }
+}
+
+/*
+ * reporter - print the resolver and admission counters, the disk
+ *     tier's if it is on, the queue-wait statistics in prethread mode and
+ *     the ring counters in uring mode, on every SIGUSR1;
+ *     on SIGTERM, save the cache if asked to and exit
+ */
+void *reporter(void *vargp)
+{
+    sigset_t mask;
+    int sig, depth, n;
+    unsigned long removed, total, max, lookups;
+    dns_stats dns;
+    disk_stats disk;
+    uring_stats ring;
+    admit_stats adm;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGTERM);
+    while (1) {
+        if (sigwait(&mask, &sig) != 0)
+            continue;
+        if (sig == SIGTERM) {
+            if (snapshot && (n = cache_save(&proxy_cache, snapshot)) >= 0)
+                log_info("cache: saved %d objects to %s", n, snapshot);
+            exit(0);
+        }
+        dns_get_stats(&dns);
+        lookups = dns.hits + dns.negative_hits + dns.misses;
+        fprintf(stderr, "dns: %lu lookups, %lu hits, %lu negative hits, "
+                "%lu misses (%lu failed), %d hosts cached, resolving took "
+                "%lu us total, avg %lu us, max %lu us\n", lookups, dns.hits,
+                dns.negative_hits, dns.misses, dns.failures, dns.entries,
+                dns.resolve_us, dns.misses ? dns.resolve_us / dns.misses : 0,
+                dns.resolve_max_us);
+        if (disk_enabled) {
+            disk_get_stats(&disk);
+            fprintf(stderr, "disk: %lu hits, %lu spills (%lu dropped), %lu "
+                    "objects in %lu of %lu bytes, %lu compactions\n",
+                    disk.hits, disk.spills, disk.dropped, disk.entries,
+                    disk.live, disk.end, disk.compactions);
+        }
+        admit_get_stats(&adm);
+        fprintf(stderr, "admit: %lu connections served, %lu shed, %d in the "
+                "proxy; %lu fetches admitted, %lu after queueing, %lu shed, "
+                "%d origins busy\n", adm.conns_served, adm.conns_shed,
+                adm.conns, adm.fetches, adm.queued, adm.fetches_shed,
+                adm.origins);
+        uring_get_stats(&ring);
+        if (ring.rings)
+            fprintf(stderr, "uring: %d rings (%d with registered buffers), "
+                    "%lu connections, %lu operations in %lu enters, "
+                    "%.1f per enter\n", ring.rings, ring.fixed, ring.accepted,
+                    ring.ops, ring.enters,
+                    ring.enters ? (double)ring.ops / ring.enters : 0.0);
+        if (sbuf.n == 0)
+            continue;
+        P(&sbuf.mutex);
+        removed = sbuf.removed;
+        total = sbuf.wait_total_us;
+        max = sbuf.wait_max_us;
+        depth = sbuf.rear - sbuf.front;
+        V(&sbuf.mutex);
+        fprintf(stderr, "prethread: %lu connections served, %d/%d queued, "
+                "queue wait avg %lu us, max %lu us\n", removed, depth,
+                sbuf.n, removed ? total / removed : 0, max);
+    }
+    return NULL;
+}
+
+/*
+ * thread - serve one connection on its own detached thread
  */
 /* $begin thread */
 void *thread(void *args) 
 {
+    int fd = (int)(intptr_t)args;
+
     Pthread_detach(pthread_self());
-    int fd = *(int *)args;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    rio_t rio;
-    char pathname[MAXLINE], port[MAXLINE], host[MAXLINE];
-    int clientfd;
-
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return NULL;
-    // Parse request
-    sscanf(buf, "%s %s %s", method, uri, version);
-    // Begin request error
-    if (strcasecmp(method, "GET")) {
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Proxy does not implement this method");
-        return NULL;
-    }
- 
-    // Parse request.
-    sprintf(port, "80");
-    parse_request(buf, host, port, pathname);
-    // Send request to server.
-    clientfd = Open_clientfd(host, port);
-    forward_to_server(clientfd, pathname, host);
-    // Read response.
-    Rio_readinitb(&rio, clientfd);
-    int size = 0;
-    while ((size = Rio_readlineb(&rio, buf, MAXLINE)) > 0)
-    {
-        Rio_writen(fd, buf, size);
-        printf("%s\n", buf);
-    }
-    Free(args);
+    serve_client(fd);
     Close(fd);
-    Close(clientfd);
+    admit_conn_done();
     return NULL;
 }
 /* $end thread */
 
-void parse_request(char *buf, char *host, char *port, char *pathname)
+/*
+ * serve_client - answer the requests on a client connection in order,
+ *     including pipelined ones already in the read buffer, until the
+ *     client closes it or a response has to end with the connection
+ */
+void serve_client(int fd)
+{
+    arena a;
+    arena_pos conn;
+    rio_t *rio;
+    int one = 1;
+
+    // An idle persistent connection must not hold a thread forever,
+    // and neither must a client that stops reading its response.
+    set_timeout(fd, SO_RCVTIMEO, CLIENT_IDLE_TIMEOUT);
+    set_timeout(fd, SO_SNDTIMEO, BODY_TIMEOUT);
+    // The tail of a response must not wait for the client to ack the
+    // write before it, or every kept-alive request stalls on a delayed
+    // ack.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Only the read buffer outlives a request.
+    arena_init(&a);
+    rio = arena_alloc(&a, sizeof(rio_t));
+    Rio_readinitb(rio, fd);
+    arena_save(&a, &conn);
+    while (doit(fd, rio, &a) > 0)
+        arena_reset(&a, &conn);
+    arena_free(&a);
+}
+
+/*
+ * doit - handle one HTTP request/response transaction, with its buffers
+ *     in arena a; returns 1 if the connection can take another request
+ */
+/* $begin doit */
+int doit(int fd, rio_t *rio, arena *a) 
+{
+    char *req, *uri, *port, *host;
+    http_request hr;
+    cache_block *cb, *stale = NULL;
+    cache_fill *fill = NULL;
+    int client, rc, status;
+
+    /* Read and parse the request line and headers */
+    if ((rc = read_request(rio, &req, &hr, a)) == 0)
+        return 0;
+    if (rc == REQ_BAD_LINE) {
+        clienterror(fd, "request", "400", "Bad Request",
+                    "Proxy could not parse the request line");
+        return 0;
+    }
+    if (rc < 0) {
+        clienterror(fd, "header", "400", "Bad Request",
+                    "Request header too large");
+        return 0;
+    }
+    client = request_keepalive(&hr);
+    // Begin request error
+    if (!view_is(hr.method, "GET")) {
+        clienterror(fd, view_dup(a, hr.method), "501",
+                    "Not Implemented", "Proxy does not implement this method");
+        return 0;
+    }
+
+    // Split the URI; only the cache key, host and port need copies.
+    uri = view_dup(a, hr.uri);
+    if (request_target(&hr) < 0) {
+        clienterror(fd, uri, "400", "Bad Request",
+                    "Proxy could not parse the request URI");
+        return 0;
+    }
+    host = view_dup(a, hr.host);
+    port = view_dup(a, hr.port);
+    log_debug("Parsed host %s, port %s, pathname %.*s", host, port,
+              (int)hr.path.len, hr.path.p);
+    // First find in cache, or join a fetch of the object in flight.
+    switch (cache_acquire(&proxy_cache, uri, &cb, &fill)) {
+    case CACHE_HIT:
+        rc = send_object(fd, cb->content, cb->block_size, cb->hdr_len,
+                         &client, a);
+        release_cache_block(&proxy_cache, cb);
+        log_access(req, "HIT", 200);
+        return rc < 0 ? 0 : client;
+    case CACHE_JOIN:
+        if ((rc = serve_from_fill(fd, fill, &client, a)) != -1) {
+            log_access(req, "JOIN", 200);
+            return rc < 0 ? 0 : client;
+        }
+        // It will not be cached after all, so fetch it ourselves.
+        fill = NULL;
+        break;
+    case CACHE_STALE:
+        stale = cb;
+        break;
+    }
+    if (fill)
+        fill->credentials = request_credentials(&hr);
+    // Fetch it from the origin, teeing the response into the cache, or
+    // revalidate the stale copy, once the origin has a slot for it.
+    if (admit_origin(host, port, NULL) != ADMIT_OK) {
+        if (fill)
+            cache_fill_abort(fill);
+        if (stale && cache_serve_stale(stale)) {
+            rc = send_object(fd, stale->content, stale->block_size,
+                             stale->hdr_len, &client, a);
+            log_access(req, "STALE", 200);
+        } else {
+            admit_reject(fd);
+            log_access(req, "SHED", 503);
+            rc = -1;
+        }
+        if (stale)
+            release_cache_block(&proxy_cache, stale);
+        return rc < 0 ? 0 : client;
+    }
+    rc = fetch_from_server(fd, host, port, &hr, fill, &client, &status, a);
+    admit_origin_done(host, port);
+    if (rc == -1) {
+        if (fill)
+            cache_fill_abort(fill);
+        // An unreachable origin does not make a stale copy useless.
+        if (status == 400)
+            clienterror(fd, "header", "400", "Bad Request",
+                        "Request has too many headers to forward");
+        else if (stale && cache_serve_stale(stale)) {
+            rc = send_object(fd, stale->content, stale->block_size,
+                             stale->hdr_len, &client, a);
+            log_access(req, "STALE", 200);
+        } else if (status == 504)
+            clienterror(fd, host, "504", "Gateway Timeout",
+                        "Proxy timed out waiting for the origin server");
+        else
+            clienterror(fd, host, "502", "Bad Gateway",
+                        "Proxy could not get a response from the origin server");
+    } else if (stale && status == 304)
+        log_access(req, "REVAL", 200);
+    else
+        log_access(req, "MISS", status);
+    if (stale)
+        release_cache_block(&proxy_cache, stale);
+    return rc < 0 ? 0 : client;
+}
+/* $end doit */
+
+/*
+ * read_request - read the next request's line and headers into a
+ *     buffer from arena a, returned in *reqp, and parse them as they
+ *     arrive, taking whole reads from rio's buffer but leaving a
+ *     pipelined request behind it there. The buffer starts at REQ_FIRST
+ *     bytes and doubles as needed. Returns the length of the header
+ *     block, 0 if the client closed the connection or went idle before
+ *     a whole one arrived, or a REQ_* error (REQ_TOO_LARGE too if it
+ *     does not fit in MAXBUF).
+ */
+int read_request(rio_t *rp, char **reqp, http_request *hr, arena *a)
+{
+    size_t len = 0, size = REQ_FIRST, n;
+    char *req = arena_alloc(a, size), *old;
+    int rc;
+
+    request_init(hr);
+    while (1) {
+        if (rp->rio_cnt == 0) {
+            while ((rc = read(rp->rio_fd, rp->rio_buf,
+                              sizeof(rp->rio_buf))) < 0 && errno == EINTR)
+                ;
+            if (rc <= 0)
+                return 0;
+            rp->rio_cnt = rc;
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        if (len == size - 1) {
+            if (size == MAXBUF)
+                return REQ_TOO_LARGE;
+            old = req;
+            req = arena_grow(a, req, size, 2 * size);
+            size *= 2;
+            // The parsed views point into the buffer; parse it again
+            // where it now is.
+            if (req != old) {
+                request_init(hr);
+                request_parse(hr, req, len);
+            }
+        }
+        n = size - 1 - len;
+        if (n > (size_t)rp->rio_cnt)
+            n = rp->rio_cnt;
+        memcpy(req + len, rp->rio_bufptr, n);
+        rc = request_parse(hr, req, len + n);
+        if (rc == REQ_DONE)
+            n = hr->off - len;
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        len += n;
+        if (rc != REQ_AGAIN)
+            break;
+    }
+    req[len] = '\0';
+    *reqp = req;
+    return (rc == REQ_DONE) ? len : rc;
+}
+
+/*
+ * send_object - write a complete response, such as a cached object,
+ *     whose header block is its first hdr_len bytes; the client is
+ *     downgraded to CLIENT_CLOSE if the response cannot be kept alive.
+ *     Returns -1 if the client went away.
+ */
+int send_object(int fd, char *content, unsigned int size,
+                unsigned int hdr_len, int *client, arena *a)
+{
+    char *head = arena_alloc(a, hdr_len + CONN_HDR_ROOM);
+    int n;
+
+    n = client_head(head, content, hdr_len, client);
+    if (rio_writen(fd, head, n) != n
+        || rio_writen(fd, content + hdr_len, size - hdr_len)
+           != (ssize_t)(size - hdr_len))
+        return -1;
+    return 0;
+}
+
+/*
+ * serve_from_fill - relay the response another request is fetching
+ *     for the same URI as it arrives; returns -1 if nothing was sent
+ *     because the object is not going to be cached, and -2 if the
+ *     client went away
+ */
+int serve_from_fill(int fd, cache_fill *fill, int *client, arena *a)
+{
+    unsigned int off = 0;
+    char *head, *data;
+    int n, len, rc = 0;
+
+    while ((n = cache_fill_read(fill, off, &data, NULL)) > 0) {
+        // Whatever is readable starts with the whole header block.
+        if (off == 0) {
+            head = arena_alloc(a, fill->hdr_len + CONN_HDR_ROOM);
+            len = client_head(head, data, fill->hdr_len, client);
+            if (rio_writen(fd, head, len) != len) {
+                rc = -2;
+                break;
+            }
+            data += fill->hdr_len;
+            n -= fill->hdr_len;
+            off = fill->hdr_len;
+        }
+        if (rio_writen(fd, data, n) != n) {
+            rc = -2;
+            break;
+        }
+        off += n;
+    }
+    cache_fill_leave(fill, NULL);
+    if (n == FILL_FAILED && off == 0)
+        return -1;
+    return (n == FILL_FAILED) ? -2 : rc;
+}
+
+/*
+ * fetch_from_server - send the request to the origin, over an idle
+ *     pooled connection if there is one, and relay the response to the
+ *     client and into fill; returns -1 if no response came back, with
+ *     *status 504 if the origin timed out, 400 if the request could not
+ *     be rewritten and 502 otherwise, -2 if the
+ *     client went away, and 0 otherwise, with the status code of the
+ *     response in *status. A pooled connection that
+ *     fails before answering is replaced by a new one. The origin has
+ *     HEADER_TIMEOUT seconds to start the response header and
+ *     BODY_TIMEOUT for every read after it. The response
+ *     header is read whole, so that its hop-by-hop headers can be
+ *     replaced by the proxy's own Connection header for this client.
+ *     If fill revalidates a stale block, a 304 refreshes the block and
+ *     the client is sent the block instead.
+ */
+/* $begin fetch_from_server */
+int fetch_from_server(int fd, char *host, char *port, http_request *hr,
+                      cache_fill *fill, int *client, int *status,
+                      arena *a)
+{
+    char *buf = arena_alloc(a, MAXBUF + CONN_HDR_ROOM), *body = NULL;
+    cache_block *stale = fill ? fill->stale : NULL;
+    rio_t *rio = arena_alloc(a, sizeof(rio_t));
+    http_framer fr;
+    int clientfd, reused, len, timed_out, unchunk = 0, rc = 0;
+    enum frame_state st;
+    ssize_t size;
+    size_t want, bodylen = 0;
+    long spliced;
+
+    do {
+        if (upstream_keepalive && (clientfd = upstream_get(host, port)) >= 0)
+            reused = 1;
+        else if ((clientfd = dns_open_clientfd(host, port)) >= 0)
+            reused = 0;
+        else {
+            *status = (clientfd == -1 && errno == ETIMEDOUT) ? 504 : 502;
+            return -1;
+        }
+        set_timeout(clientfd, SO_SNDTIMEO, BODY_TIMEOUT);
+        set_timeout(clientfd, SO_RCVTIMEO, HEADER_TIMEOUT);
+        framer_init(&fr);
+        if ((size = forward_to_server(clientfd, hr, host, stale)) == -2) {
+            Close(clientfd);
+            *status = 400;
+            return -1;
+        }
+
+        // Read the response header.
+        Rio_readinitb(rio, clientfd);
+        len = 0;
+        while (size >= 0 && len < MAXBUF - 1
+               && (fr.state == FRAME_STATUS || fr.state == FRAME_HEADER)) {
+            if ((size = rio_readlineb(rio, buf + len, MAXBUF - len)) <= 0)
+                break;
+            framer_feed(&fr, buf + len, size);
+            len += size;
+        }
+        // A header the origin does not finish in time is as good as
+        // none, and a connection that timed out is not retried.
+        timed_out = size < 0 && errno == EAGAIN;
+        if (timed_out && !framer_header_done(&fr))
+            len = 0;
+        if (len == 0)
+            Close(clientfd);
+    } while (len == 0 && reused && !timed_out);
+    if (len == 0) {
+        *status = timed_out ? 504 : 502;
+        return -1;
+    }
+    *status = fr.status;
+    set_timeout(clientfd, SO_RCVTIMEO, BODY_TIMEOUT);
+
+    // A 304 answers the revalidation: the refreshed block is the response.
+    if (stale && fr.status == 304 && fr.state == FRAME_DONE) {
+        cache_fill_append(fill, buf, len);
+        cache_fill_end(fill);
+        if (upstream_keepalive && framer_reusable(&fr) && rio->rio_cnt == 0)
+            upstream_put(host, port, clientfd);
+        else
+            Close(clientfd);
+        return send_object(fd, stale->content, stale->block_size,
+                           stale->hdr_len, client, a) < 0 ? -2 : 0;
+    }
+
+    // Rewrite it for the client, unless it is not a header we can parse,
+    // in which case it is relayed as is and the connection closed after.
+    // A chunked body goes to a client older than HTTP/1.1 without its
+    // chunk framing, ended by closing the connection.
+    if (framer_header_done(&fr)) {
+        unchunk = fr.chunked && *client != CLIENT_HTTP11;
+        *client = response_keepalive(&fr, *client);
+        len = strip_hop_headers(buf, len, len);
+        if (fill)
+            cache_fill_append(fill, buf, len);
+        if (unchunk)
+            len = drop_header(buf, len, len, "Transfer-Encoding");
+        len = add_conn_header(buf, len, len, *client);
+    } else {
+        *client = CLIENT_CLOSE;
+        if (fill)
+            cache_fill_append(fill, buf, len);
+    }
+    if (rio_writen(fd, buf, len) != len)
+        rc = -2;
+    log_debug("Response header from %s:%s\n%.*s", host, port, len, buf);
+
+    // Relay the body in bulk, binary safe and never past its end, so a
+    // kept-alive connection does not block. A large body that is not
+    // going into the cache is spliced straight across once the bytes
+    // already buffered in rio are out.
+    while (rc == 0 && size > 0 && fr.state != FRAME_DONE) {
+        if (fill && !cache_fill_active(fill)) {
+            cache_fill_abort(fill);
+            fill = NULL;
+        }
+        if (!fill && framer_raw_body(&fr, SPLICE_MIN) && rio->rio_cnt == 0) {
+            want = framer_want(&fr);
+            if ((spliced = splice_relay(clientfd, fd,
+                                        want ? (long)want : -1)) == -1) {
+                rc = -2;
+                break;
+            } else if (spliced >= 0) {
+                framer_skip(&fr, spliced);
+                if (fr.state != FRAME_DONE)
+                    size = 0;
+                break;
+            }
+        }
+        if (body == NULL) {
+            // A body of known length gets a buffer of just its size.
+            want = framer_want(&fr);
+            bodylen = (fr.state == FRAME_BODY && want < RELAY_BUF)
+                      ? want : RELAY_BUF;
+            body = arena_alloc(a, bodylen);
+        }
+        // Every read is chunk data or one line of the framing.
+        st = fr.state;
+        if ((size = read_body(rio, &fr, body, bodylen)) <= 0)
+            break;
+        if ((!unchunk || st == FRAME_CHUNK_DATA)
+            && rio_writen(fd, body, size) != size)
+            rc = -2;
+        if (fill)
+            cache_fill_append(fill, body, size);
+        framer_feed(&fr, body, size);
+    }
+
+    // A response cut short by the origin or the client is not cached,
+    // and leaves the client unable to tell where the next one starts.
+    if (fr.state != FRAME_DONE)
+        *client = CLIENT_CLOSE;
+    if (fill && rc == 0 && (fr.state == FRAME_DONE
+                            || (fr.state == FRAME_UNTIL_EOF && size == 0)))
+        cache_fill_end(fill);
+    else if (fill)
+        cache_fill_abort(fill);
+    if (upstream_keepalive && rc == 0 && framer_reusable(&fr)
+        && rio->rio_cnt == 0)
+        upstream_put(host, port, clientfd);
+    else
+        Close(clientfd);
+    return rc;
+}
+/* $end fetch_from_server */
+
+/*
+ * read_body - read the next piece of the response body, at most n
+ *     bytes: what rio has buffered first, then straight from the socket
+ *     into buf. Only the size lines of a chunked body are read line by
+ *     line; data is never read past the end the framing gives.
+ */
+ssize_t read_body(rio_t *rp, http_framer *fr, char *buf, size_t n)
+{
+    size_t want = framer_want(fr);
+    ssize_t rc;
+
+    if (want == 0 && fr->state != FRAME_UNTIL_EOF)
+        return rio_readlineb(rp, buf, n);
+    if (want > 0 && want < n)
+        n = want;
+    if (rp->rio_cnt > 0)
+        return rio_readnb(rp, buf, (size_t)rp->rio_cnt < n ? rp->rio_cnt : n);
+    while ((rc = read(rp->rio_fd, buf, n)) < 0 && errno == EINTR)
+        ;
+    return rc;
+}
+
+/*
+ * forward_to_server - send the rewritten request to the origin with one
+ *     writev, made conditional if it revalidates a stale cached block;
+ *     returns -1 if the connection failed, and -2 if the request has
+ *     too many pieces to be rewritten
+ */
+int forward_to_server(int connfd, http_request *hr, char *host,
+                      cache_block *stale)
+{
+    struct iovec iovs[REQ_IOV_MAX], *iov = iovs;
+    int niov;
+    ssize_t n;
+
+    if ((niov = build_request(iov, hr, stale)) < 0)
+        return -2;
+    log_request(iov, niov, host);
+    while (niov > 0) {
+        if ((n = writev(connfd, iov, niov)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        iov_consume(&iov, &niov, n);
+    }
+    return 0;
+}
+
+/*
+ * build_request - lay out the request forward_to_server sends as iovecs
+ *     (at most REQ_IOV_MAX) over the proxy's own header strings and the
+ *     parsed client request: its path, and the client's headers other
+ *     than the ones in own_hdrs. A request that revalidates a stale
+ *     block asks for it only if the validators of the block no longer
+ *     match. Returns how many were used, or -1 if they would not fit.
+ */
+int build_request(struct iovec *iov, http_request *hr, cache_block *stale)
+{
+    http_header *h, *end = hr->headers + hr->nheaders;
+    http_view etag, last_modified;
+    int n = 0, has_host = 0;
+
+    n = add_iov(iov, n, "GET ", 4);
+    n = add_iov(iov, n, hr->path.p, hr->path.len);
+    n = add_iov(iov, n, upstream_keepalive ? " HTTP/1.1\r\n"
+                                           : " HTTP/1.0\r\n", 11);
+    for (h = hr->headers; h < end; h++) {
+        if (view_is(h->name, "Host")) {
+            if (has_host++)
+                continue;
+        } else if (own_header(h->name))
+            continue;
+        // The line up to the end of its value, ended by CRLF even if
+        // the client only sent LF.
+        n = add_iov(iov, n, h->name.p, h->value.p + h->value.len - h->name.p);
+        n = add_iov(iov, n, crlf, 2);
+    }
+    if (!has_host) {
+        n = add_iov(iov, n, "Host: ", 6);
+        n = add_iov(iov, n, hr->host.p, hr->host.len);
+        n = add_iov(iov, n, crlf, 2);
+    }
+    if (stale) {
+        cache_validators(stale, &etag, &last_modified);
+        if (etag.len) {
+            n = add_iov(iov, n, "If-None-Match: ", 15);
+            n = add_iov(iov, n, etag.p, etag.len);
+            n = add_iov(iov, n, crlf, 2);
+        }
+        if (last_modified.len) {
+            n = add_iov(iov, n, "If-Modified-Since: ", 19);
+            n = add_iov(iov, n, last_modified.p, last_modified.len);
+            n = add_iov(iov, n, crlf, 2);
+        }
+    }
+    n = add_iov(iov, n, user_agent_hdr, strlen(user_agent_hdr));
+    if (upstream_keepalive)
+        n = add_iov(iov, n, keepalive_hdr, strlen(keepalive_hdr));
+    else {
+        n = add_iov(iov, n, conn_hdr, strlen(conn_hdr));
+        n = add_iov(iov, n, proxy_conn_hdr, strlen(proxy_conn_hdr));
+    }
+    n = add_iov(iov, n, crlf, 2);
+    return n <= REQ_IOV_MAX ? n : -1;
+}
+
+/*
+ * add_iov - point iov[n] at len bytes at p, unless n is past the end of
+ *     the REQ_IOV_MAX iovecs; returns n + 1 either way
+ */
+static int add_iov(struct iovec *iov, int n, const char *p, size_t len)
+{
+    if (n < REQ_IOV_MAX) {
+        iov[n].iov_base = (char *)p;
+        iov[n].iov_len = len;
+    }
+    return n + 1;
+}
+
+/*
+ * own_header - whether the client header is one of own_hdrs, which are
+ *     not forwarded
+ */
+static int own_header(http_view name)
+{
+    char **own;
+
+    for (own = own_hdrs; *own; own++)
+        if (view_is(name, *own))
+            return 1;
+    return 0;
+}
+
+/*
+ * view_dup - the view as a string of its own, carved from arena a
+ */
+static char *view_dup(arena *a, http_view v)
+{
+    return view_str(arena_alloc(a, v.len + 1), v.len + 1, v);
+}
+
+/*
+ * set_timeout - make blocking sends (SO_SNDTIMEO) or receives
+ *     (SO_RCVTIMEO) on fd give up with EAGAIN after secs seconds
+ */
+static void set_timeout(int fd, int opt, int secs)
+{
+    struct timeval tv;
+
+    tv.tv_sec = secs;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(tv));
+}
+
+/*
+ * iov_consume - step *iovp and *niov past the first n bytes written,
+ *     trimming a partly written iovec in place; returns how many are left
+ */
+int iov_consume(struct iovec **iovp, int *niov, size_t n)
+{
+    struct iovec *iov = *iovp;
+
+    while (*niov > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        (*niov)--;
+    }
+    if (*niov > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    *iovp = iov;
+    return *niov;
+}
+
+/*
+ * log_request - the debug log of a request about to be forwarded; the
+ *     pieces are only put together if debug logging is on
+ */
+void log_request(struct iovec *iov, int niov, char *host)
 {
-    char *temp, *first, *next, *p;
-    printf("%s\n", buf);
-    // Get host name.
-    if ((temp = strstr(buf, "http://")) == NULL)
-    {
+    char req[MAXBUF];
+    size_t len = 0, k;
+    int i;
+
+    if (log_level < LEVEL_DEBUG)
         return;
+    for (i = 0; i < niov && len < sizeof(req); i++) {
+        k = iov[i].iov_len;
+        if (k > sizeof(req) - len)
+            k = sizeof(req) - len;
+        memcpy(req + len, iov[i].iov_base, k);
+        len += k;
+    }
+    log_debug("Request to %s\n%.*s", host, (int)len, req);
+}
+
+/*
+ * request_credentials - the FILL_AUTH and FILL_COOKIE credentials the
+ *     parsed request carries, which keep its response out of the cache
+ */
+int request_credentials(http_request *hr)
+{
+    http_header *h, *end = hr->headers + hr->nheaders;
+    int credentials = 0;
+
+    for (h = hr->headers; h < end; h++) {
+        if (view_is(h->name, "Authorization"))
+            credentials |= FILL_AUTH;
+        else if (view_is(h->name, "Cookie"))
+            credentials |= FILL_COOKIE;
+    }
+    return credentials;
+}
+
+/*
+ * request_keepalive - how the client connection of the parsed request
+ *     may be reused. Requests with a body are never pipelined with,
+ *     since the proxy does not read bodies.
+ */
+int request_keepalive(http_request *hr)
+{
+    http_header *h, *end = hr->headers + hr->nheaders;
+    int client, asked = -1;
+
+    client = (hr->major > 1 || (hr->major == 1 && hr->minor >= 1))
+             ? CLIENT_HTTP11 : CLIENT_CLOSE;
+    for (h = hr->headers; h < end; h++) {
+        if (view_is(h->name, "Connection")
+            || view_is(h->name, "Proxy-Connection")) {
+            if (header_has_token(h->value.p, "close"))
+                asked = 0;
+            else if (header_has_token(h->value.p, "keep-alive") && asked)
+                asked = 1;
+        } else if ((view_is(h->name, "Content-length")
+                    && atol(h->value.p) != 0)
+                   || view_is(h->name, "Transfer-Encoding"))
+            return CLIENT_CLOSE;
+    }
+    if (asked == 0)
+        return CLIENT_CLOSE;
+    if (asked == 1 && client == CLIENT_CLOSE)
+        return CLIENT_KEEPALIVE;
+    return client;
+}
+
+/*
+ * response_keepalive - how the client connection may be reused after a
+ *     response with the header fr has parsed: only if the client asked
+ *     for it and the response ends without closing the connection, in
+ *     a framing the client understands
+ */
+int response_keepalive(http_framer *fr, int client)
+{
+    if (!framer_delimited(fr) || (fr->chunked && client != CLIENT_HTTP11))
+        return CLIENT_CLOSE;
+    return client;
+}
+
+/*
+ * strip_hop_headers - drop the Connection, Proxy-Connection and
+ *     Keep-Alive lines from the header block at the start of buf, which
+ *     holds len bytes; the bytes after the block move down with it.
+ *     Returns the new length.
+ */
+int strip_hop_headers(char *buf, int hdr_len, int len)
+{
+    static char *hop[] = {"Connection", "Proxy-Connection", "Keep-Alive",
+                          NULL};
+
+    return strip_headers(buf, hdr_len, len, hop);
+}
+
+/*
+ * drop_header - drop the name lines from the header block at the start
+ *     of buf, as strip_hop_headers does; returns the new length
+ */
+int drop_header(char *buf, int hdr_len, int len, char *name)
+{
+    char *names[2];
+
+    names[0] = name;
+    names[1] = NULL;
+    return strip_headers(buf, hdr_len, len, names);
+}
+
+/*
+ * strip_headers - drop the lines of the headers in the NULL-terminated
+ *     names from the header block at the start of buf, which holds len
+ *     bytes; the bytes after the block move down with it. Returns the
+ *     new length.
+ */
+static int strip_headers(char *buf, int hdr_len, int len, char **names)
+{
+    char *line, *next, *end = buf + hdr_len, *out, *value, **name;
+
+    // The status line always stays.
+    if ((line = memchr(buf, '\n', hdr_len)) == NULL)
+        return len;
+    out = ++line;
+    for (; line < end; line = next) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        for (name = names; *name; name++)
+            if (header_is(line, *name, &value))
+                break;
+        if (*name)
+            continue;
+        if (out != line)
+            memmove(out, line, next - line);
+        out += next - line;
+    }
+    memmove(out, end, len - hdr_len);
+    return len - (end - out);
+}
+
+/*
+ * add_conn_header - tell the client whether the connection stays open
+ *     by inserting a Connection header before the blank line that ends
+ *     the header block at the start of buf, which holds len bytes and
+ *     has CONN_HDR_ROOM bytes to spare; returns the new length
+ */
+int add_conn_header(char *buf, int hdr_len, int len, int client)
+{
+    const char *hdr = client ? keepalive_hdr : conn_hdr;
+    int n = strlen(hdr), at;
+
+    at = (hdr_len >= 2 && buf[hdr_len - 2] == '\r') ? hdr_len - 2
+                                                    : hdr_len - 1;
+    memmove(buf + at + n, buf + at, len - at);
+    memcpy(buf + at, hdr, n);
+    return len + n;
+}
+
+/*
+ * client_head - copy the header block of a complete response into head
+ *     and add the Connection header for the client; returns its length
+ */
+int client_head(char *head, char *hdr, int hdr_len, int *client)
+{
+    http_framer fr;
+
+    memcpy(head, hdr, hdr_len);
+    framer_init(&fr);
+    framer_feed(&fr, head, hdr_len);
+    if (!framer_header_done(&fr)) {
+        *client = CLIENT_CLOSE;
+        return hdr_len;
     }
-    // Point to the host name.
-    first = temp + 7;
-    // Point to "/" after host name to get path name.
-    if ((temp = strstr(first, "/")) != NULL)
-    {
-        next = temp;
-    }
-    // Point to the space after path name.
-    if ((temp = strstr(next, " ")) != NULL)
-    {
-        p = temp;
-    }
-    // Get pathname.
-    strncpy(pathname, next, p - next);
-    pathname[p - next] = '\0';
-    // Point to the ":" after host name if any.
-    if (((temp = strstr(first, ":")) != NULL) && (temp < next))  
-    {
-        // Get port.
-        strncpy(port, temp + 1, next - temp - 1);
-        port[next - temp - 1] = '\0';
-        next = temp;
-    }
-    // Get host name.
-    strncpy(host, first, next - first);
-    host[next - first] = '\0';
-    printf("%s\n", port);
-    printf("%s\n", host);
-    printf("%s\n", pathname);
-}
-
-void forward_to_server(int connfd, char *pathname, char *host)
-{
-    char req[MAXLINE];
-    // Forward request.
-    sprintf(req, "GET %s HTTP/1.0\r\n", pathname);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward hostname.
-    sprintf(req, "HOST: %s\r\n", host);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward User-Agent.
-    sprintf(req, user_agent_hdr);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward Connection.
-    sprintf(req, conn_hdr);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward Proxy-Connection.
-    sprintf(req, proxy_conn_hdr);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // End.
-    Rio_writen(connfd, "\r\n", 2);
+    *client = response_keepalive(&fr, *client);
+    return add_conn_header(head, hdr_len, hdr_len, *client);
 }
 
+/*
+ * header_is - if the header line starts with name, point *valuep at
+ *     its value
+ */
+int header_is(char *line, char *name, char **valuep)
+{
+    size_t len = strlen(name);
+
+    if (strncasecmp(line, name, len) || line[len] != ':')
+        return 0;
+    for (line += len + 1; *line == ' ' || *line == '\t'; line++)
+        ;
+    *valuep = line;
+    return 1;
+}
+
+/*
+ * header_has_token - whether the comma separated header value, which
+ *     ends at the end of its line, lists token
+ */
+int header_has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+    char *p, c;
+
+    for (p = value; *p && *p != '\r' && *p != '\n'; p++) {
+        if (strncasecmp(p, token, len)
+            || (p != value && p[-1] != ',' && p[-1] != ' '))
+            continue;
+        c = p[len];
+        if (c == '\0' || c == ',' || c == ' ' || c == ';' || c == '\r'
+            || c == '\n')
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * build_clienterror - format an error response into resp (at least
+ *     MAXBUF bytes) and return its length
+ */
+int build_clienterror(char *resp, char *cause, char *errnum,
+                      char *shortmsg, char *longmsg)
+{
+    char body[MAXBUF / 2];
+    int n;
+
+    /* Build the HTTP response body */
+    n = snprintf(body, sizeof(body), "<html><title>Proxy Error</title>"
+                 "<body bgcolor=""ffffff"">\r\n%s: %s\r\n<p>%s: %.512s\r\n"
+                 "<hr><em>The Proxy server</em>\r\n",
+                 errnum, shortmsg, longmsg, cause);
+    if (n >= (int)sizeof(body))
+        n = sizeof(body) - 1;
+    log_access(cause, "ERROR", atoi(errnum));
+
+    /* Prepend the HTTP response headers */
+    return sprintf(resp, "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+                   "Content-length: %d\r\n%s\r\n%s",
+                   errnum, shortmsg, n, conn_hdr, body);
+}
+
+/*
+ * log_access - the access log line of a request: how it was answered,
+ *     the status code, and the request line (or what went wrong)
+ */
+void log_access(char *reqline, char *how, int status)
+{
+    log_info("%s %d \"%.*s\"", how, status,
+             (int)strcspn(reqline, "\r\n"), reqline);
+}
 
 /*
  * clienterror - returns an error message to the client
@@ -184,22 +1283,10 @@ void forward_to_server(int connfd, char *pathname, char *host)
 void clienterror(int fd, char *cause, char *errnum, 
          char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE], body[MAXBUF];
+    char buf[MAXBUF];
+    int n;
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Proxy server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    n = build_clienterror(buf, cause, errnum, shortmsg, longmsg);
+    rio_writen(fd, buf, n);
 }
 /* $end clienterror */
@@ -0,0 +1,91 @@
+/*
+ *                     proxy.h
+ *
+ * Definitions shared by the proxy's request handling code and its
+ * concurrency modes (thread-per-connection, the epoll reactor and the
+ * io_uring rings).
+ * Client connections are persistent where the client asks for it: the
+ * hop-by-hop headers of each response are replaced by the proxy's own
+ * Connection header, which says whether the connection stays open.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+#include "log.h"
+#include "request.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* How a client connection may be reused after a response */
+#define CLIENT_CLOSE     0  /* Close it once the response is sent */
+#define CLIENT_KEEPALIVE 1  /* HTTP/1.0 client that asked to keep it open */
+#define CLIENT_HTTP11    2  /* HTTP/1.1 client, which also takes chunked */
+
+#define CONN_HDR_ROOM       32  /* Room for the Connection header we add */
+#define CLIENT_IDLE_TIMEOUT 5   /* Seconds a thread waits for a next request */
+#define CONNECT_TIMEOUT     5   /* Seconds a connect to an origin address takes */
+#define HEADER_TIMEOUT      15  /* ... a request or response header takes */
+#define BODY_TIMEOUT        30  /* ... a response may go without progress */
+
+/*
+ * Pieces of a forwarded request at most: 3 for the request line, 2 for
+ * each forwarded header line, 3 for a Host header made from the URI, 3
+ * each for If-None-Match and If-Modified-Since, 1 for User-Agent, 2 for
+ * Connection and Proxy-Connection, and 1 for the final CRLF
+ */
+#define REQ_IOV_MAX  (2 * REQ_MAX_HEADERS + 16)
+
+struct http_framer;
+struct cache_block;
+
+/* Request parsing and rewriting */
+int build_request(struct iovec *iov, http_request *hr,
+                  struct cache_block *stale);
+int forward_to_server(int connfd, http_request *hr, char *host,
+                      struct cache_block *stale);
+int iov_consume(struct iovec **iovp, int *niov, size_t n);
+void log_request(struct iovec *iov, int niov, char *host);
+
+/* Connection management headers */
+int request_keepalive(http_request *hr);
+int request_credentials(http_request *hr);
+int response_keepalive(struct http_framer *fr, int client);
+int strip_hop_headers(char *buf, int hdr_len, int len);
+int drop_header(char *buf, int hdr_len, int len, char *name);
+int add_conn_header(char *buf, int hdr_len, int len, int client);
+int client_head(char *head, char *hdr, int hdr_len, int *client);
+int header_is(char *line, char *name, char **valuep);
+int header_has_token(char *value, char *token);
+
+/* Locally generated error responses, and the access log */
+int build_clienterror(char *resp, char *cause, char *errnum,
+                      char *shortmsg, char *longmsg);
+void clienterror(int fd, char *cause, char *errnum,
+                 char *shortmsg, char *longmsg);
+void log_access(char *reqline, char *how, int status);
+
+/*
+ * hash_origin - FNV-1a over host, then port, keying the tables of
+ *     origins in dns.c, upstream.c and admit.c
+ */
+static inline unsigned int hash_origin(char *host, char *port)
+{
+    unsigned int h = 2166136261u;
+
+    for (; *host; host++)
+        h = (h ^ (unsigned char)*host) * 16777619u;
+    h = (h ^ ':') * 16777619u;
+    for (; *port; port++)
+        h = (h ^ (unsigned char)*port) * 16777619u;
+    return h;
+}
+
+#endif /* __PROXY_H__ */
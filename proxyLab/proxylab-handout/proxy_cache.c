@@ -1,291 +1,1365 @@
 /*
- *                     proxy.c
+ *                     proxy_cache.c
  *
- * This is a proxy program that acts as an intermediary between clients 
- * and servers.
- * Clients make requests to access resources of servers.
- * 
- *                  Author: Xin Wang 
+ * Sharded web object cache. A block lives in exactly one shard, chosen
+ * by the hash of its tag, where it is linked both into a hash bucket
+ * (for O(1) lookup) and into the shard's eviction order, kept by the
+ * policy chosen at startup. Every shard is protected by its own mutex.
+ * With the admission filter on, a new object that would only displace
+ * more popular ones is not cached at all.
+ *
+ * search_cache hands out a reference to the block instead of copying
+ * it, so a hit is served without holding any lock. A block that is
+ * evicted while readers still hold it is only freed by the last
+ * release_cache_block.
+ *
+ * Lookups of fresh blocks take no lock either. Bucket chains are only
+ * changed under the shard lock, and every link is published with a
+ * release store, so a chain can be walked inside an epoch while it
+ * changes. An unlinked block keeps its hnext, and the cache's reference
+ * to it is only dropped through epoch_retire, so a lookup that found it
+ * can still take a reference of its own. Reference counts are atomic.
+ * Recency is best effort: an lru hit that would wait for the shard lock
+ * is not recorded.
+ *
+ * A block is built in a slot reserved from its shard's slab, evicting
+ * until the slot fits, and is only then linked in. Blocks are freed by
+ * their last reference, which may be dropped under another shard's lock
+ * (an epoch callback) or under none, so every slab has a lock of its own
+ * that is always taken last.
+ *
+ * Responses are normally cached through a cache_fill, which tees the
+ * relayed bytes into a buffer and publishes it in one step once the
+ * origin is done, so a partial object is never found by search_cache.
+ * Misses that arrive while a fill for the same tag is in flight join it
+ * (single flight) rather than fetching the object again. Lock order is
+ * shard lock, then fill lock.
+ *
+ * With the disk tier on, blocks that are evicted while still fresh are
+ * spilled to it, and a miss looks there before going to the origin. A
+ * block read back from disk is published like any other; one that is
+ * not admitted is served from a block of its own outside the slabs.
+ *
+ * cache_save writes every cached block to a snapshot file, which
+ * cache_load maps at the next startup and publishes again. The snapshot
+ * is a snap_header followed by one snap_rec, tag and response per
+ * block, each padded to 8 bytes; the header carries the file's size and
+ * a checksum of the rest, so a torn or foreign file is refused whole.
+ *
+ * A stale block stays cached while it is revalidated through a fill of
+ * its own. If the origin answers with a 304, the fill publishes the old
+ * block, with a new expiry, instead of the 304; requests that joined the
+ * fill are then served the old block too.
+ *
+ *                  Author: Xin Wang
  *                  Andrew ID: xinw3
- * 
+ *
  */
-#include <stdio.h>
-#include "csapp.h"
+#include "proxy_cache.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* The block an evict_node is embedded in */
+#define block_of(n) ((cache_block *)((char *)(n) - offsetof(cache_block, ev)))
 
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *conn_hdr = "Connection: close\r\n";
-static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
+/* Largest slot a block can need: the struct, a tag and an object */
+#define MAX_SLOT (sizeof(cache_block) + MAXLINE + MAX_OBJECT_SIZE \
+                  + 2 * SLAB_ALIGN)
 
-struct cache
+#define SNAP_MAGIC   "PXCACHE"   /* With its NUL, the first 8 bytes */
+#define SNAP_VERSION 1
+
+/* Start of a snapshot file */
+typedef struct snap_header
 {
-    unsigned int cache_size;
-    cache_block *head;
-    cache_block *tail;
-};
-struct cache *ca;
+    char magic[8];
+    unsigned int version;
+    unsigned int count;           /* Blocks that follow */
+    unsigned long bytes;          /* Size of the file */
+    unsigned int checksum;        /* FNV-1a of every byte after this header */
+    unsigned int pad;
+} snap_header;
 
-struct cache_block
+/* A block in a snapshot; its tag and content follow */
+typedef struct snap_rec
 {
-    char *tag;
-    char *content;
-    unsigned int block_size;
-    struct cache_block *prev;
-    struct cache_block *next;
-};
+    unsigned int tag_len;         /* Bytes of the tag, NUL included */
+    unsigned int size;
+    unsigned int hdr_len;
+    int must_revalidate;
+    long expires;
+} snap_rec;
 
+/* What the header of a response says about caching it */
+typedef struct freshness
+{
+    int store;                    /* Neither no-store, private nor Vary */
+    int shared;                   /* public or s-maxage */
+    int must_revalidate;          /* Must not be served stale */
+    long lifetime;                /* Seconds fresh, -1 if not said */
+    long age;                     /* Age header */
+} freshness;
 
-void cache_init(cache *ca);
-void free_cache(cache *ca);
-void add_to_cache(cache_block *cb);
-void delete_cache_block(cache *ca, cache_block *cb);
-void search_cache(cache *ca, char *to_search);
+static unsigned int hash_tag(char *tag);
+static cache_shard *shard_of(cache *ca, unsigned int hash);
+static cache_block **bucket_find(cache_shard *sh, char *tag, unsigned int h);
+static cache_block *lookup(cache_shard *sh, char *tag, unsigned int h);
+static void note_hit(cache_shard *sh, cache_block *cb);
+static void delete_cache_block(cache_shard *sh, cache_block *cb);
+static void retire_cache_block(epoch_entry *e);
+static void put_cache_block(cache_block *cb);
+static void get_cache_block(cache_block *cb);
+static cache_block *reserve_block(cache *ca, char *tag, unsigned int h,
+                                  unsigned int size);
+static void init_block(cache_block *cb, cache_shard *sh, char *tag,
+                       unsigned int h, unsigned int size);
+static cache_block *promote_block(cache *ca, char *tag, unsigned int h);
+static cache_block *evict_blocks(cache_shard *sh, size_t need,
+                                 size_t *freed);
+static void spill_blocks(cache_block *victims);
+static void spill_block(cache_block *cb);
+static void *shard_alloc(cache_shard *sh, size_t n);
+static void publish_block(cache_block *cb);
+static int cache_object(cache *ca, char *tag, char *content,
+                        unsigned int size, unsigned int hdr_len,
+                        long expires, int must_revalidate);
+static int snap_write(FILE *fp, void *p, size_t n, snap_header *h);
+static unsigned int fnv_update(unsigned int h, const void *p, size_t n);
+static cache_fill *fill_new(cache *ca, char *tag, unsigned int h);
+static void fill_parse_header(cache_fill *f);
+static void fill_refresh(cache_fill *f);
+static void fill_abandon(cache_fill *f);
+static void fill_unregister(cache_fill *f);
+static void fill_notify(cache_fill *f);
+static void fill_put(cache_fill *f);
+static char *find_header_end(char *buf, unsigned int len);
+static void parse_freshness(char *hdr, unsigned int len, freshness *fr);
+static long fresh_until(freshness *fr);
+static long directive_value(char *value, char *name);
+static long http_date(char *s);
+static void header_value(char *hdr, unsigned int len, char *name,
+                         http_view *v);
 
-void *thread(void *args);
-void read_requesthdrs(rio_t *rp);
-int parse_uri(char *uri, char *filename, char *cgiargs);
-void parse_request(char *buf, char *host, char *port, char *pathname);
-void forward_to_server(int connfd, char *pathname, char *host);
+/*
+ * cache_init - set up an empty cache of capacity bytes split across
+ *     nshards shards, evicting with policy and, if admission is set,
+ *     admitting new objects through the TinyLFU filter
+ */
+void cache_init(cache *ca, size_t capacity, int nshards,
+                const evict_policy *policy, int admission)
+{
+    int i;
+    cache_shard *sh;
 
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
-         char *shortmsg, char *longmsg);
+    // Every shard must be able to hold the largest cacheable object.
+    if ((size_t)nshards > capacity / MAX_SLOT)
+        nshards = capacity / MAX_SLOT;
+    if (nshards < 1)
+        nshards = 1;
+    ca->nshards = nshards;
+    ca->shard_budget = (capacity / nshards) & ~(size_t)(SLAB_ALIGN - 1);
+    ca->region = Malloc(ca->shard_budget * nshards);
+    ca->shards = Calloc(nshards, sizeof(cache_shard));
+    for (i = 0; i < nshards; i++)
+    {
+        sh = &ca->shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        pthread_mutex_init(&sh->slab_lock, NULL);
+        evict_init(&sh->ev, policy, ca->shard_budget, admission);
+        sh->buckets = Calloc(CACHE_BUCKETS, sizeof(cache_block *));
+        slab_init(&sh->slab, ca->region + i * ca->shard_budget,
+                  ca->shard_budget);
+    }
+}
 
-/* $begin tinymain */
-int main(int argc, char **argv) 
+/*
+ * free_cache - drop every cached block and the shards themselves
+ */
+void free_cache(cache *ca)
 {
-    int listenfd, *connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
+    int i;
+    cache_shard *sh;
+    evict_node *n;
 
-    /* Check command line args */
-    if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+    for (i = 0; i < ca->nshards; i++)
+    {
+        sh = &ca->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        while ((n = evict_victim(&sh->ev)) != NULL)
+        {
+            delete_cache_block(sh, block_of(n));
+        }
+        pthread_mutex_unlock(&sh->lock);
+        pthread_mutex_destroy(&sh->lock);
+        evict_free(&sh->ev);
     }
+    epoch_barrier();
+    for (i = 0; i < ca->nshards; i++)
+    {
+        Free(ca->shards[i].buckets);
+        pthread_mutex_destroy(&ca->shards[i].slab_lock);
+    }
+    Free(ca->region);
+    Free(ca->shards);
+}
 
-    /* Cache list initiation */
-    //pthread_mutex_init(&mutex_lock, NULL);
-    ca = (cache *)malloc(sizeof(cache));
-    cache_init(cache);
+/*
+ * search_cache - look up tag; on a hit, tell the eviction policy and
+ *     return the block with a reference the caller must release
+ */
+cache_block *search_cache(cache *ca, char *tag)
+{
+    unsigned int h = hash_tag(tag);
+    cache_shard *sh = shard_of(ca, h);
+    cache_block *cb;
 
-    listenfd = Open_listenfd(argv[1]);
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        //line:netp:tiny:accept
-        connfd = Malloc(sizeof(connfd));
-        connfd[0] = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-            Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                        port, MAXLINE, 0);
-            printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, thread, (void *)connfd);
+    evict_record(&sh->ev, h);
+    epoch_enter();
+    if ((cb = lookup(sh, tag, h)) != NULL)
+    {
+        get_cache_block(cb);
+    }
+    epoch_exit();
+    if (cb)
+    {
+        note_hit(sh, cb);
     }
-    //pthread_mutex_destroy(&mutex_lock);
-    free_cache(cache);
+    return cb;
 }
-/* $end tinymain */
 
 /*
- * thread - handle one HTTP request/response transaction
+ * release_cache_block - drop a reference returned by search_cache
  */
-/* $begin thread */
-void *thread(void *args) 
+void release_cache_block(cache *ca, cache_block *cb)
 {
-    Pthread_detach(pthread_self());
-    int fd = *(int *)args;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    rio_t rio;
-    char pathname[MAXLINE], port[MAXLINE], host[MAXLINE];
-    int clientfd;
-    char *cache_content;
+    put_cache_block(cb);
+}
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return NULL;
-    // Parse request
-    sscanf(buf, "%s %s %s", method, uri, version);
-    // Begin request error
-    if (strcasecmp(method, "GET")) {
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Proxy does not implement this method");
-        return NULL;
+/*
+ * add_to_cache - cache a copy of content under tag, replacing any older
+ *     copy and evicting blocks of the shard to make room; returns -1 if
+ *     the object is too large to cache or was not admitted
+ */
+int add_to_cache(cache *ca, char *tag, char *content, unsigned int size)
+{
+    char *end;
+    unsigned int hdr_len;
+    freshness fr;
+
+    if (size > MAX_OBJECT_SIZE)
+        return -1;
+    end = find_header_end(content, size);
+    hdr_len = end ? end + 4 - content : 0;
+    parse_freshness(content, hdr_len, &fr);
+    if (!fr.store)
+        return -1;
+    return cache_object(ca, tag, content, size, hdr_len, fresh_until(&fr),
+                        fr.must_revalidate);
+}
+
+/*
+ * cache_save - write every cached block to a snapshot at path, through
+ *     a temporary file renamed over it once complete; returns the number
+ *     of blocks saved, or -1
+ */
+int cache_save(cache *ca, char *path)
+{
+    char tmp[MAXLINE], pad[8] = { 0 };
+    snap_header h;
+    snap_rec r;
+    cache_shard *sh;
+    cache_block *cb;
+    FILE *fp;
+    int i, b, rc = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+    {
+        log_warn("cache: cannot create %s: %s", tmp, strerror(errno));
+        return -1;
     }
-    // First find in cache.
-    search_cache(ca, uri);
-    // Parse request.
-    sprintf(port, "80");
-    parse_request(buf, host, port, pathname);
-    // Send request to server.
-    clientfd = Open_clientfd(host, port);
-    forward_to_server(clientfd, pathname, host);
-    // Read response.
-    Rio_readinitb(&rio, clientfd);
-    int size = 0;
-    while ((size = Rio_readlineb(&rio, buf, MAXLINE)) > 0)
-    {
-        Rio_writen(fd, buf, size);
-        printf("%s\n", buf);
-    }
-    Free(args);
-    Close(fd);
-    Close(clientfd);
-    return NULL;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, SNAP_MAGIC);
+    h.version = SNAP_VERSION;
+    h.bytes = sizeof(h);
+    h.checksum = 2166136261u;
+    fwrite(&h, sizeof(h), 1, fp);
+    for (i = 0; i < ca->nshards && rc == 0; i++)
+    {
+        sh = &ca->shards[i];
+        pthread_mutex_lock(&sh->lock);
+        for (b = 0; b < CACHE_BUCKETS && rc == 0; b++)
+        {
+            for (cb = sh->buckets[b]; cb && rc == 0; cb = cb->hnext)
+            {
+                r.tag_len = strlen(cb->tag) + 1;
+                r.size = cb->block_size;
+                r.hdr_len = cb->hdr_len;
+                r.must_revalidate = cb->must_revalidate;
+                r.expires = cb->expires;
+                rc = snap_write(fp, &r, sizeof(r), &h)
+                    | snap_write(fp, cb->tag, r.tag_len, &h)
+                    | snap_write(fp, cb->content, r.size, &h)
+                    | snap_write(fp, pad, -(r.tag_len + r.size) & 7, &h);
+                h.count++;
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    if (rc == 0 && (fseek(fp, 0, SEEK_SET) < 0
+                    || fwrite(&h, sizeof(h), 1, fp) != 1
+                    || fflush(fp) == EOF || fsync(fileno(fp)) < 0))
+        rc = -1;
+    if (fclose(fp) == EOF)
+        rc = -1;
+    if (rc == 0 && rename(tmp, path) < 0)
+        rc = -1;
+    if (rc < 0)
+    {
+        log_warn("cache: cannot write snapshot %s: %s", path,
+                 strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return h.count;
 }
-/* $end thread */
 
-void parse_request(char *buf, char *host, char *port, char *pathname)
+/*
+ * cache_load - publish the blocks of the snapshot at path, read through
+ *     mmap, and log how long it took; returns the number of blocks
+ *     restored, or -1 if there is no snapshot or it is not valid
+ */
+int cache_load(cache *ca, char *path)
 {
-    char *temp, *first, *next, *p;
-    printf("%s\n", buf);
-    // Get host name.
-    if ((temp = strstr(buf, "http://")) == NULL)
+    struct timeval start, end;
+    struct stat st;
+    snap_header *h;
+    snap_rec r;
+    char *map, *p, *tag, *limit;
+    int fd, n = 0, restored = 0;
+
+    gettimeofday(&start, NULL);
+    if ((fd = open(path, O_RDONLY)) < 0)
     {
-        return;
+        if (errno != ENOENT)
+            log_warn("cache: cannot open %s: %s", path, strerror(errno));
+        return -1;
     }
-    // Point to the host name.
-    first = temp + 7;
-    // Point to "/" after host name to get path name.
-    if ((temp = strstr(first, "/")) != NULL)
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snap_header)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+           == MAP_FAILED)
     {
-        next = temp;
+        log_warn("cache: cannot map snapshot %s", path);
+        close(fd);
+        return -1;
     }
-    // Point to the space after path name.
-    if ((temp = strstr(next, " ")) != NULL)
+    close(fd);
+    h = (snap_header *)map;
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC))
+        || h->version != SNAP_VERSION || h->bytes != (unsigned long)st.st_size
+        || h->checksum != fnv_update(2166136261u, map + sizeof(*h),
+                                     st.st_size - sizeof(*h)))
     {
-        p = temp;
+        log_warn("cache: %s is not a valid snapshot, starting cold", path);
+        munmap(map, st.st_size);
+        return -1;
     }
-    // Get pathname.
-    strncpy(pathname, next, p - next);
-    pathname[p - next] = '\0';
-    // Point to the ":" after host name if any.
-    if (((temp = strstr(first, ":")) != NULL) && (temp < next))  
+
+    limit = map + st.st_size;
+    for (p = map + sizeof(*h); n < (int)h->count; n++)
     {
-        // Get port.
-        strncpy(port, temp + 1, next - temp - 1);
-        port[next - temp - 1] = '\0';
-        next = temp;
+        // The checksum matched, so a bad record means a bad writer.
+        if (limit - p < (long)sizeof(r))
+        {
+            log_warn("cache: snapshot %s ends early", path);
+            break;
+        }
+        memcpy(&r, p, sizeof(r));
+        tag = p + sizeof(r);
+        if (limit - tag < (long)r.tag_len + r.size || r.tag_len == 0
+            || tag[r.tag_len - 1] != '\0' || r.size > MAX_OBJECT_SIZE
+            || r.hdr_len > r.size)
+        {
+            log_warn("cache: bad record %d in snapshot %s", n, path);
+            break;
+        }
+        if (cache_object(ca, tag, tag + r.tag_len, r.size, r.hdr_len,
+                         r.expires, r.must_revalidate) == 0)
+            restored++;
+        p = tag + ((r.tag_len + r.size + 7) & ~7u);
     }
-    // Get host name.
-    strncpy(host, first, next - first);
-    host[next - first] = '\0';
-    printf("%s\n", port);
-    printf("%s\n", host);
-    printf("%s\n", pathname);
+    munmap(map, st.st_size);
+    gettimeofday(&end, NULL);
+    log_info("cache: restored %d of %d objects from %s in %ld us", restored,
+             n, path, (end.tv_sec - start.tv_sec) * 1000000L
+             + end.tv_usec - start.tv_usec);
+    return restored;
 }
 
-void forward_to_server(int connfd, char *pathname, char *host)
+/*
+ * cache_object - cache a copy of content under tag with the given
+ *     freshness; returns -1 if it was not cached
+ */
+static int cache_object(cache *ca, char *tag, char *content,
+                        unsigned int size, unsigned int hdr_len,
+                        long expires, int must_revalidate)
 {
-    char req[MAXLINE];
-    // Forward request.
-    sprintf(req, "GET %s HTTP/1.0\r\n", pathname);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward hostname.
-    sprintf(req, "HOST: %s\r\n", host);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward User-Agent.
-    sprintf(req, user_agent_hdr);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward Connection.
-    sprintf(req, conn_hdr);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // Forward Proxy-Connection.
-    sprintf(req, proxy_conn_hdr);
-    Rio_writen(connfd, req, strlen(req));
-    printf("%s\n", req);
-    // End.
-    Rio_writen(connfd, "\r\n", 2);
+    cache_block *cb;
+
+    if ((cb = reserve_block(ca, tag, hash_tag(tag), size)) == NULL)
+        return -1;
+    memcpy(cb->content, content, size);
+    cb->hdr_len = hdr_len;
+    cb->expires = expires;
+    cb->must_revalidate = must_revalidate;
+    publish_block(cb);
+    put_cache_block(cb);
+    return 0;
 }
 
+/*
+ * snap_write - write n bytes to a snapshot, adding them to its size and
+ *     checksum; returns -1 if the write failed
+ */
+static int snap_write(FILE *fp, void *p, size_t n, snap_header *h)
+{
+    h->bytes += n;
+    h->checksum = fnv_update(h->checksum, p, n);
+    return (fwrite(p, 1, n, fp) == n) ? 0 : -1;
+}
 
 /*
- * clienterror - returns an error message to the client
+ * reserve_block - a new block for size bytes of content under tag, in a
+ *     slot of its shard, with a reference for the caller; it is not
+ *     cached until publish_block. Blocks are evicted to make room, but
+ *     only if the admission filter prefers the new block to the first of
+ *     them. Returns NULL if the block is not admitted, or if it does not
+ *     fit even then, because readers still hold what was evicted.
  */
-/* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
-         char *shortmsg, char *longmsg) 
+static cache_block *reserve_block(cache *ca, char *tag, unsigned int h,
+                                  unsigned int size)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    cache_shard *sh = shard_of(ca, h);
+    size_t need = sizeof(cache_block) + strlen(tag) + 1 + size, freed;
+    cache_block *cb, *victims;
+    int admitted;
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Proxy server</em>\r\n", body);
+    if (need > slab_max_alloc(&sh->slab))
+        return NULL;
+    if ((cb = shard_alloc(sh, need)) == NULL)
+    {
+        pthread_mutex_lock(&sh->lock);
+        admitted = evict_admit(&sh->ev, h, evict_victim(&sh->ev));
+        pthread_mutex_unlock(&sh->lock);
+        if (!admitted)
+            return NULL;
+    }
+    while (cb == NULL)
+    {
+        pthread_mutex_lock(&sh->lock);
+        victims = evict_blocks(sh, need, &freed);
+        pthread_mutex_unlock(&sh->lock);
+        spill_blocks(victims);
+        // The slots may only be waiting for lookups to finish; blocks
+        // retired elsewhere in the meantime are not waited for.
+        epoch_sync();
+        if ((cb = shard_alloc(sh, need)) == NULL && freed == 0)
+            return NULL;
+    }
+    init_block(cb, sh, tag, h, size);
+    return cb;
+}
 
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+/*
+ * evict_blocks - evict blocks of sh until their slots add up to need
+ *     bytes or there are none left, and set *freed to what they add up
+ *     to. Returns the evicted blocks, linked through spill_next, each
+ *     with a reference for spill_blocks. Call with sh->lock held.
+ */
+static cache_block *evict_blocks(cache_shard *sh, size_t need,
+                                 size_t *freed)
+{
+    cache_block *victims = NULL, *cb;
+    evict_node *n;
+
+    for (*freed = 0; *freed < need && (n = evict_victim(&sh->ev)) != NULL;)
+    {
+        cb = block_of(n);
+        get_cache_block(cb);
+        cb->spill_next = victims;
+        victims = cb;
+        *freed += slab_slot_size(cb);
+        delete_cache_block(sh, cb);
+    }
+    return victims;
 }
-/* $end clienterror */
 
-void cache_init(cache *ca)
+/*
+ * spill_blocks - spill the blocks from evict_blocks to the disk tier and
+ *     drop their references. Called without the shard lock, since a
+ *     spill writes to the log.
+ */
+static void spill_blocks(cache_block *victims)
 {
-    ca->cache_size = 0;
-    ca->head->next = ca->tail;
-    ca->tail->prev = ca->head;
+    cache_block *next;
+
+    for (; victims; victims = next)
+    {
+        next = victims->spill_next;
+        spill_block(victims);
+        put_cache_block(victims);
+    }
 }
-/* LRU cache policy */
-void add_to_cache(cache *ca, cache_block *cb)
+
+/*
+ * init_block - lay out a new block for tag and size bytes of content in
+ *     the memory at cb, from the slab of sh or, if sh is NULL, from
+ *     Malloc; the caller holds the only reference
+ */
+static void init_block(cache_block *cb, cache_shard *sh, char *tag,
+                       unsigned int h, unsigned int size)
 {
-    ca->cache_size = ca->cache_size + cb->block_size;
-    cb->prev = ca->head;
-    cb->next = ca->head->next;
-    ca->head->next->prev = cb;
-    ca->head->next = cb;
-
+    size_t taglen = strlen(tag);
+
+    memset(cb, 0, sizeof(cache_block));
+    cb->tag = (char *)(cb + 1);
+    memcpy(cb->tag, tag, taglen + 1);
+    cb->content = cb->tag + taglen + 1;
+    cb->block_size = size;
+    cb->hash = h;
+    cb->refcnt = 1;
+    cb->shard = sh;
+}
+
+/*
+ * promote_block - read the object for tag back from the disk tier into
+ *     a new block, cached in memory if it is admitted, and return it
+ *     with a reference; NULL if it is not on disk
+ */
+static cache_block *promote_block(cache *ca, char *tag, unsigned int h)
+{
+    disk_object obj;
+    cache_block *cb;
+
+    if (!disk_enabled || disk_lookup(tag, h, &obj) < 0)
+        return NULL;
+    if ((cb = reserve_block(ca, tag, h, obj.size)) == NULL)
+    {
+        cb = Malloc(sizeof(cache_block) + strlen(tag) + 1 + obj.size);
+        init_block(cb, NULL, tag, h, obj.size);
+    }
+    if (disk_read(&obj, cb->content) < 0)
+    {
+        put_cache_block(cb);
+        return NULL;
+    }
+    cb->hdr_len = obj.hdr_len;
+    cb->expires = obj.expires;
+    cb->must_revalidate = obj.must_revalidate;
+    if (cb->shard)
+    {
+        publish_block(cb);
+        disk_forget(tag, h);
+    }
+    return cb;
+}
+
+/*
+ * spill_block - hand a block that is being evicted to the disk tier, if
+ *     it is on and the block is still fresh
+ */
+static void spill_block(cache_block *cb)
+{
+    if (disk_enabled && cb->expires > time(NULL))
+        disk_put(cb->tag, cb->hash, cb->content, cb->block_size, cb->hdr_len,
+                 cb->expires, cb->must_revalidate);
+}
+
+/*
+ * shard_alloc - n bytes from the shard's slab, or NULL if it is full
+ */
+static void *shard_alloc(cache_shard *sh, size_t n)
+{
+    void *p;
+
+    pthread_mutex_lock(&sh->slab_lock);
+    p = slab_alloc(&sh->slab, n);
+    pthread_mutex_unlock(&sh->slab_lock);
+    return p;
 }
-void search_cache(cache *ca, char *to_search)
+
+/*
+ * publish_block - cache a block from reserve_block, whose content and
+ *     freshness are filled in, in place of any older block for its tag;
+ *     the cache takes a reference of its own
+ */
+static void publish_block(cache_block *cb)
 {
+    cache_shard *sh = cb->shard;
+    cache_block *old;
+
+    pthread_mutex_lock(&sh->lock);
+    if ((old = *bucket_find(sh, cb->tag, cb->hash)) != NULL)
+    {
+        delete_cache_block(sh, old);
+    }
+    get_cache_block(cb);
+    cb->hnext = sh->buckets[cb->hash % CACHE_BUCKETS];
+    __atomic_store_n(&sh->buckets[cb->hash % CACHE_BUCKETS], cb,
+                     __ATOMIC_RELEASE);
+    evict_insert(&sh->ev, &cb->ev, cb->hash, slab_slot_size(cb));
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * cache_acquire - look up tag. On a hit on a fresh block the block is
+ *     returned with a reference; otherwise the caller either joins the
+ *     fill already fetching the object or becomes the leader of a new
+ *     one, which for a stale block revalidates it (CACHE_STALE, with a
+ *     reference to the stale block).
+ */
+int cache_acquire(cache *ca, char *tag, cache_block **cbp, cache_fill **fillp)
+{
+    unsigned int h = hash_tag(tag);
+    cache_shard *sh = shard_of(ca, h);
     cache_block *cb;
-    for (cb = ca->head->next; cb != ca->tail; cb = cb->next)
+    cache_fill *f;
+    long now = time(NULL);
+
+    evict_record(&sh->ev, h);
+    epoch_enter();
+    if ((cb = lookup(sh, tag, h)) != NULL
+        && __atomic_load_n(&cb->expires, __ATOMIC_RELAXED) > now)
+    {
+        get_cache_block(cb);
+        epoch_exit();
+        note_hit(sh, cb);
+        *cbp = cb;
+        return CACHE_HIT;
+    }
+    epoch_exit();
+    // Not even a stale copy in memory: try the disk tier.
+    if (cb == NULL && (cb = promote_block(ca, tag, h)) != NULL)
+    {
+        *cbp = cb;
+        return CACHE_HIT;
+    }
+
+    // Misses and stale blocks: look again, now that nothing can change.
+    pthread_mutex_lock(&sh->lock);
+    if ((cb = *bucket_find(sh, tag, h)) != NULL && cb->expires > now)
+    {
+        evict_hit(&sh->ev, &cb->ev);
+        get_cache_block(cb);
+        pthread_mutex_unlock(&sh->lock);
+        *cbp = cb;
+        return CACHE_HIT;
+    }
+    for (f = sh->fills; f; f = f->next)
     {
-        if (!strcmp(cb->tag, to_search))
+        if (f->hash == h && !strcmp(f->tag, tag))
         {
-            add_to_cache(ca, cb);
+            pthread_mutex_lock(&f->lock);
+            f->refcnt++;
+            pthread_mutex_unlock(&f->lock);
+            pthread_mutex_unlock(&sh->lock);
+            *fillp = f;
+            return CACHE_JOIN;
         }
     }
+    f = fill_new(ca, tag, h);
+    f->next = sh->fills;
+    sh->fills = f;
+    if (cb)
+    {
+        get_cache_block(cb);
+        f->stale = cb;
+        *cbp = cb;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    *fillp = f;
+    return cb ? CACHE_STALE : CACHE_MISS;
 }
-void delete_cache_block(cache *ca, cache_block *cb)
+
+/*
+ * cache_validators - point etag and last_modified at the values of the
+ *     ETag and Last-Modified headers of the block (length 0 if missing),
+ *     for a request that revalidates it
+ */
+void cache_validators(cache_block *cb, http_view *etag,
+                      http_view *last_modified)
 {
-    cache_block *cb_prev;
-    cb->next->prev = cb->prev;
-    cb->prev->next = cb->next;
-    ca->cache_size = ca->cache_size - cb->block_size;
-    cb_prev->cb->prev;
-    cb->prev = NULL;
-    cb->next = NULL;
-    Free(cb->tag);
-    Free(cb->content);
-    Free(cb);
+    header_value(cb->content, cb->hdr_len, "ETag", etag);
+    header_value(cb->content, cb->hdr_len, "Last-Modified", last_modified);
 }
-void free_cache(cache *ca)
+
+/*
+ * cache_serve_stale - whether the stale block may still be served when
+ *     it cannot be revalidated because the origin is unreachable
+ */
+int cache_serve_stale(cache_block *cb)
+{
+    return !cb->must_revalidate;
+}
+
+/*
+ * cache_fill_append - tee n more response bytes into the fill, giving
+ *     up on the copy once the object can no longer be cached
+ */
+void cache_fill_append(cache_fill *f, char *data, size_t n)
+{
+    // Only the leader changes state, buf and cap, so it reads them freely.
+    if (f->state != FILL_ACTIVE || n == 0)
+        return;
+    if (f->len + n > (f->streamable ? f->cap : MAX_OBJECT_SIZE)) {
+        fill_abandon(f);
+        return;
+    }
+    if (f->len + n > f->cap) {
+        // Not streamable yet, so no reader is looking at buf.
+        while (f->len + n > f->cap)
+            f->cap *= 2;
+        if (f->cap > MAX_OBJECT_SIZE)
+            f->cap = MAX_OBJECT_SIZE;
+        f->buf = Realloc(f->buf, f->cap);
+    }
+    memcpy(f->buf + f->len, data, n);
+    pthread_mutex_lock(&f->lock);
+    f->len += n;
+    pthread_mutex_unlock(&f->lock);
+    if (f->hdr_len == 0)
+        fill_parse_header(f);
+    fill_notify(f);
+}
+
+/*
+ * cache_fill_end - the origin is done: publish a complete copy into the
+ *     cache and let go of the fill; returns -1 if nothing was cached
+ */
+int cache_fill_end(cache_fill *f)
 {
     cache_block *cb;
-    for(cb = ca->tail->prev; cb != ca->head)
+    int rc = -1;
+
+    if (f->state == FILL_ACTIVE && f->not_modified) {
+        fill_refresh(f);
+        rc = 0;
+    } else if (f->state == FILL_ACTIVE && f->hdr_len > 0
+        && (f->body_len < 0 || f->len == f->hdr_len + f->body_len)) {
+        // Without a Content-length the slot could only be reserved now.
+        if (!f->block
+            && (cb = reserve_block(f->ca, f->tag, f->hash, f->len)) != NULL) {
+            memcpy(cb->content, f->buf, f->len);
+            Free(f->buf);
+            pthread_mutex_lock(&f->lock);
+            f->block = cb;
+            f->buf = cb->content;
+            f->cap = f->len;
+            pthread_mutex_unlock(&f->lock);
+        }
+        if (f->block) {
+            f->block->hdr_len = f->hdr_len;
+            f->block->expires = f->expires;
+            f->block->must_revalidate = f->must_revalidate;
+            publish_block(f->block);
+            rc = 0;
+        }
+        // Readers are served the bytes even if they were not cached.
+        pthread_mutex_lock(&f->lock);
+        f->state = FILL_DONE;
+        pthread_mutex_unlock(&f->lock);
+    } else if (f->state == FILL_ACTIVE) {
+        pthread_mutex_lock(&f->lock);
+        f->state = FILL_ABANDONED;
+        pthread_mutex_unlock(&f->lock);
+    }
+    // New requests find the block before the fill is gone.
+    fill_unregister(f);
+    fill_notify(f);
+    fill_put(f);
+    return rc;
+}
+
+/*
+ * cache_fill_abort - the leader gives up on the response
+ */
+void cache_fill_abort(cache_fill *f)
+{
+    if (f->state == FILL_ACTIVE)
+        fill_abandon(f);
+    fill_put(f);
+}
+
+/*
+ * cache_fill_active - whether the leader's bytes are still wanted, that
+ *     is the fill has not been found uncacheable. Only the leader
+ *     changes the state of an active fill, so it can ask without locking.
+ */
+int cache_fill_active(cache_fill *f)
+{
+    return f->state == FILL_ACTIVE;
+}
+
+/*
+ * cache_fill_read - make the bytes of the fill from off on available to
+ *     a reader. Returns how many can be read at *datap, 0 once the whole
+ *     object has been read, or FILL_FAILED if it will never be cached.
+ *     Blocks until one of these holds, unless a waiter is given, in
+ *     which case it returns FILL_AGAIN and w->wake is called later.
+ */
+int cache_fill_read(cache_fill *f, unsigned int off, char **datap,
+                    fill_waiter *w)
+{
+    fill_waiter *p;
+    int rc;
+
+    pthread_mutex_lock(&f->lock);
+    while (1) {
+        if (f->state == FILL_ABANDONED) {
+            rc = FILL_FAILED;
+            break;
+        }
+        if ((f->state == FILL_DONE || f->streamable) && off < f->len) {
+            *datap = f->buf + off;
+            rc = f->len - off;
+            break;
+        }
+        if (f->state == FILL_DONE) {
+            rc = 0;
+            break;
+        }
+        if (w) {
+            for (p = f->waiters; p && p != w; p = p->next)
+                ;
+            if (p == NULL) {
+                w->next = f->waiters;
+                f->waiters = w;
+            }
+            rc = FILL_AGAIN;
+            break;
+        }
+        pthread_cond_wait(&f->changed, &f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+/*
+ * cache_fill_leave - a reader is done with the fill
+ */
+void cache_fill_leave(cache_fill *f, fill_waiter *w)
+{
+    fill_waiter **pp;
+
+    if (w) {
+        pthread_mutex_lock(&f->lock);
+        for (pp = &f->waiters; *pp; pp = &(*pp)->next) {
+            if (*pp == w) {
+                *pp = w->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    fill_put(f);
+}
+
+/*
+ * fill_new - a fill for tag, owned by the leader
+ */
+static cache_fill *fill_new(cache *ca, char *tag, unsigned int h)
+{
+    cache_fill *f = Calloc(1, sizeof(cache_fill));
+    size_t taglen = strlen(tag);
+
+    f->tag = Malloc(taglen + 1);
+    memcpy(f->tag, tag, taglen + 1);
+    f->hash = h;
+    f->ca = ca;
+    f->cap = MAXBUF;
+    f->buf = Malloc(f->cap);
+    f->body_len = -1;
+    f->state = FILL_ACTIVE;
+    f->refcnt = 1;
+    f->registered = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->changed, NULL);
+    return f;
+}
+
+/*
+ * fill_abandon - give up on caching the response and tell the readers
+ */
+static void fill_abandon(cache_fill *f)
+{
+    pthread_mutex_lock(&f->lock);
+    f->state = FILL_ABANDONED;
+    pthread_mutex_unlock(&f->lock);
+    fill_unregister(f);
+    fill_notify(f);
+}
+
+/*
+ * fill_unregister - stop new misses from joining the fill
+ */
+static void fill_unregister(cache_fill *f)
+{
+    cache_shard *sh = shard_of(f->ca, f->hash);
+    cache_fill **pp;
+
+    pthread_mutex_lock(&sh->lock);
+    if (f->registered)
+    {
+        for (pp = &sh->fills; *pp != f; pp = &(*pp)->next)
+            ;
+        *pp = f->next;
+        f->registered = 0;
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * fill_notify - wake every reader of the fill
+ */
+static void fill_notify(cache_fill *f)
+{
+    fill_waiter *w;
+
+    pthread_mutex_lock(&f->lock);
+    pthread_cond_broadcast(&f->changed);
+    for (w = f->waiters; w; w = w->next)
+        w->wake(w->arg);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * fill_put - drop one reference, freeing the fill with the last
+ */
+static void fill_put(cache_fill *f)
+{
+    int last;
+
+    pthread_mutex_lock(&f->lock);
+    last = (--f->refcnt == 0);
+    pthread_mutex_unlock(&f->lock);
+    if (!last)
+        return;
+    if (f->block)
+        release_cache_block(f->ca, f->block); /* The block holds buf */
+    else
+        Free(f->buf);
+    Free(f->tag);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->changed);
+    Free(f);
+}
+
+/*
+ * fill_parse_header - once the header block is in, only keep copying a
+ *     200 response that may be stored and whose declared length fits in
+ *     MAX_OBJECT_SIZE, or the 304 that answers a revalidation. With a
+ *     Content-length, buf becomes the content of a reserved block (or,
+ *     if none can be had, an exact-size buffer) and readers may stream it.
+ */
+static void fill_parse_header(cache_fill *f)
+{
+    cache_block *cb;
+    char *end, *p;
+    freshness fr;
+
+    if ((end = find_header_end(f->buf, f->len)) == NULL) {
+        // A header block that does not fit in MAXBUF is not cached.
+        if (f->len > MAXBUF)
+            fill_abandon(f);
+        return;
+    }
+    f->hdr_len = end + 4 - f->buf;
+    if (f->len >= 12 && f->stale && !strncmp(f->buf, "HTTP/1.", 7)
+        && !strncmp(f->buf + 8, " 304", 4)) {
+        // Readers wait for fill_refresh to hand them the stale block.
+        f->not_modified = 1;
+        return;
+    }
+    parse_freshness(f->buf, f->hdr_len, &fr);
+    // The cache serves every client, so the answer to a request with a
+    // cookie is never stored, nor one to a request with credentials
+    // unless the origin says it may be shared.
+    if (f->credentials & FILL_COOKIE
+        || (f->credentials & FILL_AUTH && !fr.shared))
+        fr.store = 0;
+    if (f->len < 12 || strncmp(f->buf, "HTTP/1.", 7)
+        || strncmp(f->buf + 8, " 200", 4) || !fr.store) {
+        fill_abandon(f);
+        return;
+    }
+    f->expires = fresh_until(&fr);
+    f->must_revalidate = fr.must_revalidate;
+    for (p = f->buf; p < end; p++) {
+        if (!strncasecmp(p, "Content-length:", 15)) {
+            f->body_len = strtol(p + 15, NULL, 10);
+            break;
+        }
+        if ((p = memchr(p, '\n', end + 2 - p)) == NULL)
+            break;
+    }
+    if (f->body_len < 0)
+        return;
+    if (f->hdr_len + f->body_len > MAX_OBJECT_SIZE
+        || f->len > f->hdr_len + f->body_len) {
+        fill_abandon(f);
+        return;
+    }
+    f->cap = f->hdr_len + f->body_len;
+    if ((cb = reserve_block(f->ca, f->tag, f->hash, f->cap)) != NULL) {
+        memcpy(cb->content, f->buf, f->len);
+        Free(f->buf);
+        f->block = cb;
+        f->buf = cb->content;
+    } else
+        f->buf = Realloc(f->buf, f->cap);
+    pthread_mutex_lock(&f->lock);
+    f->streamable = 1;
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * fill_refresh - the origin answered the revalidation of the stale
+ *     block with a 304: give the block a new expiry and publish it as
+ *     the fill's object in place of the 304. A 304 that does not say how
+ *     long the block stays fresh leaves its lifetime as it was.
+ */
+static void fill_refresh(cache_fill *f)
+{
+    cache_block *cb = f->stale;
+    cache_shard *sh = shard_of(f->ca, cb->hash);
+    freshness fr, old;
+
+    parse_freshness(f->buf, f->hdr_len, &fr);
+    if (fr.lifetime < 0) {
+        parse_freshness(cb->content, cb->hdr_len, &old);
+        fr.lifetime = old.lifetime;
+    }
+    pthread_mutex_lock(&sh->lock);
+    __atomic_store_n(&cb->expires, fresh_until(&fr), __ATOMIC_RELAXED);
+    cb->must_revalidate |= fr.must_revalidate;
+    get_cache_block(cb);
+    pthread_mutex_unlock(&sh->lock);
+
+    // The block keeps its content; the fill's buf held only the 304.
+    Free(f->buf);
+    pthread_mutex_lock(&f->lock);
+    f->block = cb;
+    f->buf = cb->content;
+    f->len = f->cap = cb->block_size;
+    f->hdr_len = cb->hdr_len;
+    f->state = FILL_DONE;
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * delete_cache_block - unlink cb from its shard and drop the cache's
+ *     reference once no lookup can still find it; the shard lock must
+ *     be held
+ */
+static void delete_cache_block(cache_shard *sh, cache_block *cb)
+{
+    cache_block **pp;
+
+    pp = bucket_find(sh, cb->tag, cb->hash);
+    // cb->hnext stays as it is for lookups still walking through cb.
+    __atomic_store_n(pp, cb->hnext, __ATOMIC_RELEASE);
+    evict_remove(&sh->ev, &cb->ev);
+    epoch_retire(&cb->retired, retire_cache_block);
+}
+
+/*
+ * retire_cache_block - every lookup that could have found the unlinked
+ *     block is over: drop the cache's reference
+ */
+static void retire_cache_block(epoch_entry *e)
+{
+    put_cache_block((cache_block *)((char *)e
+                                    - offsetof(cache_block, retired)));
+}
+
+/*
+ * get_cache_block - take a reference to a block that is cached, or that
+ *     the caller already holds
+ */
+static void get_cache_block(cache_block *cb)
+{
+    __atomic_add_fetch(&cb->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * put_cache_block - drop one reference, giving the block's slot back to
+ *     its shard (or its memory back to the heap) with the last
+ */
+static void put_cache_block(cache_block *cb)
+{
+    cache_shard *sh = cb->shard;
+
+    if (__atomic_sub_fetch(&cb->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    if (sh == NULL)
     {
-        delete_cache_block(ca, cb);
+        Free(cb);                 /* Served from disk, never cached */
+        return;
+    }
+    pthread_mutex_lock(&sh->slab_lock);
+    slab_free(&sh->slab, cb);
+    pthread_mutex_unlock(&sh->slab_lock);
+}
+
+/*
+ * bucket_find - return the link that points at the block for tag, or
+ *     at the NULL ending its bucket if there is none
+ */
+static cache_block **bucket_find(cache_shard *sh, char *tag, unsigned int h)
+{
+    cache_block **pp = &sh->buckets[h % CACHE_BUCKETS];
+
+    while (*pp && ((*pp)->hash != h || strcmp((*pp)->tag, tag)))
+    {
+        pp = &(*pp)->hnext;
+    }
+    return pp;
+}
+
+/*
+ * lookup - the block for tag, found without the shard lock; the caller
+ *     is inside an epoch, or holds the lock
+ */
+static cache_block *lookup(cache_shard *sh, char *tag, unsigned int h)
+{
+    cache_block *cb;
+
+    cb = __atomic_load_n(&sh->buckets[h % CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+    while (cb && (cb->hash != h || strcmp(cb->tag, tag)))
+    {
+        cb = __atomic_load_n(&cb->hnext, __ATOMIC_ACQUIRE);
+    }
+    return cb;
+}
+
+/*
+ * note_hit - tell the eviction policy about a hit found without the
+ *     shard lock. A policy whose hits move blocks around (lru) only hears
+ *     of it if the lock is free right now.
+ */
+static void note_hit(cache_shard *sh, cache_block *cb)
+{
+    if (!sh->ev.policy->locked_hit)
+    {
+        evict_hit(&sh->ev, &cb->ev);
+    }
+    else if (pthread_mutex_trylock(&sh->lock) == 0)
+    {
+        evict_hit(&sh->ev, &cb->ev);
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+/*
+ * find_header_end - locate the blank line ending a header block in the
+ *     first len bytes of buf
+ */
+static char *find_header_end(char *buf, unsigned int len)
+{
+    char *p = buf, *last;
+
+    if (len < 4)
+        return NULL;
+    last = buf + len - 4;
+    while (p <= last && (p = memchr(p, '\r', last + 1 - p)) != NULL)
+    {
+        if (!memcmp(p, "\r\n\r\n", 4))
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+/*
+ * parse_freshness - read what the header block hdr, of len bytes, says
+ *     about storing the response and for how long it is fresh: s-maxage,
+ *     max-age, Expires less Date, or a tenth of the time since
+ *     Last-Modified (at most CACHE_HEURISTIC_MAX), in that order. A
+ *     no-cache response is stored but revalidated on every use. A
+ *     response with Vary is not stored, since the cache is keyed by
+ *     URI alone and cannot tell the variants apart, nor a chunked one,
+ *     which clients older than HTTP/1.1 could not be sent.
+ */
+static void parse_freshness(char *hdr, unsigned int len, freshness *fr)
+{
+    char *line, *end = hdr + len, *value;
+    long date = -1, expires = -1, last_modified = -1;
+    long max_age = -1, s_maxage = -1;
+    int no_cache = 0, has_expires = 0;
+
+    fr->store = 1;
+    fr->shared = 0;
+    fr->must_revalidate = 0;
+    fr->lifetime = -1;
+    fr->age = 0;
+    // The status line is skipped; every header line ends in a newline.
+    for (line = memchr(hdr, '\n', len); line && ++line < end;
+         line = memchr(line, '\n', end - line)) {
+        if (header_is(line, "Cache-Control", &value)) {
+            if (header_has_token(value, "no-store")
+                || header_has_token(value, "private"))
+                fr->store = 0;
+            if (header_has_token(value, "no-cache"))
+                no_cache = 1;
+            if (header_has_token(value, "public"))
+                fr->shared = 1;
+            if (header_has_token(value, "must-revalidate")
+                || header_has_token(value, "proxy-revalidate"))
+                fr->must_revalidate = 1;
+            if (max_age < 0)
+                max_age = directive_value(value, "max-age");
+            if (s_maxage < 0)
+                s_maxage = directive_value(value, "s-maxage");
+        } else if (header_is(line, "Expires", &value)) {
+            has_expires = 1;
+            expires = http_date(value);
+        } else if (header_is(line, "Date", &value))
+            date = http_date(value);
+        else if (header_is(line, "Last-Modified", &value))
+            last_modified = http_date(value);
+        else if (header_is(line, "Age", &value))
+            fr->age = strtol(value, NULL, 10);
+        else if (header_is(line, "Vary", &value)
+                 || header_is(line, "Transfer-Encoding", &value))
+            fr->store = 0;
+    }
+    if (s_maxage >= 0)
+        fr->shared = 1;
+    if (date < 0)
+        date = time(NULL);
+    if (no_cache) {
+        fr->lifetime = 0;
+        fr->must_revalidate = 1;
+    } else if (s_maxage >= 0)
+        fr->lifetime = s_maxage;
+    else if (max_age >= 0)
+        fr->lifetime = max_age;
+    else if (has_expires)
+        // An Expires that is not a valid date means already expired.
+        fr->lifetime = (expires > date) ? expires - date : 0;
+    else if (last_modified >= 0 && last_modified <= date) {
+        fr->lifetime = (date - last_modified) / 10;
+        if (fr->lifetime > CACHE_HEURISTIC_MAX)
+            fr->lifetime = CACHE_HEURISTIC_MAX;
+    }
+    if (fr->age < 0)
+        fr->age = 0;
+}
+
+/*
+ * fresh_until - the wall clock second a response with freshness fr,
+ *     received now, goes stale
+ */
+static long fresh_until(freshness *fr)
+{
+    long lifetime = (fr->lifetime < 0) ? CACHE_DEFAULT_TTL : fr->lifetime;
+
+    return time(NULL) + lifetime - fr->age;
+}
+
+/*
+ * directive_value - the number given to directive name (name=N or
+ *     name="N") in a Cache-Control value, or -1 if it is not there
+ */
+static long directive_value(char *value, char *name)
+{
+    size_t len = strlen(name);
+    char *p;
+
+    for (p = value; *p && *p != '\r' && *p != '\n'; p++) {
+        if ((p == value || p[-1] == ',' || p[-1] == ' ')
+            && !strncasecmp(p, name, len) && p[len] == '=')
+            return strtol(p + len + 1 + (p[len + 1] == '"'), NULL, 10);
+    }
+    return -1;
+}
+
+/*
+ * http_date - seconds since the epoch of an HTTP date such as
+ *     "Sun, 06 Nov 1994 08:49:37 GMT", or -1 if it is not one
+ */
+static long http_date(char *s)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4], *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, "%*3s, %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6
+        || strlen(mon) != 3 || (m = strstr(months, mon)) == NULL
+        || (m - months) % 3)
+        return -1;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/*
+ * header_value - point v at the value of header name in the header
+ *     block hdr of len bytes, up to its line end; v->len is 0 if the
+ *     header is not there
+ */
+static void header_value(char *hdr, unsigned int len, char *name,
+                         http_view *v)
+{
+    char *line, *end = hdr + len, *value;
+
+    v->p = hdr;
+    v->len = 0;
+    for (line = memchr(hdr, '\n', len); line && ++line < end;
+         line = memchr(line, '\n', end - line)) {
+        if (header_is(line, name, &value)) {
+            v->p = value;
+            v->len = strcspn(value, "\r\n");
+            return;
+        }
+    }
+}
+
+/*
+ * hash_tag - 32-bit FNV-1a hash of the tag
+ */
+static unsigned int hash_tag(char *tag)
+{
+    unsigned int h = 2166136261u;
+
+    while (*tag)
+    {
+        h ^= (unsigned char)*tag++;
+        h *= 16777619u;
     }
-    Free(ca->head);
-    Free(ca->tail);
-    Free(ca);
+    return h;
+}
 
+/*
+ * fnv_update - continue an FNV-1a hash h over n more bytes
+ */
+static unsigned int fnv_update(unsigned int h, const void *p, size_t n)
+{
+    const unsigned char *c = p;
+
+    while (n--)
+    {
+        h ^= *c++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * shard_of - the shard responsible for a hash. The bucket index uses
+ *     the low bits, so shards are picked with the high ones.
+ */
+static cache_shard *shard_of(cache *ca, unsigned int hash)
+{
+    return &ca->shards[(hash >> 16) % ca->nshards];
 }
@@ -0,0 +1,180 @@
+/*
+ *                     proxy_cache.h
+ *
+ * In-memory web object cache for the proxy. Objects are keyed by the
+ * request URI and indexed by a hash table; the key space is split into
+ * independently locked shards, each with an equal share of the byte
+ * budget and its own eviction order (see evict.h). The shard count is
+ * capped so that every shard can still hold an object of MAX_OBJECT_SIZE.
+ *
+ * The whole capacity is allocated once, by cache_init, and each shard
+ * carves its objects out of its part of it (see slab.h): a block is one
+ * slot holding the cache_block, its tag and the response. The budget is
+ * the slot bytes, so the cache never holds more memory than it was given,
+ * and evicting a block hands its whole slot back at once.
+ *
+ * With "-w file" the cache survives a restart: it is saved to a snapshot
+ * on SIGTERM, and at startup the snapshot is mapped and every object in
+ * it is copied into a slot of its shard, after which the file is unmapped.
+ *
+ * The shard locks are for writers. A hit on a fresh object takes none:
+ * the hash index is read inside an epoch (see epoch.h), and a block that
+ * is evicted or replaced is only let go of by the cache once every
+ * reader that might have found it is done looking.
+ *
+ * Every object carries an expiry worked out from its Cache-Control,
+ * Expires, Date and Last-Modified headers. A hit on an object past its
+ * expiry is a miss that revalidates it: the request goes upstream with
+ * the object's validators, and a 304 refreshes the cached copy instead
+ * of transferring it again.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __PROXY_CACHE_H__
+#define __PROXY_CACHE_H__
+
+#include "proxy.h"
+#include "evict.h"
+#include "epoch.h"
+#include "slab.h"
+#include "disk.h"
+
+#define CACHE_SHARDS        8      /* Default number of shards */
+#define CACHE_BUCKETS       1024   /* Hash buckets per shard */
+#define CACHE_DEFAULT_TTL   300    /* Seconds fresh without freshness headers */
+#define CACHE_HEURISTIC_MAX 86400  /* Cap on lifetimes from Last-Modified */
+
+typedef struct cache_block
+{
+    char *tag;                    /* Request URI, in the block's slot */
+    char *content;                /* Whole response, after the tag */
+    unsigned int block_size;      /* Bytes of content */
+    unsigned int hdr_len;         /* Bytes of its header block, 0 if unknown */
+    unsigned int hash;            /* Hash of tag */
+    long expires;                 /* Wall clock second it goes stale */
+    int must_revalidate;          /* Never served stale */
+    int refcnt;                   /* Readers, plus one while cached */
+    struct cache_block *hnext;    /* Next block in the hash bucket */
+    evict_node ev;                /* Place in the shard's eviction order */
+    epoch_entry retired;          /* Waiting for lookups to let go of it */
+    struct cache_shard *shard;    /* Whose slab the slot is from, if any */
+    struct cache_block *spill_next; /* Next evicted block left to spill */
+} cache_block;
+
+typedef struct cache_shard
+{
+    pthread_mutex_t lock;         /* Serializes changes to everything below */
+    evict_state ev;               /* Which block to evict next */
+    cache_block **buckets;        /* Hash index of the shard's blocks */
+    struct cache_fill *fills;     /* Misses being fetched right now */
+    pthread_mutex_t slab_lock;    /* Taken last, by whoever frees a slot */
+    slab slab;                    /* The shard's part of the region */
+} cache_shard;
+
+typedef struct cache
+{
+    int nshards;
+    size_t shard_budget;          /* Capacity / nshards, slab aligned */
+    char *region;                 /* Memory of every shard's slab */
+    cache_shard *shards;
+} cache;
+
+/* What cache_acquire found for a tag */
+#define CACHE_HIT   0   /* *cbp is a referenced cached block */
+#define CACHE_JOIN  1   /* *fillp is another request's fill to read from */
+#define CACHE_MISS  2   /* *fillp is a new fill the caller must feed */
+#define CACHE_STALE 3   /* ... revalidating the referenced stale *cbp */
+
+/* cache_fill_read results other than a byte count */
+#define FILL_FAILED (-1)  /* Fill abandoned, the object will not be cached */
+#define FILL_AGAIN  (-2)  /* Nothing new yet, the waiter will be woken */
+
+enum fill_state { FILL_ACTIVE, FILL_DONE, FILL_ABANDONED };
+
+/* Credentials of the request that leads a fill */
+#define FILL_AUTH   1   /* It has an Authorization header */
+#define FILL_COOKIE 2   /* It has a Cookie header */
+
+/*
+ * Someone that cannot block in cache_fill_read (a reactor connection)
+ * asks to be woken through a waiter instead.
+ */
+typedef struct fill_waiter
+{
+    void (*wake)(void *arg);      /* Called whenever the fill changes */
+    void *arg;
+    struct fill_waiter *next;
+} fill_waiter;
+
+/*
+ * A response being fetched from the origin and teed into the cache while
+ * it is relayed. The request that missed (the leader) appends the bytes
+ * and publishes the complete copy into the cache as is, without copying
+ * it again; the copy is abandoned as soon as it cannot become a cached
+ * object. While in flight, the fill is registered in its shard so that
+ * concurrent misses on the same tag join it as readers instead of going
+ * to the origin themselves. Readers stream the bytes as they arrive once
+ * the response is known to be cacheable with a Content-length (its
+ * buffer then never moves), and otherwise wait for it to be published.
+ * Once the length is known the bytes go straight into a slot reserved
+ * for the block; a response of unknown length is copied into one at the
+ * end.
+ */
+typedef struct cache_fill
+{
+    char *tag;                    /* Request URI */
+    unsigned int hash;
+    struct cache *ca;
+    char *buf;                    /* Response bytes so far */
+    unsigned int len;             /* Valid bytes in buf */
+    unsigned int cap;             /* Allocated bytes of buf */
+    unsigned int hdr_len;         /* Length of the header block, 0 until seen */
+    long body_len;                /* Content-length, or -1 if not given */
+    long expires;                 /* Expiry of the object being fetched */
+    int must_revalidate;
+    cache_block *stale;           /* Block being revalidated, if any */
+    int credentials;              /* FILL_AUTH and FILL_COOKIE, set by
+                                     the leader before it appends */
+    int not_modified;             /* The origin answered it with a 304 */
+    enum fill_state state;
+    int streamable;               /* Readers may stream buf as it grows */
+    cache_block *block;           /* Block whose content is buf, if any */
+    int refcnt;                   /* Leader and readers */
+    int registered;               /* Still on the shard's fills list */
+    pthread_mutex_t lock;         /* Protects len, state, streamable, */
+    pthread_cond_t changed;       /* refcnt and waiters */
+    fill_waiter *waiters;
+    struct cache_fill *next;      /* Next fill in the shard */
+} cache_fill;
+
+/* The proxy's object cache, defined in proxy.c */
+extern cache proxy_cache;
+
+void cache_init(cache *ca, size_t capacity, int nshards,
+                const evict_policy *policy, int admission);
+void free_cache(cache *ca);
+cache_block *search_cache(cache *ca, char *tag);
+void release_cache_block(cache *ca, cache_block *cb);
+int add_to_cache(cache *ca, char *tag, char *content, unsigned int size);
+int cache_save(cache *ca, char *path);
+int cache_load(cache *ca, char *path);
+
+int cache_acquire(cache *ca, char *tag, cache_block **cbp, cache_fill **fillp);
+void cache_validators(cache_block *cb, http_view *etag,
+                      http_view *last_modified);
+int cache_serve_stale(cache_block *cb);
+
+/* Used by the leader of a fill */
+void cache_fill_append(cache_fill *f, char *data, size_t n);
+int cache_fill_end(cache_fill *f);
+void cache_fill_abort(cache_fill *f);
+int cache_fill_active(cache_fill *f);
+
+/* Used by the readers of a fill */
+int cache_fill_read(cache_fill *f, unsigned int off, char **datap,
+                    fill_waiter *w);
+void cache_fill_leave(cache_fill *f, fill_waiter *w);
+
+#endif /* __PROXY_CACHE_H__ */
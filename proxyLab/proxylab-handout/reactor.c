@@ -0,0 +1,481 @@
+/*
+ *                     reactor.c
+ *
+ * Event-driven mode of the proxy. The main thread accepts connections
+ * and hands each one, round robin, to one of a fixed number of reactor
+ * threads. Every reactor owns an edge-triggered epoll instance and
+ * drives its connections through the state machine in conn.c, doing
+ * their I/O with nonblocking system calls: a step that gets EAGAIN
+ * returns, and runs again when epoll reports the socket ready.
+ *
+ * Both the client and the origin socket of a connection are registered
+ * for input and output with the same conn_t, and any event simply runs
+ * the state machine until it would block. Memory and context switches
+ * therefore scale with the number of reactor threads instead of the
+ * number of open connections. An origin connection going back to the
+ * idle pool is taken out of the epoll set first.
+ *
+ * A large body that is not going into the cache leaves CONN_RELAY for
+ * CONN_SPLICE, which moves it from the origin to the client through a
+ * pipe with splice(2) instead of copying it through buf.
+ *
+ * Sharded ("-R"), there is no accepting thread: every reactor has a
+ * listening socket of its own on the same port, bound with SO_REUSEPORT,
+ * and accepts its connections itself. The kernel spreads connections
+ * over the listeners, preferring the one whose reactor is pinned to the
+ * CPU that took the connection in (SO_INCOMING_CPU), so a connection is
+ * accepted, allocated and served on one core without any hand-off.
+ *
+ * epoll_wait sleeps no longer than the reactor's timing wheel allows,
+ * so a stalled peer only holds on to memory and descriptors until its
+ * connection times out.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "proxy.h"
+#include "reactor.h"
+#include "conn.h"
+#include "relay.h"
+#include "sysdep.h"
+
+#define MAXEVENTS 64
+
+/* A connection with what the reactor keeps for it */
+typedef struct reactor_conn {
+    conn_t c;
+    int pipefd[2];               /* Splice pipe, opened on first use */
+    size_t in_pipe;              /* Body bytes spliced but not yet sent */
+    char in[CONN_IN];
+    char buf[CONN_OUT];
+} reactor_conn;
+
+typedef struct reactor {
+    conn_loop loop;             /* Connections, timers and wakeups */
+    int epfd;
+    pthread_t tid;
+    int listenfd;               /* Own listener when sharded, else -1 */
+    int cpu;                    /* CPU the reactor is pinned to, or -1 */
+} reactor_t;
+
+static void *reactor_thread(void *vargp);
+static void accept_conns(reactor_t *rt);
+static void conn_start(reactor_t *rt, int connfd);
+static ssize_t io_read(conn_t *c, int fd, char *data, size_t n);
+static int io_send(conn_t *c, char *data, size_t len, size_t *off);
+static int io_send_iov(conn_t *c, int fd);
+static int io_connect(conn_t *c, struct dns_addr *a);
+static int io_connected(conn_t *c);
+static void io_watch(conn_t *c, int fd);
+static int io_unwatch(conn_t *c, int fd);
+static int io_splice(conn_t *c);
+static int do_splice(conn_t *c);
+static void io_close(conn_t *c);
+static void io_free(conn_t *c);
+static void io_accept(conn_loop *lp);
+static void watch(reactor_t *rt, int fd, conn_t *c);
+
+static const conn_io reactor_io = {
+    io_read, io_send, io_send_iov, io_connect, io_connected, io_watch,
+    io_unwatch, io_splice, do_splice, NULL, io_close, io_free, io_accept
+};
+
+/*
+ * reactor_run - start nthreads reactors and feed them connections
+ *     accepted on listenfds[0] forever; sharded, reactor i is pinned to
+ *     a CPU and accepts on listenfds[i] itself, and the last one runs
+ *     on this thread
+ */
+/* $begin reactor_run */
+void reactor_run(int *listenfds, int nthreads, int sharded)
+{
+    reactor_t *reactors, *rt;
+    int i, connfd, evfd, next = 0, overloaded = 0;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    struct epoll_event ev;
+
+    reactors = Calloc(nthreads, sizeof(reactor_t));
+    for (i = 0; i < nthreads; i++) {
+        rt = &reactors[i];
+        if ((rt->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            unix_error("epoll_create1 error");
+        if ((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            unix_error("eventfd error");
+        conn_loop_init(&rt->loop, &reactor_io, evfd);
+        // The wakeup eventfd is the only watched fd without a conn.
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, evfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        rt->listenfd = -1;
+        rt->cpu = -1;
+        if (sharded) {
+            // The listener is watched with the reactor itself as data.
+            rt->listenfd = listenfds[i];
+            rt->cpu = cpu_nth(i);
+            if (set_nonblocking(rt->listenfd) < 0)
+                unix_error("fcntl error");
+            ev.data.ptr = rt;
+            if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, rt->listenfd, &ev) < 0)
+                unix_error("epoll_ctl error");
+        }
+    }
+    for (i = 0; i < nthreads - sharded; i++)
+        Pthread_create(&reactors[i].tid, NULL, reactor_thread, &reactors[i]);
+    if (sharded)
+        reactor_thread(&reactors[nthreads - 1]);
+
+    if (set_nonblocking(listenfds[0]) < 0)
+        unix_error("fcntl error");
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept_next(listenfds[0], (SA *)&clientaddr,
+                                  &clientlen, 1)) < 0) {
+            // Out of descriptors, give the reactors time to close some.
+            if (accept_overloaded(errno)) {
+                if (!overloaded++)
+                    log_warn("accept: %s, pausing", strerror(errno));
+                usleep(ACCEPT_BACKOFF_MS * 1000);
+            }
+            continue;
+        }
+        overloaded = 0;
+        log_debug_addr("Accepted connection from", &clientaddr, clientlen);
+        conn_start(&reactors[next], connfd);
+        next = (next + 1) % nthreads;
+    }
+}
+/* $end reactor_run */
+
+/*
+ * reactor_thread - event loop of one reactor
+ */
+static void *reactor_thread(void *vargp)
+{
+    reactor_t *rt = (reactor_t *)vargp;
+    struct epoll_event events[MAXEVENTS];
+    uint64_t count;
+    int i, n, rc;
+
+    if (rt->cpu >= 0 && (rc = cpu_pin(rt->cpu)) != 0)
+        log_warn("reactor: could not pin to CPU %d (%s)", rt->cpu,
+                 strerror(rc));
+    while (1) {
+        n = epoll_wait(rt->epfd, events, MAXEVENTS,
+                       timer_wait_ms(&rt->loop.wheel));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (read(rt->loop.evfd, &count, sizeof(count)) < 0
+                    && errno != EAGAIN)
+                    unix_error("eventfd read error");
+                conn_run_ready(&rt->loop);
+            } else if (events[i].data.ptr == rt)
+                accept_conns(rt);
+            else
+                conn_drive((conn_t *)events[i].data.ptr);
+        }
+        conn_batch_end(&rt->loop);
+    }
+    return NULL;
+}
+
+/*
+ * accept_conns - accept every connection waiting on the reactor's own
+ *     listener; out of descriptors, stop watching it, as it stays
+ *     readable, until conn_batch_end ends the pause
+ */
+static void accept_conns(reactor_t *rt)
+{
+    int connfd;
+    socklen_t clientlen = sizeof(struct sockaddr_storage);
+    struct sockaddr_storage clientaddr;
+
+    while ((connfd = accept_conn(rt->listenfd, (SA *)&clientaddr,
+                                 &clientlen, 1)) >= 0) {
+        log_debug_addr("Accepted connection from", &clientaddr, clientlen);
+        conn_start(rt, connfd);
+        clientlen = sizeof(clientaddr);
+    }
+    if (accept_overloaded(errno)) {
+        conn_accept_pause(&rt->loop, errno);
+        if (epoll_ctl(rt->epfd, EPOLL_CTL_DEL, rt->listenfd, NULL) < 0)
+            unix_error("epoll_ctl error");
+    }
+}
+
+/*
+ * conn_start - set up a connection for the nonblocking connfd and hand
+ *     it to reactor rt, or turn it away if there are too many
+ */
+static void conn_start(reactor_t *rt, int connfd)
+{
+    reactor_conn *rc;
+
+    if (!conn_admit(connfd))
+        return;
+    // Fully initialize the connection before its reactor can see it.
+    rc = Calloc(1, sizeof(reactor_conn));
+    rc->c.in = rc->in;
+    rc->c.buf = rc->buf;
+    rc->pipefd[0] = rc->pipefd[1] = -1;
+    conn_init(&rc->c, &rt->loop, connfd);
+    watch(rt, connfd, &rc->c);
+}
+
+/*
+ * io_read - read(2), as the socket is nonblocking
+ */
+static ssize_t io_read(conn_t *c, int fd, char *data, size_t n)
+{
+    return read(fd, data, n);
+}
+
+/*
+ * io_send - write data[*off..len) to the client; returns 1 once all of
+ *     it is out, and 0 if the socket is full or the connection closed
+ */
+static int io_send(conn_t *c, char *data, size_t len, size_t *off)
+{
+    ssize_t n;
+
+    while (*off < len) {
+        n = send(c->clientfd, data + *off, len - *off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                conn_close(c);
+            return 0;
+        }
+        *off += n;
+    }
+    return 1;
+}
+
+/*
+ * io_send_iov - write the pieces left from iov_next to fd, as many per
+ *     call as the socket takes; returns 1 once all are out, 0 if the
+ *     socket is full, and -1 if the write failed
+ */
+static int io_send_iov(conn_t *c, int fd)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    while (c->niov > 0) {
+        msg.msg_iov = c->iov_next;
+        msg.msg_iovlen = c->niov;
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+        iov_consume(&c->iov_next, &c->niov, n);
+    }
+    return 1;
+}
+
+/*
+ * io_connect - begin a nonblocking connect to a, watched by the reactor
+ */
+static int io_connect(conn_t *c, struct dns_addr *a)
+{
+    int fd;
+
+    if ((fd = socket(a->family, a->socktype | SOCK_NONBLOCK, a->protocol)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&a->addr, a->len) < 0 && errno != EINPROGRESS) {
+        Close(fd);
+        return -1;
+    }
+    c->serverfd = fd;
+    watch((reactor_t *)c->loop, fd, c);
+    return 0;
+}
+
+/*
+ * io_connected - whether the connect in flight has finished, and how
+ */
+static int io_connected(conn_t *c)
+{
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(c->serverfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err == 0) {
+        len = sizeof(peer);
+        if (getpeername(c->serverfd, (SA *)&peer, &len) < 0) {
+            if (errno == ENOTCONN)
+                return 0;       /* Still connecting */
+            err = errno;
+        }
+    }
+    return err ? -1 : 1;
+}
+
+static void io_watch(conn_t *c, int fd)
+{
+    watch((reactor_t *)c->loop, fd, c);
+}
+
+/*
+ * io_unwatch - take an origin connection out of the epoll set, so that
+ *     it does not wake this reactor from the idle pool
+ */
+static int io_unwatch(conn_t *c, int fd)
+{
+    return epoll_ctl(((reactor_t *)c->loop)->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+ * io_splice - splice the rest of a large raw body, once the connection
+ *     has a pipe for it
+ */
+static int io_splice(conn_t *c)
+{
+    reactor_conn *rc = (reactor_conn *)c;
+
+    if (!framer_raw_body(&c->fr, SPLICE_MIN)
+        || (rc->pipefd[0] < 0 && splice_pipe(rc->pipefd) < 0))
+        return 0;
+    c->state = CONN_SPLICE;
+    return 1;
+}
+
+/*
+ * do_splice - move the rest of the body from the origin into the pipe,
+ *     one chunk at a time, and each chunk on to the client before the
+ *     next; back to CONN_RELAY once the body is over
+ */
+static int do_splice(conn_t *c)
+{
+    reactor_conn *rc = (reactor_conn *)c;
+    ssize_t n;
+    size_t want;
+
+    while (1) {
+        if (rc->in_pipe > 0) {
+            if ((n = splice_move(rc->pipefd[0], c->clientfd,
+                                 rc->in_pipe)) < 0) {
+                if (errno != EAGAIN)
+                    conn_close(c);
+                return 0;
+            }
+            rc->in_pipe -= n;
+            continue;
+        }
+        if (c->server_eof || c->fr.state == FRAME_DONE) {
+            c->server_eof = 1;
+            c->state = CONN_RELAY;
+            return 1;
+        }
+        want = framer_want(&c->fr);
+        if (want == 0 || want > SPLICE_CHUNK)
+            want = SPLICE_CHUNK;
+        if ((n = splice_move(c->serverfd, rc->pipefd[1], want)) < 0) {
+            if (errno != EAGAIN)
+                conn_close(c);
+            return 0;
+        }
+        if (n == 0)
+            c->server_eof = 1;
+        framer_skip(&c->fr, n);
+        rc->in_pipe = n;
+    }
+}
+
+/*
+ * io_close - close the splice pipe of a connection being closed
+ */
+static void io_close(conn_t *c)
+{
+    reactor_conn *rc = (reactor_conn *)c;
+
+    if (rc->pipefd[0] >= 0) {
+        Close(rc->pipefd[0]);
+        Close(rc->pipefd[1]);
+    }
+}
+
+static void io_free(conn_t *c)
+{
+    Free(c);
+}
+
+/*
+ * io_accept - watch the reactor's listener again after a pause
+ */
+static void io_accept(conn_loop *lp)
+{
+    reactor_t *rt = (reactor_t *)lp;
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = rt;
+    if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, rt->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/*
+ * watch - register fd with the reactor, edge triggered, for both
+ *     directions at once
+ */
+static void watch(reactor_t *rt, int fd, conn_t *c)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+}
+
+/*
+ * reactor_listen - a listening socket on port that shares it with the
+ *     other reactors' (SO_REUSEPORT), and that the kernel prefers for
+ *     connections taken in on cpu if that is not -1; -1 on error
+ */
+int reactor_listen(char *port, int cpu)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd, one = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    Getaddrinfo(NULL, port, &hints, &listp);
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+                               p->ai_protocol)) < 0)
+            continue;
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (cpu >= 0)
+            setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                       sizeof(cpu));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        Close(listenfd);
+    }
+    Freeaddrinfo(listp);
+    if (!p)
+        return -1;
+    if (listen(listenfd, LISTENQ) < 0) {
+        Close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
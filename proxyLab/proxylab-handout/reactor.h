@@ -0,0 +1,19 @@
+/*
+ *                     reactor.h
+ *
+ * Edge-triggered epoll event loop for the proxy. A fixed number of
+ * reactor threads each own an epoll instance and drive every connection
+ * handed to them as a nonblocking state machine. Sharded, each reactor
+ * is pinned to a CPU and accepts on a SO_REUSEPORT listener of its own.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+void reactor_run(int *listenfds, int nthreads, int sharded);
+int reactor_listen(char *port, int cpu);
+
+#endif /* __REACTOR_H__ */
@@ -0,0 +1,90 @@
+/*
+ *                     relay.c
+ *
+ * splice(2) helpers for relaying response bodies that are not teed into
+ * the cache. This file does not include csapp.h: splice needs
+ * _GNU_SOURCE, under which <netdb.h> declares a gai_error of its own.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "relay.h"
+
+static ssize_t splice_retry(int fromfd, int tofd, size_t n,
+                            unsigned int flags);
+
+/*
+ * splice_pipe - open the pipe for a relay between nonblocking sockets
+ */
+int splice_pipe(int pipefd[2])
+{
+    return pipe2(pipefd, O_NONBLOCK | O_CLOEXEC);
+}
+
+/*
+ * splice_move - one splice of up to n bytes from fromfd to tofd, one
+ *     of which is a pipe; returns the bytes moved, 0 at end of file, or
+ *     -1 with errno set (EAGAIN if a nonblocking socket is not ready)
+ */
+ssize_t splice_move(int fromfd, int tofd, size_t n)
+{
+    return splice_retry(fromfd, tofd, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/*
+ * splice_relay - move n bytes, or everything up to end of file if n is
+ *     negative, from the blocking socket fromfd to the blocking socket
+ *     tofd. Returns the bytes moved, which are fewer than n only if
+ *     fromfd closed or failed first; -1 if writing to tofd failed; and
+ *     -2 if no pipe could be opened and nothing was moved.
+ */
+long splice_relay(int fromfd, int tofd, long n)
+{
+    int pipefd[2];
+    long total = 0;
+    ssize_t in, out;
+    size_t chunk;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -2;
+    while (n < 0 || total < n) {
+        chunk = (n < 0 || n - total > SPLICE_CHUNK) ? SPLICE_CHUNK
+                                                    : (size_t)(n - total);
+        if ((in = splice_retry(fromfd, pipefd[1], chunk, SPLICE_F_MOVE)) <= 0)
+            break;
+        // The pipe is drained before it is filled again, so it never
+        // holds more than one chunk.
+        while (in > 0) {
+            if ((out = splice_retry(pipefd[0], tofd, in,
+                                    SPLICE_F_MOVE)) <= 0) {
+                total = -1;
+                goto done;
+            }
+            in -= out;
+            total += out;
+        }
+    }
+done:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return total;
+}
+
+/*
+ * splice_retry - splice, restarted if a signal interrupts it
+ */
+static ssize_t splice_retry(int fromfd, int tofd, size_t n,
+                            unsigned int flags)
+{
+    ssize_t rc;
+
+    while ((rc = splice(fromfd, NULL, tofd, NULL, n, flags)) < 0
+           && errno == EINTR)
+        ;
+    return rc;
+}
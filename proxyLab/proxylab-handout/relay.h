@@ -0,0 +1,24 @@
+/*
+ *                     relay.h
+ *
+ * Zero-copy relay of response bodies with splice(2): bytes move from
+ * the origin socket into a pipe and from the pipe into the client
+ * socket without being copied through user space.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+#define SPLICE_CHUNK (64 * 1024)  /* Bytes moved per splice, one pipe's worth */
+#define SPLICE_MIN   (16 * 1024)  /* Smaller bodies are cheaper to copy */
+
+int splice_pipe(int pipefd[2]);
+ssize_t splice_move(int fromfd, int tofd, size_t n);
+long splice_relay(int fromfd, int tofd, long n);
+
+#endif /* __RELAY_H__ */
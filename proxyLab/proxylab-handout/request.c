@@ -0,0 +1,203 @@
+/*
+ *                     request.c
+ *
+ * Single-pass parser for request header blocks. request_parse only
+ * ever looks at complete lines: it searches for the next line feed from
+ * where the previous search gave up, so bytes that arrive in pieces are
+ * not scanned again, and once a line is complete it is split in place.
+ * A request line with fewer than three words is rejected; header lines
+ * without a colon, and continuation lines, are skipped.
+ *
+ * This file does not depend on csapp.c, so the parser benchmark can
+ * link it on its own.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "request.h"
+
+static char default_port[] = "80";
+static char root_path[] = "/";
+
+static int parse_line(http_request *hr, char *p, char *eol);
+static int parse_header(http_request *hr, char *line, char *eol);
+static char *find_byte(char *p, char *end, char c);
+
+/*
+ * request_init - get ready for a new request at the start of a buffer
+ */
+void request_init(http_request *hr)
+{
+    hr->state = REQ_AGAIN;
+    hr->off = hr->scan = 0;
+    hr->method.p = NULL;
+    hr->major = 1;
+    hr->minor = 0;
+    hr->nheaders = 0;
+}
+
+/*
+ * request_parse - parse the lines completed since the last call in the
+ *     first len bytes of buf, which holds the request from its start;
+ *     returns REQ_AGAIN until the blank line ending the header block has
+ *     been seen, then REQ_DONE with its length in hr->off, or an error
+ */
+int request_parse(http_request *hr, char *buf, size_t len)
+{
+    char *line, *eol, *nl;
+
+    while (hr->state == REQ_AGAIN) {
+        line = buf + hr->off;
+        if ((nl = find_byte(buf + hr->scan, buf + len, '\n')) == NULL) {
+            hr->scan = len;
+            break;
+        }
+        eol = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+        hr->off = hr->scan = nl + 1 - buf;
+        if (hr->method.p == NULL)
+            hr->state = parse_line(hr, line, eol);
+        else if (eol == line)
+            hr->state = REQ_DONE;
+        else
+            hr->state = parse_header(hr, line, eol);
+    }
+    return hr->state;
+}
+
+/*
+ * request_target - split the absolute URI of the request into host,
+ *     port (80 if not given) and path ("/" if not given); returns -1 if
+ *     it is not an http URI or longer than REQ_MAX_URI
+ */
+int request_target(http_request *hr)
+{
+    char *p = hr->uri.p, *end = p + hr->uri.len, *slash, *colon;
+
+    if (hr->uri.len > REQ_MAX_URI || hr->uri.len < 7
+        || strncasecmp(p, "http://", 7))
+        return -1;
+    p += 7;
+    if ((slash = find_byte(p, end, '/')) != NULL) {
+        hr->path.p = slash;
+        hr->path.len = end - slash;
+        end = slash;
+    } else {
+        hr->path.p = root_path;
+        hr->path.len = 1;
+    }
+    if ((colon = find_byte(p, end, ':')) != NULL && colon + 1 < end) {
+        hr->port.p = colon + 1;
+        hr->port.len = end - colon - 1;
+    } else {
+        hr->port.p = default_port;
+        hr->port.len = 2;
+    }
+    hr->host.p = p;
+    hr->host.len = (colon ? colon : end) - p;
+    return hr->host.len ? 0 : -1;
+}
+
+/*
+ * view_is - whether the view is s, ignoring case
+ */
+int view_is(http_view v, char *s)
+{
+    return strlen(s) == v.len && !strncasecmp(v.p, s, v.len);
+}
+
+/*
+ * view_str - copy the view into dst as a string of at most size - 1
+ *     characters, for the few callers that need one
+ */
+char *view_str(char *dst, size_t size, http_view v)
+{
+    size_t n = (v.len < size) ? v.len : size - 1;
+
+    memcpy(dst, v.p, n);
+    dst[n] = '\0';
+    return dst;
+}
+
+/*
+ * parse_line - split the request line [p, eol) into its three words
+ */
+static int parse_line(http_request *hr, char *p, char *eol)
+{
+    http_view *word[3] = { &hr->method, &hr->uri, &hr->version };
+    char *sp, *v;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        while (p < eol && *p == ' ')
+            p++;
+        if (p == eol)
+            return REQ_BAD_LINE;
+        if ((sp = find_byte(p, eol, ' ')) == NULL)
+            sp = eol;
+        word[i]->p = p;
+        word[i]->len = sp - p;
+        p = sp;
+    }
+    v = hr->version.p;
+    if (hr->version.len == 8 && !strncmp(v, "HTTP/", 5) && v[6] == '.'
+        && v[5] >= '0' && v[5] <= '9' && v[7] >= '0' && v[7] <= '9') {
+        hr->major = v[5] - '0';
+        hr->minor = v[7] - '0';
+    }
+    return REQ_AGAIN;
+}
+
+/*
+ * parse_header - record the header line [line, eol) as a name and a
+ *     value with the white space around it trimmed
+ */
+static int parse_header(http_request *hr, char *line, char *eol)
+{
+    http_header *h;
+    char *colon, *v;
+
+    if (*line == ' ' || *line == '\t'
+        || (colon = find_byte(line, eol, ':')) == NULL)
+        return REQ_AGAIN;
+    if (hr->nheaders == REQ_MAX_HEADERS)
+        return REQ_TOO_LARGE;
+    for (v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+        ;
+    while (eol > v && (eol[-1] == ' ' || eol[-1] == '\t'))
+        eol--;
+    h = &hr->headers[hr->nheaders++];
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = v;
+    h->value.len = eol - v;
+    return REQ_AGAIN;
+}
+
+/*
+ * find_byte - the first c in [p, end), or NULL; sixteen bytes are
+ *     compared at once for as long as that many are left
+ */
+static char *find_byte(char *p, char *end, char c)
+{
+#ifdef __SSE2__
+    __m128i want = _mm_set1_epi8(c);
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)p), want));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++)
+        if (*p == c)
+            return p;
+    return NULL;
+}
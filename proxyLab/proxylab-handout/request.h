@@ -0,0 +1,63 @@
+/*
+ *                     request.h
+ *
+ * Incremental parser for the header block of a client's request. It
+ * is fed the request as it accumulates in one buffer, resumes where the
+ * last call stopped, and looks at every byte once: the request line is
+ * split into method, URI and version, and each header line into name
+ * and value. Nothing is copied; the parts are views into the buffer,
+ * which must stay put until the request has been served. Line ends and
+ * header colons are found sixteen bytes at a time with SSE2 where the
+ * compiler offers it.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include <stddef.h>
+
+#define REQ_MAX_HEADERS 64    /* Header lines a request may have */
+#define REQ_MAX_URI     4096  /* Longest URI request_target accepts */
+
+/* What request_parse found */
+#define REQ_DONE       1    /* The header block is complete */
+#define REQ_AGAIN      0    /* More of it has to be read */
+#define REQ_BAD_LINE  -1    /* The request line has fewer than 3 words */
+#define REQ_TOO_LARGE -2    /* More than REQ_MAX_HEADERS header lines */
+
+/* len bytes at p in the request buffer, not NUL terminated */
+typedef struct http_view {
+    char *p;
+    size_t len;
+} http_view;
+
+typedef struct http_header {
+    http_view name;
+    http_view value;              /* Without the line end */
+} http_header;
+
+typedef struct http_request {
+    int state;                    /* REQ_AGAIN until parsing is over */
+    size_t off;                   /* Start of the first unparsed line */
+    size_t scan;                  /* Bytes already searched for its end */
+    http_view method;
+    http_view uri;
+    http_view version;
+    int major, minor;             /* HTTP version, 1.0 if not given */
+    http_view host;               /* Parts of an absolute URI, set by */
+    http_view port;               /* request_target */
+    http_view path;
+    int nheaders;
+    http_header headers[REQ_MAX_HEADERS];
+} http_request;
+
+void request_init(http_request *hr);
+int request_parse(http_request *hr, char *buf, size_t len);
+int request_target(http_request *hr);
+int view_is(http_view v, char *s);
+char *view_str(char *dst, size_t size, http_view v);
+
+#endif /* __REQUEST_H__ */
@@ -0,0 +1,89 @@
+/*
+ *                     sbuf.c
+ *
+ * The classic CS:APP shared FIFO buffer, extended to record how long
+ * every item waited in the queue before a consumer picked it up.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+/* $begin sbufc */
+#include "sbuf.h"
+
+static unsigned long elapsed_us(struct timespec *from);
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+/* $begin sbuf_init */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamps = Calloc(n, sizeof(struct timespec));
+    sp->n = n;                       /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+    sp->removed = sp->wait_total_us = sp->wait_max_us = 0;
+}
+/* $end sbuf_init */
+
+/* Clean up buffer sp */
+/* $begin sbuf_deinit */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->stamps);
+}
+/* $end sbuf_deinit */
+
+/* Insert item onto the rear of shared buffer sp */
+/* $begin sbuf_insert */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    int slot;
+
+    P(&sp->slots);                          /* Wait for available slot */
+    P(&sp->mutex);                          /* Lock the buffer */
+    slot = (++sp->rear) % (sp->n);
+    sp->buf[slot] = item;                   /* Insert the item */
+    clock_gettime(CLOCK_MONOTONIC, &sp->stamps[slot]);
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+/* $end sbuf_insert */
+
+/* Remove and return the first item from buffer sp */
+/* $begin sbuf_remove */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item, slot;
+    unsigned long wait;
+
+    P(&sp->items);                          /* Wait for available item */
+    P(&sp->mutex);                          /* Lock the buffer */
+    slot = (++sp->front) % (sp->n);
+    item = sp->buf[slot];                   /* Remove the item */
+    wait = elapsed_us(&sp->stamps[slot]);
+    sp->removed++;
+    sp->wait_total_us += wait;
+    if (wait > sp->wait_max_us)
+        sp->wait_max_us = wait;
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+    return item;
+}
+/* $end sbuf_remove */
+
+/* Microseconds since the time stamp from */
+static unsigned long elapsed_us(struct timespec *from)
+{
+    struct timespec now;
+    long us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - from->tv_sec) * 1000000L
+        + (now.tv_nsec - from->tv_nsec) / 1000;
+    return us < 0 ? 0 : us;
+}
+/* $end sbufc */
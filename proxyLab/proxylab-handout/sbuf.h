@@ -0,0 +1,39 @@
+/*
+ *                     sbuf.h
+ *
+ * Bounded producer/consumer queue of connected descriptors, built on
+ * the P/V semaphore wrappers in csapp.c. The proxy's prethreaded mode
+ * uses it to hand accepted connections to a fixed pool of workers.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* $begin sbuft */
+typedef struct {
+    int *buf;          /* Buffer array */
+    struct timespec *stamps; /* Time each item was inserted */
+    int n;             /* Maximum number of slots */
+    int front;         /* buf[(front+1)%n] is first item */
+    int rear;          /* buf[rear%n] is last item */
+    sem_t mutex;       /* Protects accesses to buf */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+    /* Queue-wait statistics, protected by mutex */
+    unsigned long removed;       /* Items handed to consumers */
+    unsigned long wait_total_us; /* Sum of their time in the queue */
+    unsigned long wait_max_us;   /* Longest single wait */
+} sbuf_t;
+/* $end sbuft */
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+#endif /* __SBUF_H__ */
@@ -0,0 +1,216 @@
+/*
+ *                     slab.c
+ *
+ * Two-level segregated fit. Every slot starts with a header giving its
+ * size and the size of the slot just before it, so both neighbours of a
+ * slot can be found when it is freed. A free slot also holds the links
+ * of its class list. The class of a size is its power of two and the
+ * next SLAB_SL_LOG bits below it; a request is rounded up to the next
+ * class boundary before searching, so that the first slot of the class
+ * found is always large enough, and the rest of it is split off again.
+ * Only when no such class has a slot is the request's own class
+ * searched for one that happens to fit, so that a slot as large as
+ * the free part of the region can still be had.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <string.h>
+#include "slab.h"
+
+#define SLOT_FREE 1UL              /* Low bit of size: the slot is free */
+
+typedef struct slab_slot {
+    size_t size;                  /* Bytes of the slot, header included */
+    size_t prev_size;             /* Size of the slot before, 0 if first */
+    struct slab_slot *next_free;  /* Class list, only while free */
+    struct slab_slot *prev_free;
+} slab_slot;
+
+#define SLOT_HDR  (2 * sizeof(size_t))
+#define SLOT_MIN  sizeof(slab_slot)
+#define SLOT_SIZE(s) ((s)->size & ~SLOT_FREE)
+
+static void mapping(size_t size, int *fl, int *sl);
+static slab_slot *find_free(slab *sb, size_t size);
+static void insert_free(slab *sb, slab_slot *s);
+static void remove_free(slab *sb, slab_slot *s);
+static slab_slot *next_slot(slab *sb, slab_slot *s);
+static slab_slot *prev_slot(slab *sb, slab_slot *s);
+static int msb(size_t x);
+
+/*
+ * slab_init - manage the size bytes at base, all of them free
+ */
+void slab_init(slab *sb, char *base, size_t size)
+{
+    slab_slot *s = (slab_slot *)base;
+
+    memset(sb, 0, sizeof(*sb));
+    sb->base = base;
+    sb->size = size & ~(size_t)(SLAB_ALIGN - 1);
+    if (sb->size < SLOT_MIN)
+        return;
+    s->size = sb->size | SLOT_FREE;
+    s->prev_size = 0;
+    insert_free(sb, s);
+}
+
+/*
+ * slab_alloc - a slot for n bytes, or NULL if no free slot is large
+ *     enough
+ */
+void *slab_alloc(slab *sb, size_t n)
+{
+    size_t size = (n + SLOT_HDR + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab_slot *s, *rest, *next;
+
+    if (size < SLOT_MIN)
+        size = SLOT_MIN;
+    if (n > sb->size || (s = find_free(sb, size)) == NULL)
+        return NULL;
+    remove_free(sb, s);
+    if (SLOT_SIZE(s) - size >= SLOT_MIN) {
+        rest = (slab_slot *)((char *)s + size);
+        rest->size = (SLOT_SIZE(s) - size) | SLOT_FREE;
+        rest->prev_size = size;
+        if ((next = next_slot(sb, rest)) != NULL)
+            next->prev_size = SLOT_SIZE(rest);
+        insert_free(sb, rest);
+        s->size = size;
+    } else
+        s->size = SLOT_SIZE(s);
+    sb->used += s->size;
+    return (char *)s + SLOT_HDR;
+}
+
+/*
+ * slab_free - give back the slot at p, merging it with free neighbours
+ */
+void slab_free(slab *sb, void *p)
+{
+    slab_slot *s = (slab_slot *)((char *)p - SLOT_HDR), *n;
+
+    sb->used -= s->size;
+    if ((n = next_slot(sb, s)) != NULL && (n->size & SLOT_FREE)) {
+        remove_free(sb, n);
+        s->size += SLOT_SIZE(n);
+    }
+    if ((n = prev_slot(sb, s)) != NULL && (n->size & SLOT_FREE)) {
+        remove_free(sb, n);
+        n->size = SLOT_SIZE(n) + s->size;
+        s = n;
+    }
+    s->size = SLOT_SIZE(s) | SLOT_FREE;
+    if ((n = next_slot(sb, s)) != NULL)
+        n->prev_size = SLOT_SIZE(s);
+    insert_free(sb, s);
+}
+
+/*
+ * slab_slot_size - the bytes of the region the allocation at p takes
+ */
+size_t slab_slot_size(void *p)
+{
+    return SLOT_SIZE((slab_slot *)((char *)p - SLOT_HDR));
+}
+
+/*
+ * slab_max_alloc - the largest n that slab_alloc can ever satisfy
+ */
+size_t slab_max_alloc(slab *sb)
+{
+    return sb->size < SLOT_MIN ? 0 : sb->size - SLOT_HDR;
+}
+
+/*
+ * mapping - the class of a slot size: fl is its power of two and sl the
+ *     SLAB_SL_LOG bits below it
+ */
+static void mapping(size_t size, int *fl, int *sl)
+{
+    *fl = msb(size);
+    *sl = (size >> (*fl - SLAB_SL_LOG)) & ((1 << SLAB_SL_LOG) - 1);
+}
+
+/*
+ * find_free - a free slot of at least size bytes, from the smallest
+ *     class whose every slot is that large, or else from the class of
+ *     size itself
+ */
+static slab_slot *find_free(slab *sb, size_t size)
+{
+    unsigned long fmap;
+    unsigned int smap;
+    slab_slot *s;
+    int fl, sl;
+
+    // Round up to the next class boundary.
+    mapping(size + (1UL << (msb(size) - SLAB_SL_LOG)) - 1, &fl, &sl);
+    smap = sb->sl_map[fl] & (~0U << sl);
+    if (smap == 0 && fl + 1 < SLAB_FL_COUNT
+        && (fmap = sb->fl_map & (~0UL << (fl + 1))) != 0) {
+        fl = __builtin_ctzl(fmap);
+        smap = sb->sl_map[fl];
+    }
+    if (smap)
+        return sb->free[fl][__builtin_ctz(smap)];
+    mapping(size, &fl, &sl);
+    for (s = sb->free[fl][sl]; s && SLOT_SIZE(s) < size; s = s->next_free)
+        ;
+    return s;
+}
+
+static void insert_free(slab *sb, slab_slot *s)
+{
+    int fl, sl;
+
+    mapping(SLOT_SIZE(s), &fl, &sl);
+    s->prev_free = NULL;
+    s->next_free = sb->free[fl][sl];
+    if (s->next_free)
+        s->next_free->prev_free = s;
+    sb->free[fl][sl] = s;
+    sb->fl_map |= 1UL << fl;
+    sb->sl_map[fl] |= 1U << sl;
+}
+
+static void remove_free(slab *sb, slab_slot *s)
+{
+    int fl, sl;
+
+    mapping(SLOT_SIZE(s), &fl, &sl);
+    if (s->prev_free)
+        s->prev_free->next_free = s->next_free;
+    else
+        sb->free[fl][sl] = s->next_free;
+    if (s->next_free)
+        s->next_free->prev_free = s->prev_free;
+    if (sb->free[fl][sl] == NULL) {
+        sb->sl_map[fl] &= ~(1U << sl);
+        if (sb->sl_map[fl] == 0)
+            sb->fl_map &= ~(1UL << fl);
+    }
+}
+
+/*
+ * next_slot, prev_slot - the slots on either side of s in the region,
+ *     or NULL at its ends
+ */
+static slab_slot *next_slot(slab *sb, slab_slot *s)
+{
+    char *n = (char *)s + SLOT_SIZE(s);
+
+    return (n < sb->base + sb->size) ? (slab_slot *)n : NULL;
+}
+
+static slab_slot *prev_slot(slab *sb, slab_slot *s)
+{
+    return s->prev_size ? (slab_slot *)((char *)s - s->prev_size) : NULL;
+}
+
+static int msb(size_t x)
+{
+    return 8 * sizeof(unsigned long) - 1 - __builtin_clzl(x);
+}
@@ -0,0 +1,49 @@
+/*
+ *                     slab.h
+ *
+ * Allocator for the cache's objects, working inside one region that is
+ * set aside up front. A slot is carved out of the region for every
+ * object, with its block header, tag and response bytes together, so
+ * caching an object costs one allocation and evicting it returns the
+ * whole slot. Free slots are kept on size-class lists (four classes per
+ * power of two, with bitmaps of the non-empty ones), which makes both
+ * slab_alloc and slab_free O(1); a freed slot is merged with free
+ * neighbours so that large objects find room again.
+ *
+ * The region's bytes are the budget: used counts every allocated slot,
+ * its header included, so what the cache holds is exactly what it may.
+ * A slab is not locked; its owner serializes the calls.
+ *
+ * This file does not depend on csapp.c.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+#define SLAB_ALIGN    16           /* Slots start and end on this boundary */
+#define SLAB_SL_LOG   2            /* log2 of the classes per power of two */
+#define SLAB_FL_COUNT 64           /* Powers of two a slot size can have */
+
+struct slab_slot;
+
+typedef struct slab {
+    char *base;                   /* The region, SLAB_ALIGN aligned */
+    size_t size;                  /* Bytes of the region */
+    size_t used;                  /* Bytes in allocated slots */
+    unsigned long fl_map;         /* Powers of two with a free slot */
+    unsigned char sl_map[SLAB_FL_COUNT];           /* Classes with one */
+    struct slab_slot *free[SLAB_FL_COUNT][1 << SLAB_SL_LOG];
+} slab;
+
+void slab_init(slab *sb, char *base, size_t size);
+void *slab_alloc(slab *sb, size_t n);
+void slab_free(slab *sb, void *p);
+size_t slab_slot_size(void *p);
+size_t slab_max_alloc(slab *sb);
+
+#endif /* __SLAB_H__ */
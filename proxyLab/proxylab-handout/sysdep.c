@@ -0,0 +1,111 @@
+/*
+ *                     sysdep.c
+ *
+ * accept4 and CPU affinity, which need _GNU_SOURCE; see sysdep.h.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "sysdep.h"
+
+/*
+ * accept_conn - accept a connection on listenfd as a close-on-exec
+ *     socket, nonblocking too if asked, in one call, storing the
+ *     client's address in addr if it is not NULL; -1 with errno set if
+ *     none, EAGAIN once a nonblocking listener is drained
+ */
+int accept_conn(int listenfd, struct sockaddr *addr, socklen_t *len,
+                int nonblock)
+{
+    int fd, flags = SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0);
+
+    while ((fd = accept4(listenfd, addr, len, flags)) < 0
+           && (errno == EINTR || errno == ECONNABORTED))
+        ;
+    return fd;
+}
+
+/*
+ * accept_next - accept_conn on a nonblocking listener, waiting for a
+ *     connection only once the backlog is drained; -1 on an error
+ */
+int accept_next(int listenfd, struct sockaddr *addr, socklen_t *len,
+                int nonblock)
+{
+    struct pollfd pfd;
+    socklen_t size = len ? *len : 0;
+    int fd;
+
+    pfd.fd = listenfd;
+    pfd.events = POLLIN;
+    while ((fd = accept_conn(listenfd, addr, len, nonblock)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return -1;
+        if (len)
+            *len = size;
+    }
+    return fd;
+}
+
+/*
+ * accept_overloaded - whether an accept failed with err for want of
+ *     descriptors or kernel memory, which connections closing will
+ *     give back, rather than because the listener is unusable
+ */
+int accept_overloaded(int err)
+{
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+/*
+ * set_nonblocking - put fd in nonblocking mode; -1 on an error
+ */
+int set_nonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * cpu_nth - the i-th of the CPUs this process may run on, wrapping
+ *     around, or -1 if that cannot be found out
+ */
+int cpu_nth(int i)
+{
+    cpu_set_t set;
+    int cpu, n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0 || CPU_COUNT(&set) == 0)
+        return -1;
+    i %= CPU_COUNT(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set) && n++ == i)
+            return cpu;
+    return -1;
+}
+
+/*
+ * cpu_pin - keep the calling thread on cpu; returns 0, or an error
+ *     number
+ */
+int cpu_pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
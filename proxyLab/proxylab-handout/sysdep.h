@@ -0,0 +1,36 @@
+/*
+ *                     sysdep.h
+ *
+ * Linux calls the proxy uses that are only declared under _GNU_SOURCE:
+ * accept4 and CPU affinity. Like relay.c, sysdep.c does not include
+ * csapp.h, whose gai_error <netdb.h> would then declare again.
+ *
+ * Accept loops keep their listener nonblocking and take connections
+ * with accept_next: one accept4 per connection, which also sets the
+ * flags the new socket needs, and a poll only once the backlog is
+ * empty. A loop whose accept fails with accept_overloaded errno is out
+ * of descriptors or memory for now, not broken: it stops accepting for
+ * ACCEPT_BACKOFF_MS, or in an event loop until one of its connections
+ * closes, and tries again.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __SYSDEP_H__
+#define __SYSDEP_H__
+
+#include <sys/socket.h>
+
+#define ACCEPT_BACKOFF_MS 100  /* Pause in accepting after an overload */
+
+int accept_conn(int listenfd, struct sockaddr *addr, socklen_t *len,
+                int nonblock);
+int accept_next(int listenfd, struct sockaddr *addr, socklen_t *len,
+                int nonblock);
+int accept_overloaded(int err);
+int set_nonblocking(int fd);
+int cpu_nth(int i);
+int cpu_pin(int cpu);
+
+#endif /* __SYSDEP_H__ */
@@ -0,0 +1,178 @@
+/*
+ *                     timer.c
+ *
+ * The slot of a timer on level l is bits l*TIMER_BITS and up of the
+ * tick it expires on, and level l only takes timers due within
+ * TIMER_SLOTS^(l+1) ticks, so its slots all lie ahead of the wheel.
+ * When the wheel gets to a tick whose lower bits are zero, the slot of
+ * the next level up for that tick is emptied into the levels below;
+ * those timers are then due within the span of the lower levels, and
+ * one due on this very tick lands in the slot about to be run.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include "timer.h"
+
+#define TIMER_MASK  ((unsigned long)TIMER_SLOTS - 1)
+#define TIMER_SPAN  (1UL << (TIMER_BITS * TIMER_LEVELS)) /* Ticks spanned */
+
+static unsigned long now_ms(void);
+static void timer_add(timer_wheel *w, timer *t);
+static void timer_cascade(timer_wheel *w, int level, unsigned long idx);
+
+/*
+ * timer_wheel_init - start an empty wheel at the current tick
+ */
+void timer_wheel_init(timer_wheel *w)
+{
+    memset(w, 0, sizeof(*w));
+    w->now = now_ms() / TIMER_TICK_MS + 1;
+}
+
+/*
+ * timer_set - make t fire once ms have passed, rounded up to a tick,
+ *     whether or not it was pending
+ */
+void timer_set(timer_wheel *w, timer *t, unsigned long ms)
+{
+    unsigned long cur;
+
+    timer_cancel(w, t);
+    // An empty wheel is not run, and may be behind the clock.
+    if (w->count == 0 && (cur = now_ms() / TIMER_TICK_MS + 1) > w->now)
+        w->now = cur;
+    t->expires = w->now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_add(w, t);
+    w->count++;
+}
+
+/*
+ * timer_cancel - stop t from firing, if it is pending
+ */
+void timer_cancel(timer_wheel *w, timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    if ((*t->pprev = t->next) != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    w->count--;
+}
+
+/*
+ * timer_pending - whether t is set and has not fired yet
+ */
+int timer_pending(timer *t)
+{
+    return t->pprev != NULL;
+}
+
+/*
+ * timer_expire - run the wheel up to the current tick and return the
+ *     timers that fired, linked by next. They are no longer pending; a
+ *     caller that sets one again must take its next first.
+ */
+timer *timer_expire(timer_wheel *w)
+{
+    unsigned long cur = now_ms() / TIMER_TICK_MS, idx;
+    timer *fired = NULL, **tail = &fired, *t;
+    int level;
+
+    while (w->now <= cur && w->count > 0) {
+        idx = w->now & TIMER_MASK;
+        for (level = 1; idx == 0 && level < TIMER_LEVELS; level++) {
+            idx = (w->now >> (TIMER_BITS * level)) & TIMER_MASK;
+            timer_cascade(w, level, idx);
+        }
+        idx = w->now & TIMER_MASK;
+        while ((t = w->slot[0][idx]) != NULL) {
+            timer_cancel(w, t);
+            *tail = t;
+            tail = &t->next;
+        }
+        w->now++;
+    }
+    *tail = NULL;
+    // With nothing pending there is nothing to cascade on the way.
+    if (w->now <= cur)
+        w->now = cur + 1;
+    return fired;
+}
+
+/*
+ * timer_wait_ms - how long the event loop may sleep before it has to
+ *     run the wheel again: until the next tick with a timer on the first
+ *     level, or the next time that level wraps; -1 if nothing is pending
+ */
+int timer_wait_ms(timer_wheel *w)
+{
+    unsigned long tick, end = (w->now | TIMER_MASK) + 1, now;
+
+    if (w->count == 0)
+        return -1;
+    for (tick = w->now; tick < end && !w->slot[0][tick & TIMER_MASK]; tick++)
+        ;
+    now = now_ms();
+    if (tick * TIMER_TICK_MS <= now)
+        return 0;
+    if (tick * TIMER_TICK_MS - now > INT_MAX)
+        return INT_MAX;
+    return tick * TIMER_TICK_MS - now;
+}
+
+/*
+ * now_ms - the monotonic clock, in ms
+ */
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * timer_add - link t into the slot for its expiry, which is no earlier
+ *     than the next tick to run; one too far out waits as long as the
+ *     wheel spans
+ */
+static void timer_add(timer_wheel *w, timer *t)
+{
+    unsigned long delta = t->expires - w->now;
+    timer **slot;
+    int level;
+
+    if (delta >= TIMER_SPAN) {
+        delta = TIMER_SPAN - 1;
+        t->expires = w->now + delta;
+    }
+    for (level = 0; level < TIMER_LEVELS - 1; level++)
+        if (delta < 1UL << (TIMER_BITS * (level + 1)))
+            break;
+    slot = &w->slot[level][(t->expires >> (TIMER_BITS * level))
+                           & TIMER_MASK];
+    if ((t->next = *slot) != NULL)
+        t->next->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+}
+
+/*
+ * timer_cascade - move the timers of one slot of a higher level into
+ *     the levels below, now that the wheel has come to them
+ */
+static void timer_cascade(timer_wheel *w, int level, unsigned long idx)
+{
+    timer *t = w->slot[level][idx], *next;
+
+    w->slot[level][idx] = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        timer_add(w, t);
+    }
+}
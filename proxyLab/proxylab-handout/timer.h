@@ -0,0 +1,50 @@
+/*
+ *                     timer.h
+ *
+ * Hierarchical timing wheel for the event-driven modes, which keep one
+ * timer per connection for its connect, header, body and idle timeouts.
+ * Time advances in ticks of TIMER_TICK_MS. The wheel has TIMER_LEVELS
+ * levels of TIMER_SLOTS slots each: a timer due within TIMER_SLOTS ticks
+ * sits in the slot of the first level for its tick, a later one in the
+ * slot of the level that spans it, and moves down a level each time the
+ * level below wraps around. Setting and cancelling a timer is unlinking
+ * and linking it in a list, and running a tick looks at one slot, so
+ * every operation takes constant time however many timers are pending.
+ *
+ * Timers are embedded in what they time and are not thread safe; each
+ * wheel belongs to the one thread that runs its event loop.
+ *
+ * This file does not depend on csapp.c.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#define TIMER_TICK_MS 100                 /* Resolution of the wheel */
+#define TIMER_BITS    6
+#define TIMER_SLOTS   (1 << TIMER_BITS)   /* Slots per level */
+#define TIMER_LEVELS  4                   /* Spans 64^4 ticks, 19 days */
+
+typedef struct timer {
+    struct timer *next;           /* In its slot, or in the expired list */
+    struct timer **pprev;         /* Link to it, NULL if not pending */
+    unsigned long expires;        /* Tick it fires on */
+} timer;
+
+typedef struct timer_wheel {
+    unsigned long now;            /* Next tick to run */
+    int count;                    /* Timers pending */
+    timer *slot[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel;
+
+void timer_wheel_init(timer_wheel *w);
+void timer_set(timer_wheel *w, timer *t, unsigned long ms);
+void timer_cancel(timer_wheel *w, timer *t);
+timer *timer_expire(timer_wheel *w);
+int timer_wait_ms(timer_wheel *w);
+int timer_pending(timer *t);
+
+#endif /* __TIMER_H__ */
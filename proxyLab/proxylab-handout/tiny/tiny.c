@@ -2,8 +2,11 @@
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *     usage: tiny [-l error|warn|info|debug] <port>
  */
 #include "csapp.h"
+#include "log.h"
+#include "sysdep.h"
 
 void doit(int fd);
 void read_requesthdrs(rio_t *rp);
@@ -17,23 +20,31 @@ void clienterror(int fd, char *cause, char *errnum,
 int main(int argc, char **argv) 
 {
     int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    int level = LEVEL_INFO;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (argc == 4 && !strcmp(argv[1], "-l"))
+        level = log_level_parse(argv[2]);
+    else if (argc != 2)
+        level = -1;
+    if (level < 0) {
+	fprintf(stderr, "usage: %s [-l error|warn|info|debug] <port>\n",
+                argv[0]);
 	exit(1);
     }
+    log_init(STDOUT_FILENO, level);
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[argc - 1]);
+    if (set_nonblocking(listenfd) < 0)
+        unix_error("fcntl error");
     while (1) {
 	clientlen = sizeof(clientaddr);
-	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
+	if ((connfd = accept_next(listenfd, (SA *)&clientaddr,  //line:netp:tiny:accept
+                                  &clientlen, 0)) < 0)
+            unix_error("Accept error");
+        log_debug_addr("Accepted connection from", &clientaddr, clientlen);
 	doit(connfd);                                             //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
@@ -56,7 +67,7 @@ void doit(int fd)
     Rio_readinitb(&rio, fd);
     if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
         return;
-    printf("%s", buf);
+    log_info("\"%.*s\"", (int)strcspn(buf, "\r\n"), buf);
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
@@ -101,10 +112,9 @@ void read_requesthdrs(rio_t *rp)
     char buf[MAXLINE];
 
     Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
     while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
+	log_debug("%.*s", (int)strcspn(buf, "\r\n"), buf);
 	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
     }
     return;
 }
@@ -159,8 +169,7 @@ void serve_static(int fd, char *filename, int filesize)
     sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
     sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
     Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
-    printf("Response headers:\n");
-    printf("%s", buf);
+    log_debug("Response headers:\n%s", buf);
 
     /* Send response body to client */
     srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
@@ -221,6 +230,8 @@ void clienterror(int fd, char *cause, char *errnum,
 {
     char buf[MAXLINE], body[MAXBUF];
 
+    log_info("%s %s: %s", errnum, shortmsg, cause);
+
     /* Build the HTTP response body */
     sprintf(body, "<html><title>Tiny Error</title>");
     sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
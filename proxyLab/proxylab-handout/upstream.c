@@ -0,0 +1,456 @@
+/*
+ *                     upstream.c
+ *
+ * Idle pool of persistent origin connections, and the response framer
+ * that decides when a connection can go back into it.
+ *
+ * Origins are found through a hash table of (host, port) entries, each
+ * holding a stack of idle connections, most recently parked first, so
+ * the warmest connection is reused and the oldest ones time out. The
+ * table is small and every operation on it is O(1) under one mutex; all
+ * socket calls happen outside of it. A connection handed out by
+ * upstream_get has been checked not to be closed by the origin, but the
+ * origin may still close it before the request arrives, so callers
+ * retry once on a fresh connection if a reused one fails before any of
+ * the response came back.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include "upstream.h"
+
+typedef struct idle_conn {
+    int fd;
+    long since;                   /* When it was parked, in seconds */
+    struct idle_conn *next;
+} idle_conn;
+
+typedef struct origin {
+    char *host;
+    char *port;
+    unsigned int hash;
+    int nidle;                    /* Length of idle */
+    idle_conn *idle;              /* Most recently parked first */
+    struct origin *next;          /* Next origin in the hash bucket */
+} origin;
+
+int upstream_keepalive = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static origin *origins[UPSTREAM_BUCKETS];
+static int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+
+static void *reaper(void *vargp);
+static origin **origin_find(char *host, char *port, unsigned int h);
+static long now_sec(void);
+static int conn_alive(int fd);
+static void framer_line(http_framer *fr);
+
+/*
+ * upstream_init - turn on HTTP/1.1 upstream mode and start reaping idle
+ *     connections after timeout seconds
+ */
+void upstream_init(int timeout)
+{
+    pthread_t tid;
+
+    upstream_keepalive = 1;
+    idle_timeout = timeout;
+    Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/*
+ * upstream_get - take an idle connection to host:port out of the pool;
+ *     returns -1 if there is none
+ */
+int upstream_get(char *host, char *port)
+{
+    unsigned int h = hash_origin(host, port);
+    origin *o;
+    idle_conn *ic;
+    int fd;
+
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        o = *origin_find(host, port, h);
+        if (o == NULL || (ic = o->idle) == NULL) {
+            pthread_mutex_unlock(&pool_lock);
+            return -1;
+        }
+        o->idle = ic->next;
+        o->nidle--;
+        pthread_mutex_unlock(&pool_lock);
+
+        fd = ic->fd;
+        Free(ic);
+        if (conn_alive(fd))
+            return fd;
+        // The origin timed it out first.
+        Close(fd);
+    }
+}
+
+/*
+ * upstream_put - park a connection to host:port whose last response
+ *     has been read completely
+ */
+void upstream_put(char *host, char *port, int fd)
+{
+    unsigned int h = hash_origin(host, port);
+    origin **op, *o;
+    idle_conn *ic;
+
+    ic = Malloc(sizeof(idle_conn));
+    ic->fd = fd;
+    ic->since = now_sec();
+
+    pthread_mutex_lock(&pool_lock);
+    if ((o = *(op = origin_find(host, port, h))) == NULL) {
+        o = Calloc(1, sizeof(origin));
+        o->host = strdup(host);
+        o->port = strdup(port);
+        o->hash = h;
+        o->next = origins[h % UPSTREAM_BUCKETS];
+        origins[h % UPSTREAM_BUCKETS] = o;
+    }
+    if (o->nidle < UPSTREAM_MAX_IDLE) {
+        ic->next = o->idle;
+        o->idle = ic;
+        o->nidle++;
+        ic = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // Enough connections to this origin are idle already.
+    if (ic) {
+        Close(fd);
+        Free(ic);
+    }
+}
+
+/*
+ * reaper - close connections that have been idle for longer than the
+ *     timeout, and forget origins that have none left
+ */
+static void *reaper(void *vargp)
+{
+    origin **op, *o;
+    idle_conn **ip, *ic, *expired;
+    long now;
+    int i;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        sleep(1);
+        now = now_sec();
+        expired = NULL;
+
+        pthread_mutex_lock(&pool_lock);
+        for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+            for (op = &origins[i]; (o = *op) != NULL; ) {
+                for (ip = &o->idle; (ic = *ip) != NULL; ) {
+                    if (now - ic->since >= idle_timeout) {
+                        *ip = ic->next;
+                        o->nidle--;
+                        ic->next = expired;
+                        expired = ic;
+                    } else
+                        ip = &ic->next;
+                }
+                if (o->idle == NULL) {
+                    *op = o->next;
+                    Free(o->host);
+                    Free(o->port);
+                    Free(o);
+                } else
+                    op = &o->next;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        while ((ic = expired) != NULL) {
+            expired = ic->next;
+            Close(ic->fd);
+            Free(ic);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * origin_find - the link that points to the entry for host:port, or
+ *     to where it would be inserted. Call with pool_lock held.
+ */
+static origin **origin_find(char *host, char *port, unsigned int h)
+{
+    origin **op;
+
+    for (op = &origins[h % UPSTREAM_BUCKETS]; *op; op = &(*op)->next)
+        if ((*op)->hash == h && !strcmp((*op)->host, host)
+            && !strcmp((*op)->port, port))
+            break;
+    return op;
+}
+
+static long now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * conn_alive - an idle connection is usable if the origin has neither
+ *     closed it nor sent anything on it
+ */
+static int conn_alive(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * framer_init - get ready for a new response
+ */
+void framer_init(http_framer *fr)
+{
+    fr->state = FRAME_STATUS;
+    fr->status = 0;
+    fr->keepalive = 0;
+    fr->chunked = 0;
+    fr->content_length = -1;
+    fr->remaining = 0;
+    fr->hdr_len = 0;
+    fr->line_len = 0;
+}
+
+/*
+ * framer_feed - follow the response through the next n bytes read from
+ *     the origin; returns how many of them belong to the response, which
+ *     is fewer than n only if it ended in the middle
+ */
+size_t framer_feed(http_framer *fr, char *data, size_t n)
+{
+    size_t i = 0, k;
+    char *nl;
+
+    while (i < n && fr->state != FRAME_DONE) {
+        switch (fr->state) {
+        case FRAME_BODY:
+        case FRAME_CHUNK_DATA:
+            k = n - i;
+            if ((long)k > fr->remaining)
+                k = fr->remaining;
+            i += k;
+            if ((fr->remaining -= k) == 0)
+                fr->state = (fr->state == FRAME_BODY) ? FRAME_DONE
+                                                      : FRAME_CHUNK_END;
+            break;
+        case FRAME_UNTIL_EOF:
+            i = n;
+            break;
+        default:
+            // A line, possibly continued from the previous read. Only
+            // its first FRAME_LINE - 1 bytes matter.
+            nl = memchr(data + i, '\n', n - i);
+            if (fr->state == FRAME_STATUS || fr->state == FRAME_HEADER)
+                fr->hdr_len += (nl ? nl - data + 1 : n) - i;
+            k = (nl ? nl - data : n) - i;
+            if (fr->line_len + k > FRAME_LINE - 1)
+                k = FRAME_LINE - 1 - fr->line_len;
+            memcpy(fr->line + fr->line_len, data + i, k);
+            fr->line_len += k;
+            if (nl == NULL) {
+                i = n;
+                break;
+            }
+            i = nl - data + 1;
+            if (fr->line_len > 0 && fr->line[fr->line_len - 1] == '\r')
+                fr->line_len--;
+            fr->line[fr->line_len] = '\0';
+            fr->line_len = 0;
+            framer_line(fr);
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * framer_dechunk - framer_feed for a client that does not take chunked
+ *     bodies: the chunk-size lines, chunk ends and trailer among the n
+ *     bytes are dropped and the rest moved to the front of data. Returns
+ *     how many bytes are left there, and sets *used to what framer_feed
+ *     would have returned.
+ */
+size_t framer_dechunk(http_framer *fr, char *data, size_t n, size_t *used)
+{
+    size_t i = 0, out = 0, k;
+    enum frame_state st;
+    char *nl;
+
+    while (i < n && fr->state != FRAME_DONE) {
+        // Feed a run of body bytes, or the rest of a line, at a time, so
+        // that all of it is framed the same way.
+        st = fr->state;
+        if (st == FRAME_BODY || st == FRAME_CHUNK_DATA)
+            k = (n - i < (size_t)fr->remaining) ? n - i : fr->remaining;
+        else if (st == FRAME_UNTIL_EOF)
+            k = n - i;
+        else {
+            nl = memchr(data + i, '\n', n - i);
+            k = nl ? nl - (data + i) + 1 : n - i;
+        }
+        k = framer_feed(fr, data + i, k);
+        if (st != FRAME_CHUNK_SIZE && st != FRAME_CHUNK_END
+            && st != FRAME_TRAILER) {
+            if (out != i)
+                memmove(data + out, data + i, k);
+            out += k;
+        }
+        i += k;
+    }
+    *used = i;
+    return out;
+}
+
+/*
+ * framer_want - how many bytes can be read without reading past the
+ *     end of the response, or 0 if the next thing to read is a line
+ *     (or everything up to EOF)
+ */
+size_t framer_want(http_framer *fr)
+{
+    if (fr->state == FRAME_BODY || fr->state == FRAME_CHUNK_DATA)
+        return fr->remaining;
+    return 0;
+}
+
+/*
+ * framer_raw_body - the rest of the response is plain body bytes, at
+ *     least min of them, that can be relayed without being looked at
+ */
+int framer_raw_body(http_framer *fr, size_t min)
+{
+    return fr->state == FRAME_UNTIL_EOF
+        || (fr->state == FRAME_BODY && fr->remaining >= (long)min);
+}
+
+/*
+ * framer_skip - account for n bytes of a plain body that were relayed
+ *     without passing through framer_feed
+ */
+void framer_skip(http_framer *fr, size_t n)
+{
+    if (fr->state == FRAME_BODY && (fr->remaining -= n) <= 0) {
+        fr->remaining = 0;
+        fr->state = FRAME_DONE;
+    }
+}
+
+/*
+ * framer_reusable - the response is complete and the origin will
+ *     accept another request on the same connection
+ */
+int framer_reusable(http_framer *fr)
+{
+    return fr->state == FRAME_DONE && fr->keepalive;
+}
+
+/*
+ * framer_delimited - the header is complete and says where the response
+ *     ends, so the connection it came over need not close to mark it
+ */
+int framer_delimited(http_framer *fr)
+{
+    return framer_header_done(fr) && fr->state != FRAME_UNTIL_EOF;
+}
+
+/*
+ * framer_header_done - a well-formed header block has been seen whole
+ */
+int framer_header_done(http_framer *fr)
+{
+    return fr->status != 0 && fr->state != FRAME_STATUS
+        && fr->state != FRAME_HEADER;
+}
+
+/*
+ * framer_line - act on a complete line of the header, chunk framing or
+ *     trailer
+ */
+static void framer_line(http_framer *fr)
+{
+    char *value;
+    int major, minor;
+    size_t hdr_len;
+
+    switch (fr->state) {
+    case FRAME_STATUS:
+        if (fr->line[0] == '\0')
+            return;
+        if (sscanf(fr->line, "HTTP/%d.%d %d", &major, &minor,
+                   &fr->status) != 3) {
+            fr->state = FRAME_UNTIL_EOF;
+            return;
+        }
+        // HTTP/1.1 connections persist unless either side says close.
+        fr->keepalive = (major > 1 || (major == 1 && minor >= 1));
+        fr->state = FRAME_HEADER;
+        return;
+    case FRAME_HEADER:
+        if (fr->line[0] != '\0') {
+            if (header_is(fr->line, "Content-length", &value))
+                fr->content_length = strtol(value, NULL, 10);
+            else if (header_is(fr->line, "Transfer-Encoding", &value))
+                fr->chunked = header_has_token(value, "chunked");
+            else if (header_is(fr->line, "Connection", &value)) {
+                if (header_has_token(value, "close"))
+                    fr->keepalive = 0;
+                else if (header_has_token(value, "keep-alive"))
+                    fr->keepalive = 1;
+            }
+            return;
+        }
+        // End of the header block: work out how the body is framed.
+        if (fr->status >= 100 && fr->status < 200 && fr->status != 101) {
+            // Interim response; the real one follows, and both count
+            // as the header.
+            hdr_len = fr->hdr_len;
+            framer_init(fr);
+            fr->hdr_len = hdr_len;
+        } else if (fr->status == 204 || fr->status == 304) {
+            fr->state = FRAME_DONE;
+        } else if (fr->chunked) {
+            fr->state = FRAME_CHUNK_SIZE;
+        } else if (fr->content_length >= 0) {
+            fr->remaining = fr->content_length;
+            fr->state = fr->remaining ? FRAME_BODY : FRAME_DONE;
+        } else {
+            fr->keepalive = 0;
+            fr->state = FRAME_UNTIL_EOF;
+        }
+        return;
+    case FRAME_CHUNK_SIZE:
+        fr->remaining = strtol(fr->line, NULL, 16);
+        if (fr->remaining < 0) {
+            fr->keepalive = 0;
+            fr->state = FRAME_UNTIL_EOF;
+        } else
+            fr->state = fr->remaining ? FRAME_CHUNK_DATA : FRAME_TRAILER;
+        return;
+    case FRAME_CHUNK_END:
+        fr->state = FRAME_CHUNK_SIZE;
+        return;
+    case FRAME_TRAILER:
+        if (fr->line[0] == '\0')
+            fr->state = FRAME_DONE;
+        return;
+    default:
+        return;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ *                     upstream.h
+ *
+ * Persistent connections to origin servers. In HTTP/1.1 upstream mode
+ * requests ask the origin to keep the connection open, and once a
+ * response whose end is known from its framing (Content-length or
+ * chunked) has been relayed, the connection is parked in an idle pool
+ * keyed by (host, port). The next request to the same origin takes it
+ * from there and skips both the name lookup and the TCP handshake.
+ * A reaper thread closes connections that stay idle too long.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "proxy.h"
+
+#define UPSTREAM_BUCKETS      256  /* Hash buckets of the origin table */
+#define UPSTREAM_MAX_IDLE     8    /* Idle connections kept per origin */
+#define UPSTREAM_IDLE_TIMEOUT 30   /* Default idle timeout in seconds */
+#define FRAME_LINE            256  /* Header bytes kept per line */
+
+/* Nonzero when requests go upstream as HTTP/1.1 keep-alive */
+extern int upstream_keepalive;
+
+void upstream_init(int idle_timeout);
+int upstream_get(char *host, char *port);
+void upstream_put(char *host, char *port, int fd);
+
+enum frame_state {
+    FRAME_STATUS,       /* Waiting for the status line */
+    FRAME_HEADER,       /* In the header block */
+    FRAME_BODY,         /* In a body of known length */
+    FRAME_CHUNK_SIZE,   /* Waiting for a chunk-size line */
+    FRAME_CHUNK_DATA,   /* In the data of a chunk */
+    FRAME_CHUNK_END,    /* Waiting for the CRLF after chunk data */
+    FRAME_TRAILER,      /* In the trailer after the last chunk */
+    FRAME_UNTIL_EOF,    /* Body ends when the origin closes */
+    FRAME_DONE          /* Response complete */
+};
+
+/*
+ * Follows one response through its bytes, however they are split up
+ * by the reads that deliver them, to find where it ends.
+ */
+typedef struct http_framer {
+    enum frame_state state;
+    int status;                   /* Status code of the response */
+    int keepalive;                /* Origin will keep the connection open */
+    int chunked;                  /* Transfer-Encoding: chunked */
+    long content_length;          /* Content-length, or -1 if not given */
+    long remaining;               /* Bytes left in the body or chunk */
+    size_t hdr_len;               /* Bytes of the header block seen so far */
+    size_t line_len;              /* Bytes of the current line in line */
+    char line[FRAME_LINE];
+} http_framer;
+
+void framer_init(http_framer *fr);
+size_t framer_feed(http_framer *fr, char *data, size_t n);
+size_t framer_dechunk(http_framer *fr, char *data, size_t n, size_t *used);
+size_t framer_want(http_framer *fr);
+int framer_raw_body(http_framer *fr, size_t min);
+void framer_skip(http_framer *fr, size_t n);
+int framer_reusable(http_framer *fr);
+int framer_delimited(http_framer *fr);
+int framer_header_done(http_framer *fr);
+
+#endif /* __UPSTREAM_H__ */
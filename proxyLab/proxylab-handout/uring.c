@@ -0,0 +1,624 @@
+/*
+ *                     uring.c
+ *
+ * io_uring mode of the proxy. Like the epoll reactor it runs a fixed
+ * number of threads that each drive many connections through a state
+ * machine, but a ring thread does not wait for a socket to be ready and
+ * then read or write it: it queues the operation itself as a submission
+ * queue entry (SQE) and is told when it has been done. Accepts, origin
+ * connects, reads and writes are all SQEs, and the ones queued while a
+ * batch of completions is handled go to the kernel together with the
+ * wait for the next batch, in one io_uring_enter. A busy ring thus makes
+ * about one system call per batch rather than several per request.
+ *
+ * Every ring keeps an accept in flight on the shared listening socket,
+ * except while it is out of descriptors (conn_accept_pause), so the
+ * kernel spreads new connections over the rings; sharded ("-R"), every
+ * ring is pinned to a CPU and accepts on a SO_REUSEPORT listener of its
+ * own instead, as reactor.c describes. The request and response
+ * buffers of a ring's first URING_CONNS connections are carved out of
+ * one region registered with the ring, and reads and writes of them are
+ * READ_FIXED and WRITE_FIXED, which do not map the pages again on every
+ * call. Later connections, and all of them if the region could not be
+ * registered, get buffers of their own and plain operations.
+ *
+ * The connections run the state machine in conn.c, which does its I/O
+ * through the ring: a step that needs I/O queues it and returns, and
+ * when the completion arrives the same step runs again and takes the
+ * result instead of queueing. A join waits for its fill through the
+ * ring's eventfd, on which a read is always in flight. Uncached bodies
+ * are copied through the registered buffer, not spliced.
+ *
+ * The wait for completions is bounded by the ring's timing wheel
+ * (IORING_ENTER_EXT_ARG). A connection that times out with an operation
+ * in flight has it cancelled, and acts on the timeout once the
+ * cancelled operation completes, so it never closes a socket the kernel
+ * is still using.
+ *
+ * The rings are set up with the io_uring system calls directly, as
+ * liburing is not assumed to be installed. Where io_uring cannot be set
+ * up at all the proxy runs the epoll reactor instead.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "proxy.h"
+#include "uring.h"
+#include "reactor.h"
+#include "conn.h"
+#include "sysdep.h"
+
+#define URING_ACCEPT 1UL     /* user_data of the accept, not a conn_t */
+#define URING_WAKE   2UL     /* user_data of the eventfd read */
+#define URING_CANCEL 3UL     /* user_data of a timed out op's cancel */
+#define URING_SLOT   ((CONN_IN + CONN_OUT + 63) & ~63)  /* in and buf */
+
+/* A connection with what the ring keeps for it */
+typedef struct ring_conn {
+    conn_t c;
+    int done;                    /* Its op completed, res not yet taken */
+    int res;                     /* Its result, or minus the errno */
+    int fixed;                   /* in and buf are in the registered region */
+    struct msghdr msg;           /* The sendmsg in flight */
+    struct ring_conn *next_free; /* Link on the ring's free list */
+} ring_conn;
+
+typedef struct ring {
+    conn_loop loop;              /* Connections, timers and wakeups */
+    int fd;
+    pthread_t tid;
+    int listenfd;
+    int cpu;                     /* CPU the ring is pinned to, or -1 */
+    unsigned *sq_head;           /* Shared with the kernel */
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;           /* Tail including SQEs not yet submitted */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    int fixed;                   /* region is registered as buffer 0 */
+    char *region;                /* Buffers of the pooled connections */
+    ring_conn *pool;             /* URING_CONNS connections over region */
+    ring_conn *free;             /* Pooled connections not in use */
+    uint64_t evcount;            /* Target of the eventfd read */
+} ring_t;
+
+static ring_t *rings;
+static int nrings;
+static uring_stats stats;        /* Counters, updated once per batch */
+
+static int ring_setup(ring_t *rt, int listenfd);
+static void ring_buffers(ring_t *rt);
+static void *ring_thread(void *vargp);
+static void ring_complete(ring_t *rt, unsigned long data, int res);
+static struct io_uring_sqe *ring_sqe(ring_t *rt);
+static int ring_submit(ring_t *rt, int wait);
+static void queue_accept(ring_t *rt);
+static void queue_wake(ring_t *rt);
+static struct io_uring_sqe *queue_op(conn_t *c, int opcode, int fd);
+static conn_t *conn_new(ring_t *rt, int fd);
+static ssize_t io_read(conn_t *c, int fd, char *data, size_t n);
+static int io_send(conn_t *c, char *data, size_t len, size_t *off);
+static int io_send_iov(conn_t *c, int fd);
+static int io_connect(conn_t *c, struct dns_addr *a);
+static int io_connected(conn_t *c);
+static void io_watch(conn_t *c, int fd);
+static int io_unwatch(conn_t *c, int fd);
+static void io_cancel(conn_t *c);
+static void io_close(conn_t *c);
+static void io_free(conn_t *c);
+static void io_accept(conn_loop *lp);
+
+static const conn_io ring_io = {
+    io_read, io_send, io_send_iov, io_connect, io_connected, io_watch,
+    io_unwatch, NULL, NULL, io_cancel, io_close, io_free, io_accept
+};
+
+/*
+ * uring_run - set up nthreads rings, sharing listenfds[0] or, sharded,
+ *     each pinned to a CPU with listenfds[i] of its own, and run them,
+ *     the last one on this thread; falls back to the epoll reactor if
+ *     io_uring is not there
+ */
+/* $begin uring_run */
+void uring_run(int *listenfds, int nthreads, int sharded)
+{
+    int i;
+
+    rings = Calloc(nthreads, sizeof(ring_t));
+    for (i = 0; i < nthreads; i++) {
+        rings[i].cpu = sharded ? cpu_nth(i) : -1;
+        if (ring_setup(&rings[i], listenfds[sharded ? i : 0]) < 0) {
+            if (i == 0) {
+                log_warn("uring: io_uring unavailable (%s), using epoll",
+                         strerror(errno));
+                Free(rings);
+                rings = NULL;
+                reactor_run(listenfds, nthreads, sharded);
+                return;
+            }
+            unix_error("io_uring_setup error");
+        }
+    }
+    __atomic_store_n(&nrings, nthreads, __ATOMIC_RELEASE);
+    for (i = 0; i < nthreads - 1; i++)
+        Pthread_create(&rings[i].tid, NULL, ring_thread, &rings[i]);
+    ring_thread(&rings[nthreads - 1]);
+}
+/* $end uring_run */
+
+/*
+ * uring_get_stats - sum the counters of the running rings
+ */
+void uring_get_stats(uring_stats *st)
+{
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    st->rings = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    for (i = 0; i < st->rings; i++)
+        st->fixed += __atomic_load_n(&rings[i].fixed, __ATOMIC_RELAXED);
+    st->accepted = __atomic_load_n(&stats.accepted, __ATOMIC_RELAXED);
+    st->ops = __atomic_load_n(&stats.ops, __ATOMIC_RELAXED);
+    st->enters = __atomic_load_n(&stats.enters, __ATOMIC_RELAXED);
+}
+
+/*
+ * ring_setup - create the ring and map its queues, and queue its first
+ *     accept and eventfd read; returns -1 with errno set if there is no
+ *     io_uring
+ */
+static int ring_setup(ring_t *rt, int listenfd)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    unsigned i;
+    int evfd;
+
+    memset(&p, 0, sizeof(p));
+    if ((rt->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_NODROP)
+        || !(p.features & IORING_FEAT_EXT_ARG)) {
+        Close(rt->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    // The SQ and CQ rings share one mapping; the SQEs have their own.
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = Mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rt->fd,
+              IORING_OFF_SQ_RING);
+    cq = sq;
+    rt->sqes = Mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    rt->fd, IORING_OFF_SQES);
+    rt->sq_head = (unsigned *)(sq + p.sq_off.head);
+    rt->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    rt->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    rt->sq_entries = p.sq_entries;
+    rt->sqe_tail = *rt->sq_tail;
+    // SQE i always sits in slot i of the submission ring.
+    for (i = 0; i < p.sq_entries; i++)
+        ((unsigned *)(sq + p.sq_off.array))[i] = i;
+    rt->cq_head = (unsigned *)(cq + p.cq_off.head);
+    rt->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    rt->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    rt->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if ((evfd = eventfd(0, EFD_CLOEXEC)) < 0)
+        unix_error("eventfd error");
+    conn_loop_init(&rt->loop, &ring_io, evfd);
+    rt->listenfd = listenfd;
+    queue_accept(rt);
+    queue_wake(rt);
+    return 0;
+}
+
+/*
+ * ring_buffers - set up the ring's connection pool and register its
+ *     buffers. Called on the ring's own thread, once it is pinned, so
+ *     that the pages are local to its CPU.
+ */
+static void ring_buffers(ring_t *rt)
+{
+    struct iovec region;
+    int i;
+
+    rt->region = Malloc(URING_CONNS * URING_SLOT);
+    rt->pool = Calloc(URING_CONNS, sizeof(ring_conn));
+    for (i = 0; i < URING_CONNS; i++) {
+        rt->pool[i].c.in = rt->region + i * URING_SLOT;
+        rt->pool[i].c.buf = rt->pool[i].c.in + CONN_IN;
+        rt->pool[i].next_free = (i + 1 < URING_CONNS) ? &rt->pool[i + 1]
+                                                      : NULL;
+    }
+    rt->free = rt->pool;
+    region.iov_base = rt->region;
+    region.iov_len = URING_CONNS * URING_SLOT;
+    // Registering pins the pages, which RLIMIT_MEMLOCK may not allow.
+    if (syscall(__NR_io_uring_register, rt->fd, IORING_REGISTER_BUFFERS,
+                &region, 1) == 0)
+        __atomic_store_n(&rt->fixed, 1, __ATOMIC_RELAXED);
+    else
+        log_warn("uring: could not register buffers (%s)", strerror(errno));
+}
+
+/*
+ * ring_thread - event loop of one ring: submit what was queued while
+ *     waiting for at least one completion, then handle every completion
+ *     there is
+ */
+static void *ring_thread(void *vargp)
+{
+    ring_t *rt = (ring_t *)vargp;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    unsigned long data, ops;
+    int res;
+
+    if (rt->cpu >= 0 && (res = cpu_pin(rt->cpu)) != 0)
+        log_warn("uring: could not pin to CPU %d (%s)", rt->cpu,
+                 strerror(res));
+    ring_buffers(rt);
+    while (1) {
+        ring_submit(rt, 1);
+        ops = 0;
+        head = *rt->cq_head;
+        tail = __atomic_load_n(rt->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, ops++) {
+            // Take the entry and give its slot back before handling it.
+            cqe = &rt->cqes[head & rt->cq_mask];
+            data = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(rt->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring_complete(rt, data, res);
+        }
+        __atomic_add_fetch(&stats.ops, ops, __ATOMIC_RELAXED);
+        conn_batch_end(&rt->loop);
+    }
+    return NULL;
+}
+
+/*
+ * ring_complete - handle one completion: a new connection, a wakeup, or
+ *     the end of a connection's operation, which lets it run again
+ */
+static void ring_complete(ring_t *rt, unsigned long data, int res)
+{
+    ring_conn *rc;
+
+    if (data == URING_ACCEPT) {
+        // Out of descriptors, another accept would fail at once too.
+        if (res < 0 && accept_overloaded(-res)) {
+            conn_accept_pause(&rt->loop, -res);
+            return;
+        }
+        queue_accept(rt);
+        if (res < 0 || !conn_admit(res))
+            return;
+        __atomic_add_fetch(&stats.accepted, 1, __ATOMIC_RELAXED);
+        conn_drive(conn_new(rt, res));
+        return;
+    }
+    if (data == URING_WAKE) {
+        queue_wake(rt);
+        conn_run_ready(&rt->loop);
+        return;
+    }
+    if (data == URING_CANCEL)
+        return;
+    rc = (ring_conn *)data;
+    rc->c.busy = 0;
+    if (rc->c.expired) {
+        // Whatever the operation got done, the connection timed out.
+        rc->c.expired = 0;
+        conn_timed_out(&rc->c);
+        return;
+    }
+    rc->done = 1;
+    rc->res = res;
+    conn_drive(&rc->c);
+}
+
+/*
+ * ring_sqe - a cleared SQE at the tail of the submission queue,
+ *     submitting what is queued first if the queue is full
+ */
+static struct io_uring_sqe *ring_sqe(ring_t *rt)
+{
+    struct io_uring_sqe *sqe;
+
+    // Without SQPOLL the kernel consumes every SQE it is handed.
+    while (rt->sqe_tail - __atomic_load_n(rt->sq_head, __ATOMIC_ACQUIRE)
+           >= rt->sq_entries)
+        ring_submit(rt, 0);
+    sqe = &rt->sqes[rt->sqe_tail & rt->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    rt->sqe_tail++;
+    return sqe;
+}
+
+/*
+ * ring_submit - hand the queued SQEs to the kernel, waiting for at least
+ *     one completion if wait is set, or until the next timer is due;
+ *     returns how many were taken
+ */
+static int ring_submit(ring_t *rt, int wait)
+{
+    unsigned n = rt->sqe_tail - *rt->sq_tail;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int rc, ms = wait ? timer_wait_ms(&rt->loop.wheel) : -1;
+
+    memset(&arg, 0, sizeof(arg));
+    if (ms >= 0) {
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        arg.ts = (unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    __atomic_store_n(rt->sq_tail, rt->sqe_tail, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&stats.enters, 1, __ATOMIC_RELAXED);
+    rc = syscall(__NR_io_uring_enter, rt->fd, n, wait ? 1 : 0, flags,
+                 ms >= 0 ? &arg : NULL, ms >= 0 ? sizeof(arg) : 0);
+    // A signal, a timer coming due, or completions the kernel is still
+    // holding back, just send us to the completion queue.
+    if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY
+        && errno != ETIME)
+        unix_error("io_uring_enter error");
+    return rc;
+}
+
+static void queue_accept(ring_t *rt)
+{
+    struct io_uring_sqe *sqe = ring_sqe(rt);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = rt->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+static void queue_wake(ring_t *rt)
+{
+    struct io_uring_sqe *sqe = ring_sqe(rt);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = rt->loop.evfd;
+    sqe->addr = (unsigned long)&rt->evcount;
+    sqe->len = sizeof(rt->evcount);
+    sqe->user_data = URING_WAKE;
+}
+
+/*
+ * queue_op - an SQE for the connection's next operation, on fd
+ */
+static struct io_uring_sqe *queue_op(conn_t *c, int opcode, int fd)
+{
+    struct io_uring_sqe *sqe = ring_sqe((ring_t *)c->loop);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)c;
+    c->busy = 1;
+    return sqe;
+}
+
+/*
+ * conn_new - a connection for the accepted fd, from the ring's pool if
+ *     it has one left
+ */
+static conn_t *conn_new(ring_t *rt, int fd)
+{
+    ring_conn *rc;
+    char *in, *buf;
+
+    if ((rc = rt->free) != NULL) {
+        rt->free = rc->next_free;
+        in = rc->c.in;
+        buf = rc->c.buf;
+        memset(rc, 0, sizeof(*rc));
+        rc->c.in = in;
+        rc->c.buf = buf;
+        rc->fixed = rt->fixed;
+    } else {
+        rc = Calloc(1, sizeof(ring_conn));
+        rc->c.in = Malloc(URING_SLOT);
+        rc->c.buf = rc->c.in + CONN_IN;
+    }
+    conn_init(&rc->c, &rt->loop, fd);
+    return &rc->c;
+}
+
+/*
+ * io_read - read(2) for the state machine: the first call queues the
+ *     read and fails with EAGAIN, the call after its completion returns
+ *     what it read
+ */
+static ssize_t io_read(conn_t *c, int fd, char *data, size_t n)
+{
+    ring_conn *rc = (ring_conn *)c;
+    struct io_uring_sqe *sqe;
+
+    if (!rc->done) {
+        sqe = queue_op(c, rc->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                       fd);
+        sqe->addr = (unsigned long)data;
+        sqe->len = n;
+        errno = EAGAIN;
+        return -1;
+    }
+    rc->done = 0;
+    if (rc->res < 0) {
+        errno = -rc->res;
+        return -1;
+    }
+    return rc->res;
+}
+
+/*
+ * io_send - write data[*off..len) to the client; returns 1 once all of
+ *     it is out, and 0 while a write is in flight or if the connection
+ *     closed. Only buf is in the registered region.
+ */
+static int io_send(conn_t *c, char *data, size_t len, size_t *off)
+{
+    ring_conn *rc = (ring_conn *)c;
+    struct io_uring_sqe *sqe;
+
+    while (*off < len) {
+        if (!rc->done) {
+            if (rc->fixed && data == c->buf)
+                sqe = queue_op(c, IORING_OP_WRITE_FIXED, c->clientfd);
+            else {
+                sqe = queue_op(c, IORING_OP_SEND, c->clientfd);
+                sqe->msg_flags = MSG_NOSIGNAL;
+            }
+            sqe->addr = (unsigned long)(data + *off);
+            sqe->len = len - *off;
+            return 0;
+        }
+        rc->done = 0;
+        if (rc->res == -EINTR)
+            continue;
+        if (rc->res <= 0) {
+            conn_close(c);
+            return 0;
+        }
+        *off += rc->res;
+    }
+    return 1;
+}
+
+/*
+ * io_send_iov - write the pieces left from iov_next to fd, all of them
+ *     in one sendmsg; returns 1 once all are out, 0 while a write is in
+ *     flight, and -1 if it failed
+ */
+static int io_send_iov(conn_t *c, int fd)
+{
+    ring_conn *rc = (ring_conn *)c;
+    struct io_uring_sqe *sqe;
+
+    while (c->niov > 0) {
+        if (!rc->done) {
+            memset(&rc->msg, 0, sizeof(rc->msg));
+            rc->msg.msg_iov = c->iov_next;
+            rc->msg.msg_iovlen = c->niov;
+            sqe = queue_op(c, IORING_OP_SENDMSG, fd);
+            sqe->addr = (unsigned long)&rc->msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            return 0;
+        }
+        rc->done = 0;
+        if (rc->res == -EINTR)
+            continue;
+        if (rc->res < 0)
+            return -1;
+        iov_consume(&c->iov_next, &c->niov, rc->res);
+    }
+    return 1;
+}
+
+/*
+ * io_connect - open a socket for a; io_connected queues the connect
+ *     itself
+ */
+static int io_connect(conn_t *c, struct dns_addr *a)
+{
+    int fd;
+
+    if ((fd = socket(a->family, a->socktype | SOCK_CLOEXEC, a->protocol)) < 0)
+        return -1;
+    c->serverfd = fd;
+    return 0;
+}
+
+/*
+ * io_connected - queue the connect to the current address, and take its
+ *     result once it completes
+ */
+static int io_connected(conn_t *c)
+{
+    ring_conn *rc = (ring_conn *)c;
+    struct io_uring_sqe *sqe;
+    struct dns_addr *a = &c->addrs.addr[c->next_addr];
+
+    if (!rc->done) {
+        sqe = queue_op(c, IORING_OP_CONNECT, c->serverfd);
+        sqe->addr = (unsigned long)&a->addr;
+        sqe->off = a->len;
+        return 0;
+    }
+    rc->done = 0;
+    return rc->res < 0 ? -1 : 1;
+}
+
+/*
+ * io_watch, io_unwatch - a ring only hears of the operations it queued,
+ *     so there is nothing to watch, and a finished origin connection
+ *     may always go back to the pool
+ */
+static void io_watch(conn_t *c, int fd)
+{
+}
+
+static int io_unwatch(conn_t *c, int fd)
+{
+    return 0;
+}
+
+/*
+ * io_cancel - cancel the operation the connection has in flight
+ */
+static void io_cancel(conn_t *c)
+{
+    struct io_uring_sqe *sqe = ring_sqe((ring_t *)c->loop);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)c;
+    sqe->user_data = URING_CANCEL;
+}
+
+static void io_close(conn_t *c)
+{
+}
+
+/*
+ * io_free - return a pooled connection to the pool, or free another
+ */
+static void io_free(conn_t *c)
+{
+    ring_t *rt = (ring_t *)c->loop;
+    ring_conn *rc = (ring_conn *)c;
+
+    if (rc >= rt->pool && rc < rt->pool + URING_CONNS) {
+        rc->next_free = rt->free;
+        rt->free = rc;
+        return;
+    }
+    Free(c->in);
+    Free(c);
+}
+
+/*
+ * io_accept - queue an accept again after a pause
+ */
+static void io_accept(conn_loop *lp)
+{
+    queue_accept((ring_t *)lp);
+}
@@ -0,0 +1,31 @@
+/*
+ *                     uring.h
+ *
+ * io_uring mode of the proxy. A fixed number of ring threads each own
+ * an io_uring instance and drive their connections by submitting every
+ * accept, connect, read and write as a queue entry, in batches. Sharded,
+ * as in the reactor, each ring is pinned to a CPU and has a listener of
+ * its own.
+ *
+ *                  Author: Xin Wang
+ *                  Andrew ID: xinw3
+ *
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#define URING_ENTRIES 256   /* Submission queue entries per ring */
+#define URING_CONNS   128   /* Connections per ring with registered buffers */
+
+typedef struct uring_stats {
+    int rings;                    /* Rings running, 0 outside uring mode */
+    int fixed;                    /* Of them, with registered buffers */
+    unsigned long accepted;       /* Connections accepted */
+    unsigned long ops;            /* Operations completed */
+    unsigned long enters;         /* io_uring_enter calls */
+} uring_stats;
+
+void uring_run(int *listenfds, int nthreads, int sharded);
+void uring_get_stats(uring_stats *st);
+
+#endif /* __URING_H__ */